@@ -5,6 +5,7 @@ include(CMakeFindDependencyMacro)
 ################################################################################
 
 find_dependency(Homa)
+find_dependency(Threads)
 
 ################################################################################
 ## Add target file #############################################################
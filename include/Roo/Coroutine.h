@@ -0,0 +1,428 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_COROUTINE_H
+#define ROO_COROUTINE_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "Roo/Coroutine.h requires C++20 coroutine support"
+#endif
+
+#include <Roo/Roo.h>
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <utility>
+
+namespace Roo {
+
+// Forward declarations
+class CoroutineExecutor;
+
+/**
+ * Return type of a coroutine that can be run by a CoroutineExecutor.
+ *
+ * A Coroutine does not start running until it is passed to
+ * CoroutineExecutor::spawn(); its frame is freed when it returns.
+ *
+ * Example:
+ *
+ *     Roo::Coroutine client(Roo::CoroutineExecutor* executor, ...)
+ *     {
+ *         Roo::unique_ptr<Roo::RooPC> rpc = socket->allocRooPC();
+ *         rpc->send(server, request, length);
+ *         while (Homa::InMessage* response = co_await executor->response(
+ *                    rpc.get())) {
+ *             ...
+ *         }
+ *     }
+ */
+class Coroutine {
+  public:
+    /**
+     * Coroutine state required by the compiler.
+     */
+    struct promise_type {
+        promise_type()
+            : executor(nullptr)
+        {}
+
+        ~promise_type();
+
+        Coroutine get_return_object()
+        {
+            return Coroutine(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+
+        /// Executor running this coroutine; nullptr until spawned.
+        CoroutineExecutor* executor;
+    };
+
+    /// Move constructor
+    Coroutine(Coroutine&& other) noexcept
+        : handle(std::exchange(other.handle, nullptr))
+    {}
+
+    /**
+     * Destroy a Coroutine that was never spawned.
+     */
+    ~Coroutine()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+  private:
+    explicit Coroutine(std::coroutine_handle<promise_type> handle)
+        : handle(handle)
+    {}
+
+    /// Suspended coroutine; empty once ownership passes to an executor.
+    std::coroutine_handle<promise_type> handle;
+
+    friend class CoroutineExecutor;
+
+    // Disable copy and assign
+    Coroutine(const Coroutine&) = delete;
+    Coroutine& operator=(const Coroutine&) = delete;
+    Coroutine& operator=(Coroutine&&) = delete;
+};
+
+/**
+ * Runs Coroutine objects on a single thread, resuming each when the RooPC or
+ * Socket event it is waiting for occurs.
+ *
+ * The executor drives the Socket: run() and runOnce() call Socket::poll() and
+ * the Socket must not be polled by any other thread while coroutines are
+ * suspended on it.  Suspended coroutines cost only their frame so a single
+ * executor can wait on a very large number of RooPCs.
+ *
+ * This class is NOT thread-safe.
+ */
+class CoroutineExecutor {
+  public:
+    /**
+     * Awaitable returned by complete().
+     */
+    class CompleteAwaiter {
+      public:
+        CompleteAwaiter(CoroutineExecutor* executor, RooPC* rpc)
+            : executor(executor)
+            , rpc(rpc)
+        {}
+
+        bool await_ready()
+        {
+            return rpc->checkStatus() != RooPC::Status::IN_PROGRESS;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            CoroutineExecutor* executor = this->executor;
+            rpc->onComplete(
+                [executor, handle](RooPC*) { executor->schedule(handle); });
+        }
+
+        RooPC::Status await_resume()
+        {
+            return rpc->checkStatus();
+        }
+
+      private:
+        /// Executor that will resume the awaiting coroutine.
+        CoroutineExecutor* const executor;
+
+        /// RooPC being waited on.
+        RooPC* const rpc;
+    };
+
+    /**
+     * Awaitable returned by response().
+     */
+    class ResponseAwaiter {
+      public:
+        ResponseAwaiter(CoroutineExecutor* executor, RooPC* rpc)
+            : executor(executor)
+            , rpc(rpc)
+            , response(nullptr)
+            , scheduled(false)
+        {}
+
+        bool await_ready()
+        {
+            response = rpc->receive();
+            if (response != nullptr) {
+                return true;
+            }
+            if (rpc->checkStatus() == RooPC::Status::IN_PROGRESS) {
+                return false;
+            }
+            // A final response may have arrived before the status changed.
+            response = rpc->receive();
+            return true;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            // Either event resumes the coroutine, but only once.
+            RooPC::Callback wake = [this, handle](RooPC*) {
+                if (!scheduled) {
+                    scheduled = true;
+                    executor->schedule(handle);
+                }
+            };
+            rpc->onResponse(wake);
+            rpc->onComplete(std::move(wake));
+        }
+
+        Homa::InMessage* await_resume()
+        {
+            if (scheduled) {
+                // The callbacks refer to this awaiter; unregister them before
+                // it goes away.
+                rpc->onResponse(nullptr);
+                rpc->onComplete(nullptr);
+                response = rpc->receive();
+            }
+            return response;
+        }
+
+      private:
+        /// Executor that will resume the awaiting coroutine.
+        CoroutineExecutor* const executor;
+
+        /// RooPC being waited on.
+        RooPC* const rpc;
+
+        /// Response to return to the awaiting coroutine.
+        Homa::InMessage* response;
+
+        /// True once the awaiting coroutine has been scheduled.
+        bool scheduled;
+    };
+
+    /**
+     * Awaitable returned by receive().
+     */
+    class ReceiveAwaiter {
+      public:
+        explicit ReceiveAwaiter(CoroutineExecutor* executor)
+            : executor(executor)
+            , handle()
+            , task()
+        {}
+
+        bool await_ready()
+        {
+            // Requests are handed out in the order they were awaited.
+            if (!executor->receivers.empty()) {
+                return false;
+            }
+            task = executor->socket->receive();
+            return bool(task);
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            this->handle = handle;
+            executor->receivers.push_back(this);
+        }
+
+        Roo::unique_ptr<ServerTask> await_resume()
+        {
+            return std::move(task);
+        }
+
+      private:
+        /// Executor that will resume the awaiting coroutine.
+        CoroutineExecutor* const executor;
+
+        /// The awaiting coroutine.
+        std::coroutine_handle<> handle;
+
+        /// Request to return to the awaiting coroutine.
+        Roo::unique_ptr<ServerTask> task;
+
+        friend class CoroutineExecutor;
+    };
+
+    /**
+     * Construct an executor.
+     *
+     * @param socket
+     *      Socket on which the executor's coroutines operate.
+     */
+    explicit CoroutineExecutor(Socket* socket)
+        : socket(socket)
+        , ready()
+        , receivers()
+        , active(0)
+    {}
+
+    /**
+     * Destruct the executor.  The executor must not be destroyed while any
+     * of its coroutines are suspended.
+     */
+    ~CoroutineExecutor() = default;
+
+    /**
+     * Start running a coroutine.  The coroutine runs until its first
+     * suspension the next time the executor resumes coroutines.
+     */
+    void spawn(Coroutine coroutine)
+    {
+        std::coroutine_handle<Coroutine::promise_type> handle =
+            std::exchange(coroutine.handle, nullptr);
+        handle.promise().executor = this;
+        active++;
+        schedule(handle);
+    }
+
+    /**
+     * Make incremental progress: poll the Socket and resume each coroutine
+     * whose awaited event has occurred.  Coroutines made ready by the
+     * coroutines resumed here are not resumed until the next call.
+     */
+    void runOnce()
+    {
+        socket->poll();
+        while (!receivers.empty()) {
+            Roo::unique_ptr<ServerTask> task = socket->receive();
+            if (!task) {
+                break;
+            }
+            ReceiveAwaiter* receiver = receivers.front();
+            receivers.pop_front();
+            receiver->task = std::move(task);
+            schedule(receiver->handle);
+        }
+        for (std::size_t count = ready.size(); count > 0; --count) {
+            std::coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+        }
+    }
+
+    /**
+     * Run until every spawned coroutine has returned.
+     */
+    void run()
+    {
+        while (active > 0) {
+            runOnce();
+        }
+    }
+
+    /**
+     * Return the number of spawned coroutines that have not yet returned.
+     */
+    std::size_t size() const
+    {
+        return active;
+    }
+
+    /**
+     * Return an awaitable that suspends the calling coroutine until the RooPC
+     * is COMPLETED or FAILED and evaluates to the RooPC's final status.
+     */
+    CompleteAwaiter complete(RooPC* rpc)
+    {
+        return CompleteAwaiter(this, rpc);
+    }
+
+    /**
+     * Return an awaitable that suspends the calling coroutine until a
+     * response for the RooPC is available and evaluates to the response (as
+     * returned by RooPC::receive()), or to nullptr once the RooPC has finished
+     * and all of its responses have been returned.
+     */
+    ResponseAwaiter response(RooPC* rpc)
+    {
+        return ResponseAwaiter(this, rpc);
+    }
+
+    /**
+     * Return an awaitable that suspends the calling coroutine until an
+     * incoming request is available and evaluates to the request (as returned
+     * by Socket::receive()).
+     */
+    ReceiveAwaiter receive()
+    {
+        return ReceiveAwaiter(this);
+    }
+
+    /**
+     * Arrange for a suspended coroutine to be resumed by the next call to
+     * runOnce().
+     */
+    void schedule(std::coroutine_handle<> handle)
+    {
+        ready.push_back(handle);
+    }
+
+  private:
+    /// Socket on which this executor's coroutines operate.
+    Socket* const socket;
+
+    /// Coroutines ready to be resumed, in the order they became ready.
+    std::deque<std::coroutine_handle<>> ready;
+
+    /// Coroutines waiting in receive(), in the order they started waiting.
+    std::deque<ReceiveAwaiter*> receivers;
+
+    /// Number of spawned coroutines that have not yet returned.
+    std::size_t active;
+
+    friend struct Coroutine::promise_type;
+
+    // Disable copy and assign
+    CoroutineExecutor(const CoroutineExecutor&) = delete;
+    CoroutineExecutor& operator=(const CoroutineExecutor&) = delete;
+};
+
+/**
+ * Release the coroutine's hold on its executor once the coroutine returns.
+ */
+inline Coroutine::promise_type::~promise_type()
+{
+    if (executor != nullptr) {
+        executor->active--;
+    }
+}
+
+}  // namespace Roo
+
+#endif  // ROO_COROUTINE_H
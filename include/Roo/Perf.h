@@ -18,6 +18,7 @@
 
 #include <atomic>
 #include <cstdint>
+#include <vector>
 
 namespace Roo {
 namespace Perf {
@@ -41,6 +42,14 @@ struct Stats {
     /// CPU time spent in the poll() loop doing no work in cycles.
     uint64_t idle_cycles;
 
+    /// Time spent in waitForWork() polling without finding work before
+    /// blocking, in cycles; included in idle_cycles.
+    uint64_t idle_spin_cycles;
+
+    /// Time spent blocked in waitForWork() in cycles; no CPU is used while
+    /// blocked.
+    uint64_t idle_blocked_cycles;
+
     /// Number of application message bytes sent.
     uint64_t tx_message_bytes;
 
@@ -102,11 +111,36 @@ struct Stats {
     uint64_t rx_error_pkts;
 };
 
+/**
+ * Performance statistics for a single ServerTask worker thread (see
+ * Socket::startWorkers()).
+ */
+struct WorkerStats {
+    /// Number of ServerTasks this worker has run.
+    uint64_t tasks;
+
+    /// Number of the ServerTasks run by this worker that were taken from
+    /// other workers' queues.
+    uint64_t steals;
+
+    /// Number of ServerTasks currently queued for this worker.
+    uint64_t queue_depth;
+
+    /// Largest number of ServerTasks queued for this worker at once.
+    uint64_t max_queue_depth;
+};
+
 /**
  * Fill the provided stats structure with the current performance statistics.
  */
 void getStats(Stats* stats);
 
+/**
+ * Replace the contents of the provided vector with the current statistics of
+ * each running ServerTask worker thread, in the order the workers started.
+ */
+void getWorkerStats(std::vector<WorkerStats>* stats);
+
 }  // namespace Perf
 }  // namespace Roo
 
@@ -18,10 +18,12 @@
 
 #include <Homa/Driver.h>
 #include <Homa/Homa.h>
+#include <sys/uio.h>
 
 #include <atomic>
 #include <bitset>
 #include <cstdint>
+#include <functional>
 #include <memory>
 
 namespace Roo {
@@ -47,7 +49,10 @@ using unique_ptr = std::unique_ptr<T, typename T::Deleter>;
  * messages back to the client that initiated the RooPC. A client may also
  * choose it send more than one request in a single RooPC.
  *
- * This class is NOT thread-safe.
+ * This class is NOT thread-safe.  In particular, receive() may run
+ * concurrently with the socket's polling thread but has a single consumer:
+ * it must not be called by more than one thread at a time for the same
+ * RooPC.
  */
 class RooPC {
   public:
@@ -72,6 +77,12 @@ class RooPC {
         FAILED,       // The RooPC has failed to send.
     };
 
+    /**
+     * Function called to notify the application of progress on a RooPC.  The
+     * RooPC that made progress is passed as the argument.
+     */
+    using Callback = std::function<void(RooPC*)>;
+
     /**
      * Send a new request for this RooPC asynchronously.
      *
@@ -85,9 +96,47 @@ class RooPC {
     virtual void send(Homa::Driver::Address destination, const void* request,
                       std::size_t length) = 0;
 
+    /**
+     * Send a new request for this RooPC asynchronously where the request
+     * message is the concatenation of several separate fragments.  Each
+     * fragment is copied directly into the outgoing message.
+     *
+     * @param destination
+     *      The network address to which the request will be sent.
+     * @param fragments
+     *      Array of buffers whose contents, in order, form the request.
+     * @param count
+     *      Number of entries in _fragments_.
+     */
+    virtual void send(Homa::Driver::Address destination,
+                      const struct iovec* fragments, std::size_t count) = 0;
+
+    /**
+     * Send the same request to each of several destinations as part of this
+     * RooPC.  Equivalent to calling send() once per destination but the
+     * request header is only formatted once and the RooPC is only locked
+     * once for the whole batch.
+     *
+     * @param destinations
+     *      Array of network addresses to which the request will be sent.
+     * @param count
+     *      Number of entries in _destinations_.
+     * @param request
+     *      First byte of a buffer contained the request message to be sent.
+     * @param length
+     *      Number of bytes in the request message.
+     */
+    virtual void sendMany(const Homa::Driver::Address destinations[],
+                          std::size_t count, const void* request,
+                          std::size_t length) = 0;
+
     /**
      * Return a received response for this RooPC.
      *
+     * Responses are handed out through a single-consumer queue, so this
+     * method must not be called concurrently for the same RooPC; callers
+     * that share a RooPC between threads must serialize their calls.
+     *
      * @return
      *      Returns an incoming response message, if available; otherwise, a
      *      nullptr is returned.  Ownership of the returned message is NOT
@@ -107,6 +156,35 @@ class RooPC {
      */
     virtual void wait() = 0;
 
+    /**
+     * Register a function to be called once when this RooPC becomes
+     * COMPLETED or FAILED.  If the RooPC has already finished, the function
+     * is called immediately.
+     *
+     * Callbacks are normally invoked by the thread calling Socket::poll(),
+     * without any socket locks held; a callback may use and even destroy the
+     * RooPC but should not block.  Registering a callback replaces any
+     * previously registered completion callback.
+     *
+     * @param callback
+     *      Function to call when the RooPC finishes.
+     */
+    virtual void onComplete(Callback callback) = 0;
+
+    /**
+     * Register a function to be called when new responses become available
+     * to receive().  If undelivered responses are already available, the
+     * function is called immediately.  Several responses that arrive together
+     * may be reported by a single call.
+     *
+     * Callbacks are invoked as described for onComplete().  Registering a
+     * callback replaces any previously registered response callback.
+     *
+     * @param callback
+     *      Function to call when responses arrive.
+     */
+    virtual void onResponse(Callback callback) = 0;
+
   protected:
     /**
      * Destruct this ServerTask and free any associated memory.
@@ -114,6 +192,58 @@ class RooPC {
     virtual void destroy() = 0;
 };
 
+/**
+ * A response message that a ServerTask handler serializes into directly; see
+ * ServerTask::allocReply().
+ *
+ * Only append() is offered: the ServerTask reserves room at the front of the
+ * message for the Roo response header and prepends the header when the
+ * response is sent, so the response reaches the requestor laid out exactly as
+ * if it had been passed to ServerTask::reply().  The underlying message must
+ * not be reserved into, prepended to, sent, or otherwise accessed directly.
+ *
+ * A ReplyBuffer does not own the message; it is only valid until the
+ * matching ServerTask::commitReply() call.
+ */
+class ReplyBuffer {
+  public:
+    /**
+     * Construct a ReplyBuffer that appends to the given message.
+     *
+     * @param message
+     *      Response message reserved by a ServerTask; nullptr for an invalid
+     *      ReplyBuffer.
+     */
+    explicit ReplyBuffer(Homa::OutMessage* message = nullptr)
+        : message(message)
+    {}
+
+    /**
+     * Copy data to the end of the response.
+     *
+     * @param source
+     *      First byte of the data to be appended.
+     * @param count
+     *      Number of bytes to append.
+     */
+    void append(const void* source, std::size_t count)
+    {
+        message->append(source, count);
+    }
+
+    /**
+     * Return true if this ReplyBuffer refers to a response message.
+     */
+    explicit operator bool() const
+    {
+        return message != nullptr;
+    }
+
+  private:
+    /// Response message being filled in; not owned.
+    Homa::OutMessage* message;
+};
+
 /**
  * A handle for an incoming request providing access to the request message and
  * an interface for sending a response or additional requests.
@@ -152,6 +282,30 @@ class ServerTask {
      */
     virtual void reply(const void* response, std::size_t length) = 0;
 
+    /**
+     * Allocate a response message that the caller can serialize directly into
+     * instead of first building the response in a separate buffer.  The
+     * response is not sent until commitReply() is called; no other reply() or
+     * delegate() calls may be made in between.  Calling allocReply() again
+     * before commitReply() is an error; it returns the same message.
+     *
+     * @return
+     *      An empty response to which the response data should be appended;
+     *      appending is the only operation allowed between allocReply() and
+     *      commitReply().  The response's lifetime is tied to this ServerTask.
+     *
+     * @sa commitReply()
+     */
+    virtual ReplyBuffer allocReply() = 0;
+
+    /**
+     * Send the message returned by the previous allocReply() call back to the
+     * initial RooPC requestor.  Equivalent to a reply() call with the
+     * contents of the allocated message.  Calling commitReply() without a
+     * preceding allocReply() is an error and sends nothing.
+     */
+    virtual void commitReply() = 0;
+
     /**
      * Send a message as an additional request for the associated RooPC.
      *
@@ -165,6 +319,56 @@ class ServerTask {
     virtual void delegate(Homa::Driver::Address destination,
                           const void* request, std::size_t length) = 0;
 
+    /**
+     * Send a message made up of several separate fragments as an additional
+     * request for the associated RooPC.  Each fragment is copied directly into
+     * the outgoing message.
+     *
+     * @param destination
+     *      Address to which the new request message should be sent.
+     * @param fragments
+     *      Array of buffers whose contents, in order, form the request.
+     * @param count
+     *      Number of entries in _fragments_.
+     */
+    virtual void delegate(Homa::Driver::Address destination,
+                          const struct iovec* fragments, std::size_t count) = 0;
+
+    /**
+     * Send the same message to each of several destinations as additional
+     * requests for the associated RooPC.  Equivalent to calling delegate()
+     * once per destination but the request header is only formatted once.
+     *
+     * @param destinations
+     *      Array of addresses to which the new request messages should be
+     *      sent.
+     * @param count
+     *      Number of entries in _destinations_.
+     * @param request
+     *      First byte of a buffer contained the request message to be sent.
+     * @param length
+     *      Number of bytes in the request message.
+     */
+    virtual void delegateMany(const Homa::Driver::Address destinations[],
+                              std::size_t count, const void* request,
+                              std::size_t length) = 0;
+
+    /**
+     * Send the incoming request message on as an additional request for the
+     * associated RooPC, optionally preceded by a prefix.  Unlike delegate(),
+     * the caller does not need to stage the whole request in its own buffer.
+     *
+     * @param destination
+     *      Address to which the new request message should be sent.
+     * @param prefix
+     *      First byte of a buffer containing bytes that should precede the
+     *      incoming request's contents in the new request.
+     * @param prefixLength
+     *      Number of bytes in the prefix; may be 0.
+     */
+    virtual void forward(Homa::Driver::Address destination,
+                         const void* prefix, std::size_t prefixLength) = 0;
+
   protected:
     /**
      * Destruct this ServerTask and free any associated memory.
@@ -172,6 +376,88 @@ class ServerTask {
     virtual void destroy() = 0;
 };
 
+/**
+ * Tunable parameters for a Socket.
+ */
+struct SocketOptions {
+    /**
+     * Construct SocketOptions holding the default settings.
+     */
+    SocketOptions()
+        : initialWorryTimeoutUs(2000)
+        , minWorryTimeoutUs(100)
+        , maxWorryTimeoutUs(2000)
+        , worryJitterPercent(10)
+        , taskTimeoutUs(6000)
+        , idleSpinUs(50)
+        , idleBlockUs(1000)
+        , ownPoller(false)
+        , pollerCpu(-1)
+        , responseAffinity(false)
+        , eagerSend(false)
+        , trackCompletions(false)
+    {}
+
+    /// Microseconds a RooPC waits before pinging a peer for which no
+    /// round-trip time has been measured yet.
+    uint64_t initialWorryTimeoutUs;
+
+    /// Lower bound, in microseconds, on the adaptive time a RooPC waits
+    /// before pinging a peer.  The wait is otherwise derived from the
+    /// round-trip times measured to that peer.
+    uint64_t minWorryTimeoutUs;
+
+    /// Upper bound, in microseconds, on the adaptive time a RooPC waits
+    /// before pinging a peer.
+    uint64_t maxWorryTimeoutUs;
+
+    /// Each wait is extended by a random amount of up to this percent of the
+    /// wait so that RooPCs started together do not ping in lockstep.
+    uint32_t worryJitterPercent;
+
+    /// Microseconds a detached ServerTask may go without being pinged before
+    /// it is garbage collected; should be several times maxWorryTimeoutUs.
+    uint64_t taskTimeoutUs;
+
+    /// Microseconds Socket::waitForWork() keeps polling without finding work
+    /// before it blocks.
+    uint64_t idleSpinUs;
+
+    /// Maximum microseconds Socket::waitForWork() blocks before polling
+    /// again; bounds the delay of packets that arrive without a wakeup().
+    uint64_t idleBlockUs;
+
+    /// If true, the Socket runs its own thread that continuously polls the
+    /// transport; Socket::poll() and RooPC::wait() then leave all progress to
+    /// that thread instead of polling from the calling thread.
+    bool ownPoller;
+
+    /// CPU to which the ownPoller thread is pinned; -1 to leave it unpinned.
+    int pollerCpu;
+
+    /// If true, responses and manifests for a RooPC are processed by the
+    /// thread that allocated the RooPC, keeping its state in that thread's
+    /// cache; a message polled by another thread is handed over and handled
+    /// the next time the issuing thread polls.  Each thread must then keep
+    /// polling (e.g. via RooPC::wait()) until its own RooPCs finish.
+    /// Ignored if ownPoller is set.
+    bool responseAffinity;
+
+    /// If true, each ServerTask::reply() and ServerTask::delegate() message is
+    /// sent as soon as it is issued and the ServerTask's manifest follows in a
+    /// separate message once the task is destroyed.  Otherwise, the last
+    /// outbound message is held back until the next reply(), delegate(), or
+    /// the task's destruction so that the manifest can be piggy-backed on it.
+    /// Eager sending trades an extra message per task for not delaying early
+    /// replies by the rest of the handler's run time.
+    bool eagerSend;
+
+    /// If true, finished RooPCs are queued for Socket::pollCompletions().
+    /// Otherwise, pollCompletions() always returns nothing and RooPCs finish
+    /// without touching the socket-wide completion queue.
+    bool trackCompletions;
+};
+
 /**
  * Manages the RooPCs sent and received through a single transport.
  *
@@ -179,20 +465,100 @@ class ServerTask {
  */
 class Socket {
   public:
+    /**
+     * Callback that takes ownership of an incoming request.
+     */
+    using RequestHandler = std::function<void(Roo::unique_ptr<ServerTask>)>;
+
     /**
      * Create a new Socket.
      *
      * @param transport
      *      The transport through which message can be sent and received.  The
      *      created socket assumes exclusive access to this transport.
+     * @param options
+     *      Settings for the created socket.
+     */
+    static std::unique_ptr<Socket> create(
+        Homa::Transport* transport,
+        const SocketOptions& options = SocketOptions());
+
+    /**
+     * Create a new Socket that skips all internal locking.
+     *
+     * The returned socket, and every RooPC and ServerTask it manages, must
+     * only ever be used by a single thread; it does not support
+     * SocketOptions::ownPoller, SocketOptions::responseAffinity or
+     * startWorkers(), and the first two options are ignored.
+     *
+     * @param transport
+     *      The transport through which message can be sent and received.  The
+     *      created socket assumes exclusive access to this transport.
+     * @param options
+     *      Settings for the created socket.
      */
-    static std::unique_ptr<Socket> create(Homa::Transport* transport);
+    static std::unique_ptr<Socket> createSingleThreaded(
+        Homa::Transport* transport,
+        const SocketOptions& options = SocketOptions());
 
     /**
      * Allocate a new RooPC that is managed by this socket.
      */
     virtual Roo::unique_ptr<RooPC> allocRooPC() = 0;
 
+    /**
+     * Allocate multiple new RooPCs that are managed by this socket.
+     *
+     * Equivalent to calling allocRooPC() _count_ times but amortizes the
+     * per-call overhead across the batch.
+     *
+     * @param[out] rpcs
+     *      Array of at least _count_ entries which will be filled with the
+     *      newly allocated RooPCs.  Any RooPCs the first _count_ entries
+     *      still hold are destroyed first.
+     * @param count
+     *      Number of RooPCs to allocate.
+     */
+    virtual void allocRooPCs(Roo::unique_ptr<RooPC> rpcs[],
+                             std::size_t count) = 0;
+
+    /**
+     * Destroy multiple RooPCs that were allocated by this socket.
+     *
+     * Equivalent to resetting each of the provided pointers but amortizes the
+     * per-call overhead across the batch.
+     *
+     * @param rpcs
+     *      Array of _count_ RooPCs to destroy; each entry will be left empty.
+     *      Empty entries are ignored.
+     * @param count
+     *      Number of entries in _rpcs_.
+     */
+    virtual void destroyRooPCs(Roo::unique_ptr<RooPC> rpcs[],
+                               std::size_t count) = 0;
+
+    /**
+     * Return RooPCs that have finished (i.e. become COMPLETED or FAILED)
+     * since they were last returned, in the order they finished.
+     *
+     * Each RooPC is returned at most once; the cost of a call is proportional
+     * to the number of RooPCs returned rather than the number outstanding.
+     * The returned pointers do not transfer ownership; a RooPC that is
+     * destroyed before it is returned is silently removed from the queue.
+     * RooPCs finish as a side effect of poll().  Only tracked if the Socket
+     * was created with SocketOptions::trackCompletions.
+     *
+     * @param[out] completed
+     *      Array of at least _max_ entries; the first N entries will be set
+     *      to finished RooPCs, where N is the return value.
+     * @param max
+     *      Maximum number of RooPCs to return.
+     * @return
+     *      Number of finished RooPCs returned.
+     */
+    virtual std::size_t pollCompletions(RooPC* completed[],
+                                        std::size_t max) = 0;
+
     /**
      * Check for and return an incoming request.
      *
@@ -202,14 +568,106 @@ class Socket {
      */
     virtual Roo::unique_ptr<ServerTask> receive() = 0;
 
+    /**
+     * Check for and return multiple incoming requests.
+     *
+     * @param[out] tasks
+     *      Array of at least _max_ entries; the first N entries will be filled
+     *      with request contexts for incoming requests, where N is the return
+     *      value.  Any ServerTask an overwritten entry still holds is
+     *      released as if its pointer were reset.
+     * @param max
+     *      Maximum number of requests to return.
+     * @return
+     *      Number of incoming requests returned.
+     */
+    virtual std::size_t receive(Roo::unique_ptr<ServerTask> tasks[],
+                                std::size_t max) = 0;
+
+    /**
+     * Register a handler to be invoked for each incoming request.
+     *
+     * Once registered, the handler is called inline on the thread calling
+     * poll() as soon as a request arrives, instead of the request being queued
+     * for receive().  This avoids the hand-off to another thread and should be
+     * used for requests that can be processed quickly; a handler can still
+     * pass long running requests to other threads since it is given ownership
+     * of the ServerTask.
+     *
+     * This method should not be called concurrently with poll().  If the
+     * Socket has its own poller (see SocketOptions::ownPoller), the poller is
+     * paused while the handler is replaced, so this method must not be called
+     * from a handler.
+     *
+     * @param handler
+     *      Callback to invoke for each incoming request; passing an empty
+     *      handler restores the default behavior of queuing requests for
+     *      receive().
+     */
+    virtual void registerHandler(RequestHandler handler) = 0;
+
+    /**
+     * Process incoming requests on a pool of worker threads run by the
+     * Socket.
+     *
+     * Each incoming request is queued for one of the workers, which passes it
+     * to the handler.  A worker whose queue is empty takes requests queued
+     * for other workers so that a slow request does not hold up the requests
+     * queued behind it.  Once started, requests are no longer queued for
+     * receive() or passed to a handler registered with registerHandler().
+     * The workers run until the Socket is destroyed; statistics for each
+     * worker are available from Perf::getWorkerStats().
+     *
+     * This method should be called at most once and, like registerHandler(),
+     * not concurrently with poll().  Sockets created by createSingleThreaded()
+     * log an error and ignore this call.
+     *
+     * @param numWorkers
+     *      Number of worker threads to start.
+     * @param handler
+     *      Callback the workers invoke for each incoming request.
+     * @param firstCpu
+     *      If non-negative, worker i is pinned to CPU firstCpu + i;
+     *      otherwise, the workers are not pinned.
+     */
+    virtual void startWorkers(std::size_t numWorkers, RequestHandler handler,
+                              int firstCpu) = 0;
+
     /**
      * Make incremental progress performing Socket management.
      *
      * This method MUST be called for the Socket to make progress and should
-     * be called frequently to ensure timely progress.
+     * be called frequently to ensure timely progress, unless the Socket has
+     * its own poller (see SocketOptions::ownPoller) in which case this method
+     * does nothing.
      */
     virtual void poll() = 0;
 
+    /**
+     * Make progress like poll() without consuming a core while the Socket is
+     * idle.
+     *
+     * Polls until the Socket does some useful work.  If no work is found
+     * within SocketOptions::idleSpinUs, the calling thread blocks until
+     * wakeup() is called, a RooPC or ServerTask timeout is due, or
+     * SocketOptions::idleBlockUs elapses, and then polls once more.  Callers
+     * should call this method in a loop in place of poll().
+     *
+     * Homa transports do not signal packet arrivals; while the thread is
+     * blocked, arriving messages are delayed by up to idleBlockUs unless the
+     * driver or application calls wakeup() when packets arrive.
+     *
+     * If the Socket has its own poller, this method only yields the calling
+     * thread.
+     */
+    virtual void waitForWork() = 0;
+
+    /**
+     * Wake any thread blocked in waitForWork().  Cheap when no thread is
+     * blocked.  This method is thread-safe.
+     */
+    virtual void wakeup() = 0;
+
     /**
      * Return the driver used to send and received packets for this Socket.
      */
@@ -0,0 +1,89 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef ROO_BITMAP_H
+#define ROO_BITMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace Roo {
+
+/**
+ * A set of small non-negative integers stored as a bitmap that grows as
+ * needed.
+ *
+ * The first 64 bits are stored inline so bitmaps that only hold values less
+ * than 64 never allocate memory.
+ *
+ * This class is NOT thread-safe.
+ */
+class Bitmap {
+  public:
+    /**
+     * Construct an empty Bitmap.
+     */
+    Bitmap()
+        : firstWord(0)
+        , words()
+    {}
+
+    /**
+     * Return true if the bit at the given position is set.
+     */
+    bool test(std::size_t pos) const
+    {
+        if (pos < BITS_PER_WORD) {
+            return (firstWord >> pos) & 1;
+        }
+        std::size_t index = pos / BITS_PER_WORD - 1;
+        if (index >= words.size()) {
+            return false;
+        }
+        return (words[index] >> (pos % BITS_PER_WORD)) & 1;
+    }
+
+    /**
+     * Set the bit at the given position.
+     */
+    void set(std::size_t pos)
+    {
+        if (pos < BITS_PER_WORD) {
+            firstWord |= uint64_t(1) << pos;
+            return;
+        }
+        std::size_t index = pos / BITS_PER_WORD - 1;
+        if (index >= words.size()) {
+            words.resize(index + 1, 0);
+        }
+        words[index] |= uint64_t(1) << (pos % BITS_PER_WORD);
+    }
+
+  private:
+    /// Number of bits held in each word.
+    static const std::size_t BITS_PER_WORD = 64;
+
+    /// Bits 0 through 63.
+    uint64_t firstWord;
+
+    /// Bits 64 and above; bit i is held in words[i / 64 - 1].
+    std::vector<uint64_t> words;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_BITMAP_H
@@ -0,0 +1,63 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "Bitmap.h"
+
+namespace Roo {
+namespace {
+
+TEST(BitmapTest, test)
+{
+    Bitmap bitmap;
+    EXPECT_FALSE(bitmap.test(0));
+    EXPECT_FALSE(bitmap.test(63));
+    EXPECT_FALSE(bitmap.test(64));
+    EXPECT_FALSE(bitmap.test(100000));
+
+    bitmap.firstWord = 0x8000000000000001UL;
+    bitmap.words.push_back(0x2);
+    EXPECT_TRUE(bitmap.test(0));
+    EXPECT_FALSE(bitmap.test(1));
+    EXPECT_TRUE(bitmap.test(63));
+    EXPECT_FALSE(bitmap.test(64));
+    EXPECT_TRUE(bitmap.test(65));
+    EXPECT_FALSE(bitmap.test(128));
+}
+
+TEST(BitmapTest, set)
+{
+    Bitmap bitmap;
+
+    bitmap.set(0);
+    bitmap.set(63);
+    EXPECT_EQ(0x8000000000000001UL, bitmap.firstWord);
+    EXPECT_TRUE(bitmap.words.empty());
+
+    bitmap.set(64);
+    EXPECT_EQ(1U, bitmap.words.size());
+    EXPECT_EQ(0x1UL, bitmap.words[0]);
+
+    bitmap.set(64 * 4 + 3);
+    EXPECT_EQ(4U, bitmap.words.size());
+    EXPECT_EQ(0x8UL, bitmap.words[3]);
+    EXPECT_TRUE(bitmap.test(64 * 4 + 3));
+    EXPECT_FALSE(bitmap.test(64 * 4 + 2));
+}
+
+}  // namespace
+}  // namespace Roo
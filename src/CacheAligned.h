@@ -0,0 +1,78 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_CACHEALIGNED_H
+#define ROO_CACHEALIGNED_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+namespace Roo {
+
+/**
+ * Base class for types that are padded or aligned to cache lines (e.g. with
+ * alignas(CacheAligned::CACHE_LINE_SIZE) members) and allocated with new.
+ *
+ * Before C++17, a new-expression ignores alignment beyond that of
+ * std::max_align_t, which would leave the separately padded fields sharing
+ * cache lines.  Deriving from this class makes new and delete of the derived
+ * type (and arrays of it) use cache line aligned memory.
+ */
+class CacheAligned {
+  public:
+    /// Size of a cache line in bytes.
+    static const std::size_t CACHE_LINE_SIZE = 64;
+
+    static void* operator new(std::size_t size)
+    {
+        return allocate(size);
+    }
+
+    static void* operator new[](std::size_t size)
+    {
+        return allocate(size);
+    }
+
+    static void operator delete(void* ptr) noexcept
+    {
+        std::free(ptr);
+    }
+
+    static void operator delete[](void* ptr) noexcept
+    {
+        std::free(ptr);
+    }
+
+  private:
+    /**
+     * Return cache line aligned memory of at least the given size.
+     *
+     * @throw std::bad_alloc
+     *      If the memory could not be allocated.
+     */
+    static void* allocate(std::size_t size)
+    {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, CACHE_LINE_SIZE, size) != 0) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+};
+
+}  // namespace Roo
+
+#endif  // ROO_CACHEALIGNED_H
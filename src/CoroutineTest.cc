@@ -0,0 +1,237 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <Roo/Coroutine.h>
+
+#include <vector>
+
+#include "Mock/MockHoma.h"
+
+namespace Roo {
+namespace {
+
+using ::testing::_;
+using ::testing::ByMove;
+using ::testing::NiceMock;
+using ::testing::Return;
+using ::testing::SaveArg;
+
+class MockRooPC : public RooPC {
+  public:
+    MOCK_METHOD3(send, void(Homa::Driver::Address destination,
+                            const void* request, std::size_t length));
+    MOCK_METHOD3(send, void(Homa::Driver::Address destination,
+                            const struct iovec* fragments, std::size_t count));
+    MOCK_METHOD4(sendMany,
+                 void(const Homa::Driver::Address destinations[],
+                      std::size_t count, const void* request,
+                      std::size_t length));
+    MOCK_METHOD0(receive, Homa::InMessage*());
+    MOCK_METHOD0(checkStatus, Status());
+    MOCK_METHOD0(wait, void());
+    MOCK_METHOD1(onComplete, void(Callback callback));
+    MOCK_METHOD1(onResponse, void(Callback callback));
+
+  protected:
+    MOCK_METHOD0(destroy, void());
+};
+
+class MockServerTask : public ServerTask {
+  public:
+    MOCK_METHOD0(getRequest, Homa::InMessage*());
+    MOCK_METHOD2(reply, void(const void* response, std::size_t length));
+    MOCK_METHOD0(allocReply, ReplyBuffer());
+    MOCK_METHOD0(commitReply, void());
+    MOCK_METHOD3(delegate, void(Homa::Driver::Address destination,
+                                const void* request, std::size_t length));
+    MOCK_METHOD3(delegate,
+                 void(Homa::Driver::Address destination,
+                      const struct iovec* fragments, std::size_t count));
+    MOCK_METHOD4(delegateMany,
+                 void(const Homa::Driver::Address destinations[],
+                      std::size_t count, const void* request,
+                      std::size_t length));
+    MOCK_METHOD3(forward, void(Homa::Driver::Address destination,
+                               const void* prefix, std::size_t prefixLength));
+
+  protected:
+    MOCK_METHOD0(destroy, void());
+};
+
+class MockSocket : public Socket {
+  public:
+    MOCK_METHOD0(allocRooPC, Roo::unique_ptr<RooPC>());
+    MOCK_METHOD2(allocRooPCs,
+                 void(Roo::unique_ptr<RooPC> rpcs[], std::size_t count));
+    MOCK_METHOD2(destroyRooPCs,
+                 void(Roo::unique_ptr<RooPC> rpcs[], std::size_t count));
+    MOCK_METHOD2(pollCompletions,
+                 std::size_t(RooPC* completed[], std::size_t max));
+    MOCK_METHOD0(receive, Roo::unique_ptr<ServerTask>());
+    MOCK_METHOD2(receive, std::size_t(Roo::unique_ptr<ServerTask> tasks[],
+                                      std::size_t max));
+    MOCK_METHOD1(registerHandler, void(RequestHandler handler));
+    MOCK_METHOD3(startWorkers, void(std::size_t numWorkers,
+                                    RequestHandler handler, int firstCpu));
+    MOCK_METHOD0(poll, void());
+    MOCK_METHOD0(waitForWork, void());
+    MOCK_METHOD0(wakeup, void());
+    MOCK_METHOD0(getDriver, Homa::Driver*());
+};
+
+class CoroutineTest : public ::testing::Test {
+  public:
+    CoroutineTest()
+        : socket()
+        , rpc()
+        , executor(&socket)
+    {}
+
+    NiceMock<MockSocket> socket;
+    NiceMock<MockRooPC> rpc;
+    CoroutineExecutor executor;
+};
+
+Coroutine
+awaitComplete(CoroutineExecutor* executor, RooPC* rpc, RooPC::Status* status)
+{
+    *status = co_await executor->complete(rpc);
+}
+
+Coroutine
+awaitResponses(CoroutineExecutor* executor, RooPC* rpc,
+               std::vector<Homa::InMessage*>* responses)
+{
+    while (Homa::InMessage* response = co_await executor->response(rpc)) {
+        responses->push_back(response);
+    }
+}
+
+Coroutine
+awaitReceive(CoroutineExecutor* executor, ServerTask** received)
+{
+    Roo::unique_ptr<ServerTask> task = co_await executor->receive();
+    *received = task.release();
+}
+
+TEST_F(CoroutineTest, spawn)
+{
+    RooPC::Status status = RooPC::Status::IN_PROGRESS;
+    EXPECT_CALL(rpc, checkStatus())
+        .WillRepeatedly(Return(RooPC::Status::COMPLETED));
+
+    executor.spawn(awaitComplete(&executor, &rpc, &status));
+
+    // Not started until the executor resumes it.
+    EXPECT_EQ(1U, executor.size());
+    EXPECT_EQ(RooPC::Status::IN_PROGRESS, status);
+
+    executor.runOnce();
+    EXPECT_EQ(0U, executor.size());
+    EXPECT_EQ(RooPC::Status::COMPLETED, status);
+}
+
+TEST_F(CoroutineTest, complete)
+{
+    RooPC::Status status = RooPC::Status::NOT_STARTED;
+    RooPC::Callback callback;
+    EXPECT_CALL(rpc, checkStatus())
+        .WillOnce(Return(RooPC::Status::IN_PROGRESS))
+        .WillOnce(Return(RooPC::Status::FAILED));
+    EXPECT_CALL(rpc, onComplete(_)).WillOnce(SaveArg<0>(&callback));
+
+    executor.spawn(awaitComplete(&executor, &rpc, &status));
+    executor.runOnce();
+    EXPECT_EQ(1U, executor.size());
+    ASSERT_TRUE(callback);
+
+    // Resumed by the next runOnce() after the callback.
+    callback(&rpc);
+    EXPECT_EQ(1U, executor.size());
+    executor.runOnce();
+    EXPECT_EQ(0U, executor.size());
+    EXPECT_EQ(RooPC::Status::FAILED, status);
+}
+
+TEST_F(CoroutineTest, response)
+{
+    Mock::Homa::MockInMessage first;
+    Mock::Homa::MockInMessage second;
+    std::vector<Homa::InMessage*> responses;
+    RooPC::Callback responseCallback;
+    RooPC::Callback completeCallback;
+    EXPECT_CALL(rpc, receive())
+        .WillOnce(Return(&first))
+        .WillOnce(Return(nullptr))
+        .WillOnce(Return(&second))
+        .WillOnce(Return(nullptr))
+        .WillOnce(Return(nullptr));
+    EXPECT_CALL(rpc, checkStatus())
+        .WillOnce(Return(RooPC::Status::IN_PROGRESS))
+        .WillOnce(Return(RooPC::Status::COMPLETED));
+    EXPECT_CALL(rpc, onResponse(_))
+        .WillOnce(SaveArg<0>(&responseCallback))
+        .WillOnce(Return());
+    EXPECT_CALL(rpc, onComplete(_))
+        .WillOnce(SaveArg<0>(&completeCallback))
+        .WillOnce(Return());
+
+    executor.spawn(awaitResponses(&executor, &rpc, &responses));
+    executor.runOnce();
+    EXPECT_EQ(std::vector<Homa::InMessage*>({&first}), responses);
+    ASSERT_TRUE(responseCallback);
+
+    // Both callbacks fire but the coroutine is only resumed once.
+    responseCallback(&rpc);
+    completeCallback(&rpc);
+    executor.runOnce();
+    EXPECT_EQ(std::vector<Homa::InMessage*>({&first, &second}), responses);
+
+    // Finished with no more responses.
+    EXPECT_EQ(0U, executor.size());
+}
+
+TEST_F(CoroutineTest, receive)
+{
+    MockServerTask task;
+    ServerTask* first = nullptr;
+    ServerTask* second = nullptr;
+    // The first coroutine finds nothing, the second waits behind it.
+    EXPECT_CALL(socket, receive())
+        .WillOnce(Return(ByMove(Roo::unique_ptr<ServerTask>())))
+        .WillOnce(Return(ByMove(Roo::unique_ptr<ServerTask>(&task))))
+        .WillOnce(Return(ByMove(Roo::unique_ptr<ServerTask>())));
+
+    executor.spawn(awaitReceive(&executor, &first));
+    executor.spawn(awaitReceive(&executor, &second));
+    executor.runOnce();
+    EXPECT_EQ(2U, executor.receivers.size());
+
+    // Requests are handed out in the order they were awaited.
+    executor.runOnce();
+    EXPECT_EQ(&task, first);
+    EXPECT_EQ(nullptr, second);
+    EXPECT_EQ(1U, executor.receivers.size());
+    EXPECT_EQ(1U, executor.size());
+
+    executor.receivers.front()->handle.destroy();
+    executor.receivers.clear();
+    EXPECT_EQ(0U, executor.size());
+}
+
+}  // namespace
+}  // namespace Roo
@@ -17,7 +17,9 @@
 #define ROO_INTRUSIVE_H
 
 #include <cassert>
+#include <cstddef>
 #include <iterator>
+#include <memory>
 
 namespace Roo {
 /**
@@ -479,6 +481,276 @@ class List {
     size_t count;
 };
 
+/**
+ * Chained hash table implementation.
+ *
+ * Each element carries the Node used to chain it into a bucket so inserting
+ * and removing elements never allocates memory; the bucket array is only
+ * reallocated when the table grows beyond one element per bucket.
+ *
+ * Bucket selection uses the low order bits of the hash so Hash should mix the
+ * key well.
+ *
+ * @tparam Key
+ *      Type of the keys; must be equality comparable and copyable.
+ * @tparam ElementType
+ *      Type of the elements held in the table.
+ * @tparam Hash
+ *      Function object that returns a std::size_t hash of a Key.
+ */
+template <typename Key, typename ElementType,
+          typename Hash = typename Key::Hasher>
+class HashTable {
+  public:
+    /**
+     * The intrusive metadata needed to add and remove an element from the
+     * HashTable.
+     */
+    class Node {
+      public:
+        /**
+         * HashTable::Node constructor.
+         *
+         * @param owner
+         *      Pointer to the object of which this Node is a member.
+         */
+        explicit Node(ElementType* owner)
+            : owner(owner)
+            , table(nullptr)
+            , next(nullptr)
+            , key()
+        {}
+
+        /**
+         * HashTable::Node destructor.
+         */
+        ~Node()
+        {
+            // Assert that the Node is cleanly removed from any HashTable.
+            assert(table == nullptr);
+        }
+
+      private:
+        /// Pointer to the element object that this Node represents.
+        ElementType* const owner;
+        /// Pointer to the HashTable to which this Node is currently linked.
+        HashTable* table;
+        /// Pointer to the next Node in the same bucket.
+        Node* next;
+        /// Key under which the element was inserted.
+        Key key;
+
+        friend class HashTable;
+    };
+
+    /**
+     * HashTable constructor.
+     *
+     * @param numBuckets
+     *      Initial number of buckets; must be a power of 2.
+     */
+    explicit HashTable(std::size_t numBuckets = 16)
+        : buckets(new Node*[numBuckets]())
+        , mask(numBuckets - 1)
+        , count(0)
+    {
+        assert(numBuckets > 0);
+        assert((numBuckets & (numBuckets - 1)) == 0);
+    }
+
+    /**
+     * HashTable destructor.
+     */
+    ~HashTable()
+    {
+        clear();
+    }
+
+    /**
+     * Return the element inserted with the given key or nullptr if no such
+     * element is in the HashTable.
+     */
+    ElementType* find(const Key& key) const
+    {
+        for (Node* node = buckets[Hash()(key) & mask]; node != nullptr;
+             node = node->next) {
+            if (node->key == key) {
+                return node->owner;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Insert an element with the given key.  The key must not already be in
+     * the HashTable.
+     *
+     * @param key
+     *      Key under which the element can be found.
+     * @param node
+     *      Node element to be inserted.
+     */
+    void insert(const Key& key, Node* node)
+    {
+        // Ensure the node is not already linked.
+        assert(node->table == nullptr);
+        assert(find(key) == nullptr);
+        if (count > mask) {
+            grow();
+        }
+        node->key = key;
+        node->table = this;
+        link(node);
+        ++count;
+    }
+
+    /**
+     * Remove the node from this HashTable.
+     *
+     * @param node
+     *      Node to be removed from this HashTable.
+     * @return
+     *      True if the node was removed; false if the node was not in this
+     *      HashTable.
+     */
+    bool remove(Node* node)
+    {
+        if (node->table != this) {
+            return false;
+        }
+        Node** link = &buckets[Hash()(node->key) & mask];
+        while (*link != node) {
+            link = &(*link)->next;
+        }
+        *link = node->next;
+        node->next = nullptr;
+        node->table = nullptr;
+        --count;
+        return true;
+    }
+
+    /**
+     * Remove the element with the given key from this HashTable.
+     *
+     * @return
+     *      The removed element or nullptr if no element had the given key.
+     */
+    ElementType* remove(const Key& key)
+    {
+        Node** link = &buckets[Hash()(key) & mask];
+        for (Node* node = *link; node != nullptr; node = *link) {
+            if (node->key == key) {
+                *link = node->next;
+                node->next = nullptr;
+                node->table = nullptr;
+                --count;
+                return node->owner;
+            }
+            link = &node->next;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Call func(element) for every element in the HashTable.  The function
+     * may remove the element it is given (and destroy it) but must not
+     * otherwise modify the HashTable.
+     */
+    template <typename Function>
+    void forEach(Function func)
+    {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            Node* node = buckets[i];
+            while (node != nullptr) {
+                Node* next = node->next;
+                func(node->owner);
+                node = next;
+            }
+        }
+    }
+
+    /**
+     * Remove all linked Nodes from the HashTable.
+     */
+    void clear()
+    {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            while (buckets[i] != nullptr) {
+                Node* node = buckets[i];
+                buckets[i] = node->next;
+                node->next = nullptr;
+                node->table = nullptr;
+            }
+        }
+        count = 0;
+    }
+
+    /**
+     * Check if the HashTable contains no elements.
+     */
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+    /**
+     * Return the number of elements in the HashTable.
+     */
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    /**
+     * Check if the given element is in the HashTable.
+     */
+    bool contains(Node* node) const
+    {
+        return node->table == this;
+    }
+
+  private:
+    /**
+     * Add a node to the front of its bucket (private helper method).
+     */
+    inline void link(Node* node)
+    {
+        Node** bucket = &buckets[Hash()(node->key) & mask];
+        node->next = *bucket;
+        *bucket = node;
+    }
+
+    /**
+     * Double the number of buckets and redistribute the linked Nodes.
+     */
+    void grow()
+    {
+        std::size_t oldSize = mask + 1;
+        std::unique_ptr<Node*[]> old(new Node*[2 * oldSize]());
+        old.swap(buckets);
+        mask = 2 * oldSize - 1;
+        for (std::size_t i = 0; i < oldSize; ++i) {
+            Node* node = old[i];
+            while (node != nullptr) {
+                Node* next = node->next;
+                link(node);
+                node = next;
+            }
+        }
+    }
+
+    /// Array of singly linked chains of Nodes.
+    std::unique_ptr<Node*[]> buckets;
+    /// Number of buckets minus one; used to map a hash to a bucket.
+    std::size_t mask;
+    /// Number of elements in this HashTable.
+    std::size_t count;
+
+    // Disable copy and assign
+    HashTable(const HashTable&) = delete;
+    HashTable& operator=(const HashTable&) = delete;
+};
+
 /**
  * Given an element in a list, move the element forward in the list until
  * the preceding element compares less than or equal to the given element.
@@ -600,5 +600,145 @@ TEST(IntrusiveTest, deprioritize)
     EXPECT_EQ(&foo[0], &(*++it));
 }
 
+
+struct Bar {
+    struct Key {
+        Key(int value = 0)
+            : value(value)
+        {}
+        bool operator==(const Key& other) const
+        {
+            return value == other.value;
+        }
+        struct Hasher {
+            std::size_t operator()(const Key& key) const
+            {
+                return key.value;
+            }
+        };
+        int value;
+    };
+
+    Bar()
+        : tableNode(this)
+    {}
+
+    Intrusive::HashTable<Key, Bar>::Node tableNode;
+};
+
+class IntrusiveHashTableTest : public ::testing::Test {
+  public:
+    IntrusiveHashTableTest()
+        : bar()
+        , table(4)
+    {}
+
+    void populateTable()
+    {
+        // Keys 0 and 4 share bucket 0.
+        table.insert(0, &bar[0].tableNode);
+        table.insert(1, &bar[1].tableNode);
+        table.insert(4, &bar[2].tableNode);
+    }
+
+    Bar bar[6];
+    Intrusive::HashTable<Bar::Key, Bar> table;
+};
+
+TEST_F(IntrusiveHashTableTest, Node_constructor)
+{
+    Bar bar;
+    EXPECT_EQ(&bar, bar.tableNode.owner);
+    EXPECT_EQ(nullptr, bar.tableNode.table);
+    EXPECT_EQ(nullptr, bar.tableNode.next);
+}
+
+TEST_F(IntrusiveHashTableTest, find)
+{
+    populateTable();
+    EXPECT_EQ(&bar[0], table.find(0));
+    EXPECT_EQ(&bar[1], table.find(1));
+    EXPECT_EQ(&bar[2], table.find(4));
+    EXPECT_EQ(nullptr, table.find(8));
+    EXPECT_EQ(nullptr, table.find(2));
+}
+
+TEST_F(IntrusiveHashTableTest, insert)
+{
+    table.insert(0, &bar[0].tableNode);
+    EXPECT_EQ(&table, bar[0].tableNode.table);
+    EXPECT_EQ(&bar[0].tableNode, table.buckets[0]);
+    EXPECT_EQ(1U, table.size());
+
+    table.insert(4, &bar[1].tableNode);
+    EXPECT_EQ(&bar[1].tableNode, table.buckets[0]);
+    EXPECT_EQ(&bar[0].tableNode, bar[1].tableNode.next);
+    EXPECT_EQ(2U, table.size());
+}
+
+TEST_F(IntrusiveHashTableTest, insert_grow)
+{
+    for (int i = 0; i < 5; ++i) {
+        table.insert(i, &bar[i].tableNode);
+    }
+    EXPECT_EQ(7U, table.mask);
+    EXPECT_EQ(5U, table.size());
+    for (int i = 0; i < 5; ++i) {
+        EXPECT_EQ(&bar[i].tableNode, table.buckets[i]);
+        EXPECT_EQ(&bar[i], table.find(i));
+    }
+}
+
+TEST_F(IntrusiveHashTableTest, remove_node)
+{
+    populateTable();
+
+    EXPECT_TRUE(table.remove(&bar[0].tableNode));
+    EXPECT_EQ(nullptr, bar[0].tableNode.table);
+    EXPECT_EQ(nullptr, bar[0].tableNode.next);
+    EXPECT_EQ(&bar[2].tableNode, table.buckets[0]);
+    EXPECT_EQ(nullptr, bar[2].tableNode.next);
+    EXPECT_EQ(2U, table.size());
+
+    EXPECT_FALSE(table.remove(&bar[0].tableNode));
+    EXPECT_EQ(2U, table.size());
+}
+
+TEST_F(IntrusiveHashTableTest, remove_key)
+{
+    populateTable();
+
+    EXPECT_EQ(&bar[2], table.remove(4));
+    EXPECT_FALSE(table.contains(&bar[2].tableNode));
+    EXPECT_EQ(&bar[0].tableNode, table.buckets[0]);
+    EXPECT_EQ(2U, table.size());
+
+    EXPECT_EQ(nullptr, table.remove(4));
+    EXPECT_EQ(2U, table.size());
+}
+
+TEST_F(IntrusiveHashTableTest, forEach)
+{
+    populateTable();
+    int count = 0;
+    table.forEach([&](Bar* element) {
+        table.remove(&element->tableNode);
+        count++;
+    });
+    EXPECT_EQ(3, count);
+    EXPECT_TRUE(table.empty());
+}
+
+TEST_F(IntrusiveHashTableTest, clear)
+{
+    populateTable();
+    table.clear();
+    EXPECT_TRUE(table.empty());
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_FALSE(table.contains(&bar[i].tableNode));
+    }
+    EXPECT_EQ(nullptr, table.find(0));
+}
+
 }  // namespace
 }  // namespace Roo
@@ -0,0 +1,197 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_MPMCQUEUE_H
+#define ROO_MPMCQUEUE_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include "CacheAligned.h"
+
+namespace Roo {
+
+/**
+ * A bounded, lock-free, multi-producer/multi-consumer FIFO queue.
+ *
+ * The queue is a ring of cells where each cell carries a sequence number that
+ * tells producers and consumers whether the cell is ready to be written or
+ * read (see Dmitry Vyukov's bounded MPMC queue).  Producers and consumers only
+ * contend on the cell they are operating on and on the enqueue or dequeue
+ * position, respectively; popping from an empty queue performs no writes.
+ *
+ * Elements are copied in and out of the queue so ElementType should be cheap
+ * to copy (e.g. a pointer).
+ *
+ * The enqueue and dequeue positions sit on separate cache lines, so queues
+ * allocated with new come from CacheAligned memory.
+ *
+ * This class is thread-safe.
+ */
+template <typename ElementType>
+class MpmcQueue : public CacheAligned {
+  public:
+    /**
+     * Construct an empty queue.
+     *
+     * @param capacity
+     *      Maximum number of elements the queue can hold; must be a power of 2
+     *      and at least 2.
+     */
+    explicit MpmcQueue(std::size_t capacity)
+        : cells(new Cell[capacity])
+        , mask(capacity - 1)
+        , enqueuePos(0)
+        , dequeuePos(0)
+    {
+        assert(capacity >= 2);
+        assert((capacity & (capacity - 1)) == 0);
+        for (std::size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Destruct the queue.  Any elements still in the queue are discarded.
+     */
+    ~MpmcQueue()
+    {
+        delete[] cells;
+    }
+
+    /**
+     * Add an element to the back of the queue.
+     *
+     * @param element
+     *      The element to be added.
+     * @return
+     *      True if the element was added; false if the queue was full.
+     */
+    bool push(const ElementType& element)
+    {
+        Cell* cell;
+        std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                // The cell is free; try to claim it.
+                if (enqueuePos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The cell still holds an element from the previous lap.
+                return false;
+            } else {
+                // Another producer claimed the cell first.
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->element = element;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Remove the element at the front of the queue.
+     *
+     * @param[out] element
+     *      Set to the removed element if one was available.
+     * @return
+     *      True if an element was removed; false if the queue was empty.
+     */
+    bool pop(ElementType* element)
+    {
+        Cell* cell;
+        std::size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                // The cell holds an element; try to claim it.
+                if (dequeuePos.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The cell has not been written yet; the queue is empty.
+                return false;
+            } else {
+                // Another consumer claimed the cell first.
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        *element = cell->element;
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Return true if the queue appeared to be empty at some point during the
+     * call; concurrent operations may make the result immediately stale.
+     */
+    bool empty() const
+    {
+        return enqueuePos.load(std::memory_order_relaxed) ==
+               dequeuePos.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Return the maximum number of elements the queue can hold.
+     */
+    std::size_t capacity() const
+    {
+        return mask + 1;
+    }
+
+  private:
+    /**
+     * A single slot in the ring.
+     */
+    struct Cell {
+        /// Encodes whether the cell is ready to be written (sequence equals the
+        /// enqueue position) or read (sequence equals the dequeue position
+        /// plus one) for the current lap of the ring.
+        std::atomic<std::size_t> sequence;
+
+        /// The element held by this cell, if any.
+        ElementType element;
+    };
+
+    /// Ring of cells holding the elements.
+    Cell* const cells;
+
+    /// Capacity minus one; used to map a position to a cell.
+    std::size_t const mask;
+
+    /// Position at which the next element will be added.
+    alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> enqueuePos;
+
+    /// Position from which the next element will be removed.
+    alignas(CACHE_LINE_SIZE) std::atomic<std::size_t> dequeuePos;
+
+    // Disable copy and assign
+    MpmcQueue(const MpmcQueue&) = delete;
+    MpmcQueue& operator=(const MpmcQueue&) = delete;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_MPMCQUEUE_H
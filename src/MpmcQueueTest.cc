@@ -0,0 +1,127 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "MpmcQueue.h"
+
+namespace Roo {
+namespace {
+
+TEST(MpmcQueueTest, constructor)
+{
+    MpmcQueue<int> queue(8);
+    EXPECT_EQ(8U, queue.capacity());
+    EXPECT_TRUE(queue.empty());
+    for (std::size_t i = 0; i < 8; ++i) {
+        EXPECT_EQ(i, queue.cells[i].sequence.load());
+    }
+}
+
+TEST(MpmcQueueTest, constructor_heap)
+{
+    std::unique_ptr<MpmcQueue<int>> queue(new MpmcQueue<int>(8));
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(&queue->enqueuePos) %
+                      CacheAligned::CACHE_LINE_SIZE);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(&queue->dequeuePos) %
+                      CacheAligned::CACHE_LINE_SIZE);
+}
+
+TEST(MpmcQueueTest, push)
+{
+    MpmcQueue<int> queue(2);
+
+    EXPECT_TRUE(queue.push(1));
+    EXPECT_EQ(1, queue.cells[0].element);
+    EXPECT_EQ(1U, queue.cells[0].sequence.load());
+    EXPECT_FALSE(queue.empty());
+
+    EXPECT_TRUE(queue.push(2));
+    EXPECT_EQ(2, queue.cells[1].element);
+
+    // Full
+    EXPECT_FALSE(queue.push(3));
+    EXPECT_EQ(2U, queue.enqueuePos.load());
+}
+
+TEST(MpmcQueueTest, pop)
+{
+    MpmcQueue<int> queue(2);
+    int element = 0;
+
+    // Empty
+    EXPECT_FALSE(queue.pop(&element));
+
+    queue.push(1);
+    queue.push(2);
+
+    EXPECT_TRUE(queue.pop(&element));
+    EXPECT_EQ(1, element);
+    EXPECT_EQ(2U, queue.cells[0].sequence.load());
+
+    // Cell is reusable on the next lap.
+    EXPECT_TRUE(queue.push(3));
+
+    EXPECT_TRUE(queue.pop(&element));
+    EXPECT_EQ(2, element);
+    EXPECT_TRUE(queue.pop(&element));
+    EXPECT_EQ(3, element);
+    EXPECT_FALSE(queue.pop(&element));
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(MpmcQueueTest, concurrent)
+{
+    const int numThreads = 4;
+    const int numElements = 10000;
+    MpmcQueue<int> queue(64);
+    std::atomic<int> consumed(0);
+    std::atomic<long> sum(0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&]() {
+            for (int i = 1; i <= numElements; ++i) {
+                while (!queue.push(i)) {
+                }
+            }
+        });
+        threads.emplace_back([&]() {
+            int element;
+            while (consumed.load() < numThreads * numElements) {
+                if (queue.pop(&element)) {
+                    sum.fetch_add(element);
+                    consumed.fetch_add(1);
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(numThreads * numElements, consumed.load());
+    EXPECT_EQ(numThreads * (long)numElements * (numElements + 1) / 2,
+              sum.load());
+    EXPECT_TRUE(queue.empty());
+}
+
+}  // namespace
+}  // namespace Roo
@@ -0,0 +1,76 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_NULLLOCK_H
+#define ROO_NULLLOCK_H
+
+#include <mutex>
+
+namespace Roo {
+
+/**
+ * A lock that does nothing; stands in for a SpinLock in classes that are
+ * templated on their mutex type when the instance is only ever used by a
+ * single thread, so that the compiler can elide the locking entirely.
+ *
+ * This class implements the C++ "Lockable" named requirement.
+ */
+class NullLock {
+  public:
+    /**
+     * Create a new NullLock.
+     */
+    NullLock() {}
+
+    /**
+     * Does nothing; the caller is assumed to be the only thread.
+     */
+    void lock() {}
+
+    /**
+     * Does nothing; the caller is assumed to be the only thread.
+     *
+     * @return
+     *      Always true.
+     */
+    bool try_lock()
+    {
+        return true;
+    }
+
+    /**
+     * Does nothing; the caller is assumed to be the only thread.
+     */
+    void unlock() {}
+
+    /**
+     * Define a type alias for an RAII NullLock lock_guard for convenience.
+     */
+    using Lock = std::lock_guard<NullLock>;
+
+    /**
+     * Define a type alias for a movable NullLock unique_lock for convenience.
+     */
+    using UniqueLock = std::unique_lock<NullLock>;
+
+  private:
+    // Disable copy and assign
+    NullLock(const NullLock&) = delete;
+    NullLock& operator=(const NullLock&) = delete;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_NULLLOCK_H
@@ -18,8 +18,10 @@
 #include <Homa/Perf.h>
 #include <PerfUtils/Cycles.h>
 
+#include <algorithm>
 #include <mutex>
 #include <unordered_set>
+#include <vector>
 
 namespace Roo {
 namespace Perf {
@@ -41,6 +43,11 @@ Counters globalCounters;
  */
 std::unordered_set<const Counters*> perThreadCounters;
 
+/**
+ * Counters of all running workers in the order they were registered.
+ */
+std::vector<const WorkerCounters*> workerCounters;
+
 }  // namespace Internal
 
 // Init thread local thread counters
@@ -65,6 +72,30 @@ ThreadCounters::~ThreadCounters()
     Internal::perThreadCounters.erase(this);
 }
 
+/**
+ * Construct and register a new set of worker counters.
+ */
+WorkerCounters::WorkerCounters()
+    : tasks(0)
+    , steals(0)
+    , queue_depth(0)
+    , max_queue_depth(0)
+{
+    std::lock_guard<std::mutex> lock(Internal::mutex);
+    Internal::workerCounters.push_back(this);
+}
+
+/**
+ * Deregister and destruct a set of worker counters.
+ */
+WorkerCounters::~WorkerCounters()
+{
+    std::lock_guard<std::mutex> lock(Internal::mutex);
+    Internal::workerCounters.erase(std::find(Internal::workerCounters.begin(),
+                                             Internal::workerCounters.end(),
+                                             this));
+}
+
 /**
  */
 void
@@ -107,5 +138,17 @@ getStats(Stats* stats)
     stats->rx_error_pkts = homa_stats.rx_error_pkts;
 }
 
+/**
+ */
+void
+getWorkerStats(std::vector<WorkerStats>* stats)
+{
+    std::lock_guard<std::mutex> lock(Internal::mutex);
+    stats->resize(Internal::workerCounters.size());
+    for (std::size_t i = 0; i < Internal::workerCounters.size(); ++i) {
+        Internal::workerCounters[i]->dumpStats(&(*stats)[i]);
+    }
+}
+
 }  // namespace Perf
 }  // namespace Roo
@@ -63,6 +63,16 @@ struct Counters {
                         std::memory_order_relaxed);
         }
 
+        /**
+         * Set the value of this Stat.
+         *
+         * This method is NOT thread-safe.
+         */
+        inline void set(T val)
+        {
+            this->store(val, std::memory_order_relaxed);
+        }
+
         /**
          * Return the stat value.
          *
@@ -82,6 +92,8 @@ struct Counters {
         , poll_active_cycles(0)
         , client_api_cycles(0)
         , server_api_cycles(0)
+        , idle_spin_cycles(0)
+        , idle_blocked_cycles(0)
         , tx_message_bytes(0)
         , rx_message_bytes(0)
     {}
@@ -100,6 +112,8 @@ struct Counters {
         poll_active_cycles.add(other->poll_active_cycles);
         client_api_cycles.add(other->client_api_cycles);
         server_api_cycles.add(other->server_api_cycles);
+        idle_spin_cycles.add(other->idle_spin_cycles);
+        idle_blocked_cycles.add(other->idle_blocked_cycles);
         tx_message_bytes.add(other->tx_message_bytes);
         rx_message_bytes.add(other->rx_message_bytes);
     }
@@ -112,6 +126,8 @@ struct Counters {
         stats->api_cycles = client_api_cycles.get() + server_api_cycles.get();
         stats->active_cycles = poll_active_cycles.get();
         stats->idle_cycles = poll_total_cycles.get() - poll_active_cycles.get();
+        stats->idle_spin_cycles = idle_spin_cycles.get();
+        stats->idle_blocked_cycles = idle_blocked_cycles.get();
         stats->tx_message_bytes = tx_message_bytes.get();
         stats->rx_message_bytes = rx_message_bytes.get();
     }
@@ -128,6 +144,12 @@ struct Counters {
     /// CPU time actively executing ServerTask related API calls in cycles.
     Stat<uint64_t> server_api_cycles;
 
+    /// Time polling in waitForWork() without finding work in cycles.
+    Stat<uint64_t> idle_spin_cycles;
+
+    /// Time blocked in waitForWork() in cycles.
+    Stat<uint64_t> idle_blocked_cycles;
+
     /// Number of application message bytes sent.
     Stat<uint64_t> tx_message_bytes;
 
@@ -148,6 +170,38 @@ struct ThreadCounters : public Counters {
  */
 extern thread_local ThreadCounters counters;
 
+/**
+ * Performance counters for a single ServerTask worker; registered for
+ * getWorkerStats() for the lifetime of the object.
+ */
+struct WorkerCounters {
+    WorkerCounters();
+    ~WorkerCounters();
+
+    /**
+     * Export this object's counter values to a WorkerStats structure.
+     */
+    void dumpStats(WorkerStats* stats) const
+    {
+        stats->tasks = tasks.get();
+        stats->steals = steals.get();
+        stats->queue_depth = queue_depth.get();
+        stats->max_queue_depth = max_queue_depth.get();
+    }
+
+    /// Number of ServerTasks the worker has run.
+    Counters::Stat<uint64_t> tasks;
+
+    /// Number of ServerTasks the worker took from other workers.
+    Counters::Stat<uint64_t> steals;
+
+    /// Number of ServerTasks currently queued for the worker.
+    Counters::Stat<uint64_t> queue_depth;
+
+    /// Largest number of ServerTasks queued for the worker at once.
+    Counters::Stat<uint64_t> max_queue_depth;
+};
+
 /**
  * Provides a convenient way to measure multiple consecutive cycle time
  * intervals.
@@ -34,6 +34,26 @@
 namespace Roo {
 namespace Proto {
 
+/**
+ * Return the hash _seed_ updated to include _value_.
+ *
+ * Every bit of the inputs affects every bit of the result (the final mixing
+ * step is the 64-bit finalizer from MurmurHash3) so that the low order bits
+ * of the hash can be used directly to select a hash bucket.
+ */
+inline std::size_t
+hashCombine(std::size_t seed, uint64_t value)
+{
+    uint64_t h = seed ^ (value + 0x9E3779B97F4A7C15UL + (seed << 6) +
+                         (seed >> 2));
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDUL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53UL;
+    h ^= h >> 33;
+    return h;
+}
+
 /**
  * A unique identifier for a Task.
  */
@@ -89,9 +109,8 @@ struct TaskId {
         /// Return a "hash" of the given TaskId.
         std::size_t operator()(const TaskId& taskId) const
         {
-            std::size_t h1 = std::hash<uint64_t>()(taskId.socketId);
-            std::size_t h2 = std::hash<uint64_t>()(taskId.sequence);
-            return h1 ^ (h2 << 1);
+            return hashCombine(hashCombine(0, taskId.socketId),
+                               taskId.sequence);
         }
     };
 } __attribute__((packed));
@@ -156,9 +175,8 @@ struct BranchId {
         /// Return a "hash" of the given BranchId.
         std::size_t operator()(const BranchId& branchId) const
         {
-            std::size_t h1 = TaskId::Hasher()(branchId.taskId);
-            std::size_t h2 = std::hash<uint32_t>()(branchId.sequence);
-            return h1 ^ (h2 << 1);
+            return hashCombine(TaskId::Hasher()(branchId.taskId),
+                               branchId.sequence);
         }
     };
 } __attribute__((packed));
@@ -218,9 +236,8 @@ struct RequestId {
         /// Return a "hash" of the given RequestId.
         std::size_t operator()(const RequestId& requestId) const
         {
-            std::size_t h1 = BranchId::Hasher()(requestId.branchId);
-            std::size_t h2 = std::hash<uint32_t>()(requestId.sequence);
-            return h1 ^ (h2 << 1);
+            return hashCombine(BranchId::Hasher()(requestId.branchId),
+                               requestId.sequence);
         }
     };
 } __attribute__((packed));
@@ -280,9 +297,8 @@ struct ResponseId {
         /// Return a "hash" of the given ResponseId.
         std::size_t operator()(const ResponseId& responseId) const
         {
-            std::size_t h1 = TaskId::Hasher()(responseId.taskId);
-            std::size_t h2 = std::hash<uint32_t>()(responseId.sequence);
-            return h1 ^ (h2 << 1);
+            return hashCombine(TaskId::Hasher()(responseId.taskId),
+                               responseId.sequence);
         }
     };
 } __attribute__((packed));
@@ -20,9 +20,21 @@
 namespace Roo {
 
 std::unique_ptr<Socket>
-Socket::create(Homa::Transport* transport)
+Socket::create(Homa::Transport* transport, const SocketOptions& options)
 {
-    return std::unique_ptr<Socket>(new SocketImpl(transport));
+    return std::unique_ptr<Socket>(new SocketImpl(transport, options));
+}
+
+std::unique_ptr<Socket>
+Socket::createSingleThreaded(Homa::Transport* transport,
+                             const SocketOptions& options)
+{
+    // Both options would add threads that touch the socket.
+    SocketOptions singleThreaded = options;
+    singleThreaded.ownPoller = false;
+    singleThreaded.responseAffinity = false;
+    return std::unique_ptr<Socket>(
+        new BasicSocketImpl<NullLock>(transport, singleThreaded));
 }
 
 }  // namespace Roo
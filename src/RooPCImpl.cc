@@ -15,6 +15,10 @@
 
 #include "RooPCImpl.h"
 
+#include <PerfUtils/Cycles.h>
+
+#include <algorithm>
+
 #include "ControlMessage.h"
 #include "Debug.h"
 #include "Perf.h"
@@ -22,36 +26,66 @@
 
 namespace Roo {
 
+template <typename MutexType>
+const std::size_t BasicRooPCImpl<MutexType>::INLINE_CAPACITY;
+template <typename MutexType>
+const std::size_t BasicRooPCImpl<MutexType>::MAX_SCANNED_PEERS;
+template <typename MutexType>
+const uint32_t BasicRooPCImpl<MutexType>::MAX_TASK_RESPONSES;
+
 /**
  * RooPCImpl constructor.
  */
-RooPCImpl::RooPCImpl(SocketImpl* socket, Proto::RooId rooId)
+template <typename MutexType>
+BasicRooPCImpl<MutexType>::BasicRooPCImpl(SocketImpl* socket,
+                                          Proto::RooId rooId)
     : socket(socket)
     , rooId(rooId)
     , error(false)
     , requestCount(0)
-    , responseQueue()
     , responses()
+    , status(Status::NOT_STARTED)
     , branches()
+    , incompleteBranches()
     , manifestsOutstanding(0)
     , expectedResponses()
     , responsesOutstanding(0)
+    , completeCallback()
+    , responseCallback()
+    , completeNotified(false)
+    , completePending(false)
+    , responsePending(false)
 {}
 
 /**
  * RooPCImpl destructor.
  */
-RooPCImpl::~RooPCImpl() = default;
+template <typename MutexType>
+BasicRooPCImpl<MutexType>::~BasicRooPCImpl() = default;
+
+/**
+ * @copydoc RooPC::send(Homa::Driver::Address, const void*, size_t)
+ */
+template <typename MutexType>
+void
+BasicRooPCImpl<MutexType>::send(Homa::Driver::Address destination,
+                                const void* request, std::size_t length)
+{
+    struct iovec fragment = {const_cast<void*>(request), length};
+    send(destination, &fragment, 1);
+}
 
 /**
- * @copydoc RooPCImpl::send()
+ * @copydoc RooPC::send(Homa::Driver::Address, const iovec*, size_t)
  */
+template <typename MutexType>
 void
-RooPCImpl::send(Homa::Driver::Address destination, const void* request,
-                std::size_t length)
+BasicRooPCImpl<MutexType>::send(Homa::Driver::Address destination,
+                                const struct iovec* fragments,
+                                std::size_t count)
 {
     Perf::Timer timer;
-    SpinLock::Lock lock(mutex);
+    Lock lock(mutex);
     Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
     Homa::Driver::Address replyAddress =
         socket->transport->getDriver()->getLocalAddress();
@@ -62,69 +96,161 @@ RooPCImpl::send(Homa::Driver::Address destination, const void* request,
     socket->transport->getDriver()->addressToWireFormat(
         replyAddress, &outboundHeader.replyAddress);
     message->append(&outboundHeader, sizeof(outboundHeader));
-    message->append(request, length);
+    std::size_t length = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        message->append(fragments[i].iov_base, fragments[i].iov_len);
+        length += fragments[i].iov_len;
+    }
     Perf::counters.tx_message_bytes.add(sizeof(outboundHeader) + length);
 
     // Track spawned branches
-    branches.insert({branchId, {false, requestId, destination, 0}});
+    BranchInfo* branch =
+        branches.insert(branchId, {false, requestId, destination, 0}).first;
+    incompleteBranches.push_back(&branch->incompleteNode);
     manifestsOutstanding++;
+    updateStatus(lock);
 
+    branch->requestCycleTime = PerfUtils::Cycles::rdtsc();
     message->send(destination,
                   Homa::OutMessage::NO_RETRY | Homa::OutMessage::NO_KEEP_ALIVE);
+    // The transport needs the polling thread to finish sending the request.
+    socket->wakeup();
+    Perf::counters.client_api_cycles.add(timer.split());
+}
+
+/**
+ * @copydoc RooPC::sendMany()
+ */
+template <typename MutexType>
+void
+BasicRooPCImpl<MutexType>::sendMany(const Homa::Driver::Address destinations[],
+                                    std::size_t count, const void* request,
+                                    std::size_t length)
+{
+    Perf::Timer timer;
+    Lock lock(mutex);
+
+    // Every request shares the same header except for its BranchId.
+    Proto::RequestHeader outboundHeader(rooId, Proto::RequestId());
+    socket->transport->getDriver()->addressToWireFormat(
+        socket->transport->getDriver()->getLocalAddress(),
+        &outboundHeader.replyAddress);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        Homa::unique_ptr<Homa::OutMessage> message =
+            socket->transport->alloc();
+        Proto::BranchId branchId(rooId, requestCount);
+        requestCount += 1;
+        Proto::RequestId requestId(branchId, 0);
+        outboundHeader.requestId = requestId;
+        message->append(&outboundHeader, sizeof(outboundHeader));
+        message->append(request, length);
+        Perf::counters.tx_message_bytes.add(sizeof(outboundHeader) + length);
+
+        // Track spawned branches
+        BranchInfo* branch =
+            branches.insert(branchId, {false, requestId, destinations[i], 0})
+                .first;
+        incompleteBranches.push_back(&branch->incompleteNode);
+        manifestsOutstanding++;
+
+        branch->requestCycleTime = PerfUtils::Cycles::rdtsc();
+        message->send(destinations[i], Homa::OutMessage::NO_RETRY |
+                                           Homa::OutMessage::NO_KEEP_ALIVE);
+    }
+    updateStatus(lock);
+
+    // The transport needs the polling thread to finish sending the requests.
+    socket->wakeup();
     Perf::counters.client_api_cycles.add(timer.split());
 }
 
 /**
  * @copydoc RooPCImpl::receive()
  */
+template <typename MutexType>
 Homa::InMessage*
-RooPCImpl::receive()
+BasicRooPCImpl<MutexType>::receive()
 {
     Perf::Timer timer;
-    SpinLock::Lock lock(mutex);
-    Homa::InMessage* response = nullptr;
-    if (!responseQueue.empty()) {
-        response = responseQueue.front();
-        responseQueue.pop_front();
-        Perf::counters.client_api_cycles.add(timer.split());
+    Homa::unique_ptr<Homa::InMessage>* response = responses.pop();
+    if (response == nullptr) {
+        return nullptr;
     }
-    return response;
+    Perf::counters.client_api_cycles.add(timer.split());
+    return response->get();
 }
 
 /**
  * @copydoc RooPCImpl::checkStatus()
  */
+template <typename MutexType>
 RooPC::Status
-RooPCImpl::checkStatus()
+BasicRooPCImpl<MutexType>::checkStatus()
 {
-    SpinLock::Lock lock(mutex);
-    if (requestCount == 0) {
-        return Status::NOT_STARTED;
-    } else if (manifestsOutstanding == 0 && responsesOutstanding == 0) {
-        return Status::COMPLETED;
-    } else if (error) {
-        return Status::FAILED;
-    } else {
-        return Status::IN_PROGRESS;
-    }
+    return status.load(std::memory_order_acquire);
 }
 
 /**
  * @copydoc RooPCImpl::wait()
  */
+template <typename MutexType>
 void
-RooPCImpl::wait()
+BasicRooPCImpl<MutexType>::wait()
 {
     while (checkStatus() == Status::IN_PROGRESS) {
         socket->poll();
     }
 }
 
+/**
+ * @copydoc RooPCImpl::onComplete()
+ */
+template <typename MutexType>
+void
+BasicRooPCImpl<MutexType>::onComplete(Callback callback)
+{
+    Callback finished;
+    {
+        Lock lock(mutex);
+        completeCallback = std::move(callback);
+        // If the finish is still pending, invokeCallbacks() will call the
+        // new callback instead.
+        if (completeNotified && !completePending) {
+            finished = completeCallback;
+        }
+    }
+    if (finished) {
+        finished(this);
+    }
+}
+
+/**
+ * @copydoc RooPCImpl::onResponse()
+ */
+template <typename MutexType>
+void
+BasicRooPCImpl<MutexType>::onResponse(Callback callback)
+{
+    Callback arrived;
+    {
+        Lock lock(mutex);
+        responseCallback = std::move(callback);
+        if (responseCallback && responses.available() > 0) {
+            arrived = responseCallback;
+        }
+    }
+    if (arrived) {
+        arrived(this);
+    }
+}
+
 /**
  * @copydoc RooPCImpl::destroy()
  */
+template <typename MutexType>
 void
-RooPCImpl::destroy()
+BasicRooPCImpl<MutexType>::destroy()
 {
     Perf::Timer timer;
     // Don't actually free the object yet.  Return contol to the managing
@@ -141,13 +267,27 @@ RooPCImpl::destroy()
  * @param message
  *      The incoming response message to add.
  */
+template <typename MutexType>
 void
-RooPCImpl::handleResponse(Proto::ResponseHeader* header,
-                          Homa::unique_ptr<Homa::InMessage> message)
+BasicRooPCImpl<MutexType>::handleResponse(
+    Proto::ResponseHeader* header, Homa::unique_ptr<Homa::InMessage> message)
 {
-    SpinLock::Lock lock(mutex);
+    Lock lock(mutex);
     message->strip(sizeof(Proto::ResponseHeader));
 
+    // Measure the round-trip time of a request answered directly by the
+    // server to which it was sent.
+    if (header->manifestImplied) {
+        BranchInfo* branch = branches.find(header->branchId);
+        if (branch != nullptr && branch->requestCycleTime != 0 &&
+            branch->pingReceiverId.sequence == 0) {
+            socket->recordRtt(
+                branch->pingAddress,
+                PerfUtils::Cycles::rdtsc() - branch->requestCycleTime);
+            branch->requestCycleTime = 0;
+        }
+    }
+
     // Process an implied manifiest if available.
     if (header->manifestImplied) {
         // Mark manifest received.
@@ -160,22 +300,34 @@ RooPCImpl::handleResponse(Proto::ResponseHeader* header,
     }
 
     // Process the incoming response message.
-    auto ret = expectedResponses.insert({header->responseId, true});
-    if (ret.second) {
+    const uint32_t sequence = header->responseId.sequence;
+    if (sequence >= MAX_TASK_RESPONSES) {
+        WARNING("Response %u out of range for RooPC (%lu, %lu); RooPC failed.",
+                sequence, rooId.socketId, rooId.sequence);
+        error = true;
+        completePending |= takeCompletion(lock);
+        return;
+    }
+    TaskResponses* task =
+        expectedResponses.insert(header->responseId.taskId, {}).first;
+    if (!task->tracked.test(sequence)) {
         // New unanticipated response received.
-        responseQueue.push_back(message.get());
-        responses.push_back(std::move(message));
-    } else if (ret.first->second == false) {
+        task->tracked.set(sequence);
+        task->received.set(sequence);
+        responses.push(std::move(message));
+        responsePending |= static_cast<bool>(responseCallback);
+    } else if (!task->received.test(sequence)) {
         // Expected response received.
-        ret.first->second = true;
+        task->received.set(sequence);
         responsesOutstanding--;
-        responseQueue.push_back(message.get());
-        responses.push_back(std::move(message));
+        responses.push(std::move(message));
+        responsePending |= static_cast<bool>(responseCallback);
     } else {
         // Response already received
         NOTICE("Duplicate response received for RooPC (%lu, %lu)",
                rooId.socketId, rooId.sequence);
     }
+    completePending |= takeCompletion(lock);
 }
 
 /**
@@ -186,11 +338,12 @@ RooPCImpl::handleResponse(Proto::ResponseHeader* header,
  * @param message
  *      The incoming message containing the Manifest.
  */
+template <typename MutexType>
 void
-RooPCImpl::handleManifest(Proto::ManifestHeader* header,
-                          Homa::unique_ptr<Homa::InMessage> message)
+BasicRooPCImpl<MutexType>::handleManifest(
+    Proto::ManifestHeader* header, Homa::unique_ptr<Homa::InMessage> message)
 {
-    SpinLock::Lock lock(mutex);
+    Lock lock(mutex);
     std::size_t offest = sizeof(Proto::ManifestHeader);
     for (size_t i = 0; i < header->manifestCount; ++i) {
         Proto::Manifest manifest;
@@ -198,6 +351,7 @@ RooPCImpl::handleManifest(Proto::ManifestHeader* header,
                      sizeof(Proto::Manifest));
         processManifest(&manifest, lock);
     }
+    completePending |= takeCompletion(lock);
 }
 
 /**
@@ -208,22 +362,27 @@ RooPCImpl::handleManifest(Proto::ManifestHeader* header,
  * @param message
  *      The incoming message containing the Pong.
  */
+template <typename MutexType>
 void
-RooPCImpl::handlePong(Proto::PongHeader* header,
-                      Homa::unique_ptr<Homa::InMessage> message)
+BasicRooPCImpl<MutexType>::handlePong(Proto::PongHeader* header,
+                                      Homa::unique_ptr<Homa::InMessage> message)
 {
-    SpinLock::Lock lock(mutex);
+    Lock lock(mutex);
     message->strip(sizeof(Proto::PongHeader));
     const Proto::RequestId requestId = header->requestId;
 
-    auto it = branches.find(requestId.branchId);
-    if (it == branches.end()) {
+    BranchInfo* branch = branches.find(requestId.branchId);
+    if (branch == nullptr) {
         WARNING("Unexpected PONG from RequestId %s; PONG dropped.",
                 requestId.toString().c_str());
         return;
     }
 
-    BranchInfo* branch = &it->second;
+    if (branch->pingCycleTime != 0) {
+        socket->recordRtt(branch->pingAddress,
+                          PerfUtils::Cycles::rdtsc() - branch->pingCycleTime);
+        branch->pingCycleTime = 0;
+    }
     branch->pingTimeouts = 0;
 
     if (header->taskComplete && !header->branchComplete) {
@@ -244,6 +403,7 @@ RooPCImpl::handlePong(Proto::PongHeader* header,
             if (updated) {
                 assert(!branch->complete);
                 // Send ping to updated ping target
+                branch->pingCycleTime = PerfUtils::Cycles::rdtsc();
                 ControlMessage::send<Proto::PingHeader>(socket->transport,
                                                         branch->pingAddress,
                                                         branch->pingReceiverId);
@@ -256,9 +416,7 @@ RooPCImpl::handlePong(Proto::PongHeader* header,
         if (branch->complete) {
             // Nothing to do.
         } else if (header->branchComplete) {
-            // Mark branch complete.
-            branch->complete = true;
-            manifestsOutstanding--;
+            markBranchComplete(branch, lock);
         }
 
         // Update child branches
@@ -274,21 +432,25 @@ RooPCImpl::handlePong(Proto::PongHeader* header,
             BranchInfo* const info = ret.first;
             if (ret.second) {
                 // Send ping to updated ping target
+                info->pingCycleTime = PerfUtils::Cycles::rdtsc();
                 ControlMessage::send<Proto::PingHeader>(
                     socket->transport, info->pingAddress, info->pingReceiverId);
             }
         }
 
         // Update expected responses.
-        for (uint32_t i = 0; i < header->responseCount; ++i) {
-            Proto::ResponseId responseId(header->taskId, i);
-            auto checkResponse = expectedResponses.insert({responseId, false});
-            if (checkResponse.second) {
-                // Response not yet tracked.
-                responsesOutstanding++;
+        if (header->responseCount > MAX_TASK_RESPONSES) {
+            WARNING("PONG reports %u responses for RooPC (%lu, %lu); RooPC "
+                    "failed.",
+                    header->responseCount, rooId.socketId, rooId.sequence);
+            error = true;
+        } else {
+            for (uint32_t i = 0; i < header->responseCount; ++i) {
+                expectResponse(Proto::ResponseId(header->taskId, i), lock);
             }
         }
     }
+    completePending |= takeCompletion(lock);
 }
 
 /**
@@ -299,14 +461,16 @@ RooPCImpl::handlePong(Proto::PongHeader* header,
  * @param message
  *      The incoming message containing the Error.
  */
+template <typename MutexType>
 void
-RooPCImpl::handleError(Proto::ErrorHeader* header,
-                       Homa::unique_ptr<Homa::InMessage> message)
+BasicRooPCImpl<MutexType>::handleError(
+    Proto::ErrorHeader* header, Homa::unique_ptr<Homa::InMessage> message)
 {
-    SpinLock::Lock lock(mutex);
+    Lock lock(mutex);
     (void)header;
     (void)message;
     error = true;
+    completePending |= takeCompletion(lock);
 }
 
 /**
@@ -315,40 +479,40 @@ RooPCImpl::handleError(Proto::ErrorHeader* header,
  * @return
  *      True if the RooPC timeout should be reset; false, otherwise.
  */
+template <typename MutexType>
 bool
-RooPCImpl::handleTimeout()
+BasicRooPCImpl<MutexType>::handleTimeout()
 {
-    SpinLock::Lock lock(mutex);
+    Lock lock(mutex);
     if (manifestsOutstanding > 0) {
-        // Ping branches for which we don't have manifests.
-
-        std::unordered_map<Proto::RequestId, Homa::Driver::Address,
-                           Proto::RequestId::Hasher>
-            pingCandidates;
-        for (auto& it : branches) {
-            BranchInfo* info = &it.second;
-
-            // Check if the branch is still in progress.
-            if (info->complete) {
-                // nothing to do
-                continue;
-            }
-
-            // Check if the branch has timed out
-            if (info->pingTimeouts > 3) {
+        // Ping branches for which we don't have manifests; branches often
+        // share a ping target, which is only pinged once.
+        SmallMap<Proto::RequestId, bool, MAX_SCANNED_PEERS> pinged;
+        const uint64_t now = PerfUtils::Cycles::rdtsc();
+        for (BranchInfo& info : incompleteBranches) {
+            assert(!info.complete);
+
+            // Check if the branch has timed out.  The worry timeout adapts to
+            // measured round-trip times, so also require a fixed amount of
+            // time without a pong before giving up on the branch.
+            if (info.pingTimeouts > 3 &&
+                now - info.firstPingCycleTime >= socket->pingFailureCycles) {
                 error = true;
+                completePending |= takeCompletion(lock);
                 return false;
             }
+            if (info.pingTimeouts == 0) {
+                info.firstPingCycleTime = now;
+            }
+            info.pingTimeouts++;
 
-            // Add to the list of pings that need to be sent.
-            pingCandidates.insert({info->pingReceiverId, info->pingAddress});
-            info->pingTimeouts++;
-        }
-
-        // Send out the pings
-        for (auto& it : pingCandidates) {
-            ControlMessage::send<Proto::PingHeader>(socket->transport,
-                                                    it.second, it.first);
+            if (!pinged.insert(info.pingReceiverId, true).second) {
+                continue;
+            }
+            // A pong can only be timed if it answers the sole outstanding ping.
+            info.pingCycleTime = info.pingTimeouts == 1 ? now : 0;
+            ControlMessage::send<Proto::PingHeader>(
+                socket->transport, info.pingAddress, info.pingReceiverId);
         }
 
         return true;
@@ -356,6 +520,7 @@ RooPCImpl::handleTimeout()
         // All tasks are complete but the responses haven't come in yet.
         // Consider the responses lost and generate an error.
         error = true;
+        completePending |= takeCompletion(lock);
         return false;
     } else {
         // All manifests and responses have been received.
@@ -363,6 +528,154 @@ RooPCImpl::handleTimeout()
     }
 }
 
+/**
+ * Return true if this RooPC has callbacks waiting to be invoked by
+ * invokeCallbacks().
+ */
+template <typename MutexType>
+bool
+BasicRooPCImpl<MutexType>::callbacksPending()
+{
+    Lock lock(mutex);
+    return completePending || responsePending;
+}
+
+/**
+ * Invoke the callbacks for any progress this RooPC has made since the last
+ * call.  Must be called without holding any socket locks since the callbacks
+ * may call back into the RooPC or socket.
+ *
+ * @return
+ *      True if this call reported that the RooPC finished; this is true for
+ *      exactly one call whether or not a completion callback is registered.
+ */
+template <typename MutexType>
+bool
+BasicRooPCImpl<MutexType>::invokeCallbacks()
+{
+    Callback arrived;
+    Callback finished;
+    bool reported = false;
+    {
+        Lock lock(mutex);
+        if (responsePending) {
+            responsePending = false;
+            arrived = responseCallback;
+        }
+        if (completePending) {
+            completePending = false;
+            finished = completeCallback;
+            reported = true;
+        }
+    }
+    if (arrived) {
+        arrived(this);
+    }
+    if (finished) {
+        finished(this);
+    }
+    return reported;
+}
+
+/**
+ * Return the number of cycles this RooPC should wait before its next
+ * timeout; the longest worry timeout among the peers it is waiting on.
+ */
+template <typename MutexType>
+uint64_t
+BasicRooPCImpl<MutexType>::worryTimeout()
+{
+    Lock lock(mutex);
+    if (incompleteBranches.empty()) {
+        return socket->worryTimeout();
+    }
+    // Branches of a fan-out usually share a few peers; look each peer up only
+    // once.  Peers beyond the first MAX_SCANNED_PEERS distinct ones are
+    // looked up without deduplication.
+    SmallVector<Homa::Driver::Address, MAX_SCANNED_PEERS> peers;
+    uint64_t timeout = 0;
+    for (BranchInfo& info : incompleteBranches) {
+        bool seen = false;
+        for (std::size_t i = 0; i < peers.size() && !seen; ++i) {
+            seen = peers[i] == info.pingAddress;
+        }
+        if (seen) {
+            continue;
+        }
+        if (peers.size() < MAX_SCANNED_PEERS) {
+            peers.push_back(info.pingAddress);
+        }
+        timeout = std::max(timeout, socket->worryTimeout(info.pingAddress));
+    }
+    return timeout;
+}
+
+/**
+ * Recompute the status returned by checkStatus(); must be called after any
+ * change to the state the status summarizes.
+ *
+ * @param lock
+ *      Reminds the caller that the RooPCImpl::mutex should be held.
+ */
+template <typename MutexType>
+void
+BasicRooPCImpl<MutexType>::updateStatus(const Lock& lock)
+{
+    (void)lock;
+    Status current;
+    if (requestCount == 0) {
+        current = Status::NOT_STARTED;
+    } else if (manifestsOutstanding == 0 && responsesOutstanding == 0) {
+        current = Status::COMPLETED;
+    } else if (error) {
+        current = Status::FAILED;
+    } else {
+        current = Status::IN_PROGRESS;
+    }
+    // Release so a reader that sees the new status also sees the responses
+    // that led to it.
+    status.store(current, std::memory_order_release);
+}
+
+/**
+ * Return true if this RooPC is COMPLETED or FAILED.
+ *
+ * @param lock
+ *      Reminds the caller that the RooPCImpl::mutex should be held.
+ */
+template <typename MutexType>
+bool
+BasicRooPCImpl<MutexType>::isFinished(const Lock& lock)
+{
+    (void)lock;
+    return requestCount > 0 &&
+           ((manifestsOutstanding == 0 && responsesOutstanding == 0) || error);
+}
+
+/**
+ * Check whether this RooPC has just finished; i.e. it has finished and the
+ * finish has not already been claimed.  If so, the finish is claimed so that
+ * it is only reported once.  Also publishes the status for checkStatus().
+ *
+ * @param lock
+ *      Reminds the caller that the RooPCImpl::mutex should be held.
+ * @return
+ *      True if the caller should arrange for the finish to be reported by
+ *      invokeCallbacks().
+ */
+template <typename MutexType>
+bool
+BasicRooPCImpl<MutexType>::takeCompletion(const Lock& lock)
+{
+    // Every state change is followed by a call to this method.
+    updateStatus(lock);
+    if (completeNotified || !isFinished(lock)) {
+        return false;
+    }
+    completeNotified = true;
+    return true;
+}
+
 /**
  * Helper method to update information about where pings for this branch should
  * be sent with the provided information if the provided information is more
@@ -378,10 +691,11 @@ RooPCImpl::handleTimeout()
  *      up-to-date.
  *
  */
+template <typename MutexType>
 bool
-RooPCImpl::BranchInfo::updatePingTarget(Proto::BranchId branchId,
-                                        Proto::RequestId updatedId,
-                                        Homa::Driver::Address updatedAddress)
+BasicRooPCImpl<MutexType>::BranchInfo::updatePingTarget(
+    Proto::BranchId branchId, Proto::RequestId updatedId,
+    Homa::Driver::Address updatedAddress)
 {
     // Check if the ping target needs to be updated.
     // This can occur if:
@@ -421,9 +735,10 @@ RooPCImpl::BranchInfo::updatePingTarget(Proto::BranchId branchId,
  * @param lock
  *      Reminds the caller that the RooPCImpl::mutex should be held.
  */
+template <typename MutexType>
 void
-RooPCImpl::processManifest(Proto::Manifest* manifest,
-                           const SpinLock::Lock& lock)
+BasicRooPCImpl<MutexType>::processManifest(Proto::Manifest* manifest,
+                                           const Lock& lock)
 {
     (void)lock;
 
@@ -438,19 +753,66 @@ RooPCImpl::processManifest(Proto::Manifest* manifest,
     }
 
     // Add expected responses.
+    if (manifest->responseCount > MAX_TASK_RESPONSES) {
+        WARNING("Manifest reports %u responses for RooPC (%lu, %lu); RooPC "
+                "failed.",
+                manifest->responseCount, rooId.socketId, rooId.sequence);
+        error = true;
+        return;
+    }
     for (uint64_t i = 0; i < manifest->responseCount; ++i) {
-        Proto::ResponseId responseId(manifest->taskId, i);
-        auto checkResponse = expectedResponses.insert({responseId, false});
-        if (checkResponse.second) {
-            // Response not yet tracked.
-            responsesOutstanding++;
-        }
+        expectResponse(Proto::ResponseId(manifest->taskId, i), lock);
     }
 
     // Mark manifest received.
     updateBranchInfo(manifest->requestId.branchId, true, {}, {}, lock);
 }
 
+/**
+ * Helper method to start tracking an expected response if the response is
+ * not already tracked.
+ *
+ * @param responseId
+ *      Id of the response that is expected.
+ * @param lock
+ *      Reminds the caller that the RooPCImpl::mutex should be held.
+ */
+template <typename MutexType>
+void
+BasicRooPCImpl<MutexType>::expectResponse(Proto::ResponseId responseId,
+                                          const Lock& lock)
+{
+    (void)lock;
+    TaskResponses* task =
+        expectedResponses.insert(responseId.taskId, {}).first;
+    if (!task->tracked.test(responseId.sequence)) {
+        // Response not yet tracked.
+        task->tracked.set(responseId.sequence);
+        responsesOutstanding++;
+    }
+}
+
+/**
+ * Helper method to record that a manifest has been received for a tracked
+ * branch that was previously incomplete.
+ *
+ * @param branch
+ *      The branch that has finished processing.
+ * @param lock
+ *      Reminds the caller that the RooPCImpl::mutex should be held.
+ */
+template <typename MutexType>
+void
+BasicRooPCImpl<MutexType>::markBranchComplete(BranchInfo* branch,
+                                              const Lock& lock)
+{
+    (void)lock;
+    assert(!branch->complete);
+    branch->complete = true;
+    incompleteBranches.remove(&branch->incompleteNode);
+    manifestsOutstanding--;
+}
+
 /**
  * Helper method to add/update the tracked branch information to relect the
  * provided information if the information is more up-to-date. If stale
@@ -467,20 +829,23 @@ RooPCImpl::processManifest(Proto::Manifest* manifest,
  * @param lock
  *      Reminds the caller that the RooPCImpl::mutex should be held.
  */
-std::pair<RooPCImpl::BranchInfo*, bool>
-RooPCImpl::updateBranchInfo(Proto::BranchId branchId, bool isComplete,
-                            Proto::RequestId pingReceiverId,
-                            Homa::Driver::Address pingAddress,
-                            const SpinLock::Lock& lock)
+template <typename MutexType>
+std::pair<typename BasicRooPCImpl<MutexType>::BranchInfo*, bool>
+BasicRooPCImpl<MutexType>::updateBranchInfo(Proto::BranchId branchId,
+                                            bool isComplete,
+                                            Proto::RequestId pingReceiverId,
+                                            Homa::Driver::Address pingAddress,
+                                            const Lock& lock)
 {
     (void)lock;
     bool branchUpdated = false;
-    auto ret = branches.insert(
-        {branchId, {isComplete, pingReceiverId, pingAddress, 0}});
-    BranchInfo* const branch = &ret.first->second;
+    auto ret =
+        branches.insert(branchId, {isComplete, pingReceiverId, pingAddress, 0});
+    BranchInfo* const branch = ret.first;
     if (ret.second) {
         // Branch not previously tracked.
         if (!isComplete) {
+            incompleteBranches.push_back(&branch->incompleteNode);
             manifestsOutstanding++;
         }
         branchUpdated = true;
@@ -489,9 +854,7 @@ RooPCImpl::updateBranchInfo(Proto::BranchId branchId, bool isComplete,
         if (branch->complete) {
             // Nothing to do.
         } else if (isComplete) {
-            // Mark branch complete.
-            branch->complete = true;
-            manifestsOutstanding--;
+            markBranchComplete(branch, lock);
             branchUpdated = true;
         } else {
             branchUpdated =
@@ -501,4 +864,7 @@ RooPCImpl::updateBranchInfo(Proto::BranchId branchId, bool isComplete,
     return std::make_pair(branch, branchUpdated);
 }
 
+template class BasicRooPCImpl<SpinLock>;
+template class BasicRooPCImpl<NullLock>;
+
 }  // namespace Roo
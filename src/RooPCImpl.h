@@ -18,29 +18,57 @@
 
 #include <Roo/Roo.h>
 
-#include <deque>
-#include <unordered_map>
+#include <atomic>
 
+#include "Bitmap.h"
+#include "Intrusive.h"
+#include "NullLock.h"
 #include "Proto.h"
+#include "SmallMap.h"
+#include "SmallVector.h"
 #include "SpinLock.h"
+#include "SpscQueue.h"
 
 namespace Roo {
 
 // Forward Declaration
-class SocketImpl;
+template <typename MutexType>
+class BasicSocketImpl;
 
 /**
  * Implementation of RooPC.
+ *
+ * @tparam MutexType
+ *      Lock type of the managing BasicSocketImpl.
  */
-class RooPCImpl : public RooPC {
+template <typename MutexType>
+class BasicRooPCImpl : public RooPC {
   public:
-    explicit RooPCImpl(SocketImpl* socket, Proto::RooId rooId);
-    virtual ~RooPCImpl();
+    /// Socket implementation that manages this RooPC.
+    using SocketImpl = BasicSocketImpl<MutexType>;
+
+    /// RAII guard that holds a MutexType.
+    using Lock = typename MutexType::Lock;
+
+    /// Number of branches and responses a RooPC can track without allocating
+    /// memory; sized for single-hop RooPCs so that every pooled RooPC does not
+    /// pay for room that only wide fan-outs use.
+    static const std::size_t INLINE_CAPACITY = 2;
+
+    explicit BasicRooPCImpl(SocketImpl* socket, Proto::RooId rooId);
+    virtual ~BasicRooPCImpl();
     virtual void send(Homa::Driver::Address destination, const void* request,
                       std::size_t length);
+    virtual void send(Homa::Driver::Address destination,
+                      const struct iovec* fragments, std::size_t count);
+    virtual void sendMany(const Homa::Driver::Address destinations[],
+                          std::size_t count, const void* request,
+                          std::size_t length);
     virtual Homa::InMessage* receive();
     virtual Status checkStatus();
     virtual void wait();
+    virtual void onComplete(Callback callback);
+    virtual void onResponse(Callback callback);
 
     void handleResponse(Proto::ResponseHeader* header,
                         Homa::unique_ptr<Homa::InMessage> message);
@@ -51,6 +79,9 @@ class RooPCImpl : public RooPC {
     void handleError(Proto::ErrorHeader* header,
                      Homa::unique_ptr<Homa::InMessage> message);
     bool handleTimeout();
+    uint64_t worryTimeout();
+    bool callbacksPending();
+    bool invokeCallbacks();
 
     /**
      * Return this RooPC's identifier.
@@ -68,6 +99,31 @@ class RooPCImpl : public RooPC {
      * Metadata for a RooPC request branch.
      */
     struct BranchInfo {
+        /// Constructor
+        BranchInfo(bool complete, Proto::RequestId pingReceiverId,
+                   Homa::Driver::Address pingAddress, uint pingTimeouts)
+            : complete(complete)
+            , pingReceiverId(pingReceiverId)
+            , pingAddress(pingAddress)
+            , pingTimeouts(pingTimeouts)
+            , requestCycleTime(0)
+            , pingCycleTime(0)
+            , firstPingCycleTime(0)
+            , incompleteNode(this)
+        {}
+
+        /// Copy constructor; the copy is not linked into any list.
+        BranchInfo(const BranchInfo& other)
+            : complete(other.complete)
+            , pingReceiverId(other.pingReceiverId)
+            , pingAddress(other.pingAddress)
+            , pingTimeouts(other.pingTimeouts)
+            , requestCycleTime(other.requestCycleTime)
+            , pingCycleTime(other.pingCycleTime)
+            , firstPingCycleTime(other.firstPingCycleTime)
+            , incompleteNode(this)
+        {}
+
         bool updatePingTarget(Proto::BranchId branchId,
                               Proto::RequestId updatedId,
                               Homa::Driver::Address updatedAddress);
@@ -88,16 +144,55 @@ class RooPCImpl : public RooPC {
         /// The number of ping timeouts that have elapsed since last received
         /// pong response.
         uint pingTimeouts;
+
+        /// Cycle time at which this RooPC sent the branch's request; 0 if the
+        /// request was not sent by this RooPC or its round-trip time has
+        /// already been measured.
+        uint64_t requestCycleTime;
+
+        /// Cycle time at which the outstanding ping to pingAddress was sent; 0
+        /// if there is no outstanding ping or if several are outstanding, in
+        /// which case a pong can't be matched to the ping it answers.
+        uint64_t pingCycleTime;
+
+        /// Cycle time of the first ping timeout since the last pong; only
+        /// valid while pingTimeouts is non-zero.
+        uint64_t firstPingCycleTime;
+
+        /// Links this branch into RooPCImpl::incompleteBranches while the
+        /// branch is incomplete.
+        typename Intrusive::List<BranchInfo>::Node incompleteNode;
+
+        BranchInfo& operator=(const BranchInfo&) = delete;
     };
 
-    void processManifest(Proto::Manifest* manifest, const SpinLock::Lock& lock);
+    /**
+     * Tracks the responses of a single task.  A task's responses are numbered
+     * densely from 0 so they are tracked by ResponseId sequence in bitmaps.
+     */
+    struct TaskResponses {
+        /// Bit i is set if response i is being tracked; i.e. the response is
+        /// expected or has already been received.
+        Bitmap tracked;
+
+        /// Bit i is set if response i has been received.
+        Bitmap received;
+    };
+
+    void updateStatus(const Lock& lock);
+    bool isFinished(const Lock& lock);
+    bool takeCompletion(const Lock& lock);
+    void processManifest(Proto::Manifest* manifest, const Lock& lock);
+    void expectResponse(Proto::ResponseId responseId,
+                        const Lock& lock);
+    void markBranchComplete(BranchInfo* branch, const Lock& lock);
     std::pair<BranchInfo*, bool> updateBranchInfo(
         Proto::BranchId branchId, bool isComplete,
         Proto::RequestId pingReceiverId, Homa::Driver::Address pingAddress,
-        const SpinLock::Lock& lock);
+        const Lock& lock);
 
     /// Monitor-style lock
-    SpinLock mutex;
+    MutexType mutex;
 
     /// Socket that manages this RooPC.
     SocketImpl* const socket;
@@ -111,32 +206,64 @@ class RooPCImpl : public RooPC {
     /// Number of requests sent.
     uint64_t requestCount;
 
-    /// Responses for this RooPC that have not yet been delievered.
-    std::deque<Homa::InMessage*> responseQueue;
+    /// Number of distinct peers (or ping targets) that worryTimeout() and
+    /// handleTimeout() deduplicate on the stack.
+    static const std::size_t MAX_SCANNED_PEERS = 8;
 
-    /// All responses that have been received.
-    std::deque<Homa::unique_ptr<Homa::InMessage> > responses;
+    /// Largest number of responses a single task may send; bounds the memory
+    /// used to track a task's responses against corrupt response ids.
+    static const uint32_t MAX_TASK_RESPONSES = 1 << 16;
+
+    /// All responses that have been received, in the order received.  Pushed
+    /// with the mutex held and popped by receive() without it, so receive()
+    /// must not be called concurrently for the same RooPC.
+    SpscQueue<Homa::unique_ptr<Homa::InMessage>, INLINE_CAPACITY> responses;
+
+    /// Status returned by checkStatus(); written with the mutex held after
+    /// every change to the state it summarizes so checkStatus() can read it
+    /// without the mutex.
+    std::atomic<Status> status;
 
     /// Tracks the request branches spawned from this RooPC.
-    std::unordered_map<Proto::BranchId, BranchInfo, Proto::BranchId::Hasher>
-        branches;
+    SmallMap<Proto::BranchId, BranchInfo, INLINE_CAPACITY> branches;
+
+    /// Branches in _branches_ for which no manifest has been received, in the
+    /// order the branches were first tracked.  Declared after _branches_ so
+    /// that it is destroyed first.
+    Intrusive::List<BranchInfo> incompleteBranches;
 
     /// The number of expected branch manifests that have not yet been
     /// received. (Tracked seperately so the _tasks_ structure doesn't need to
     /// be scanned).
     int manifestsOutstanding;
 
-    /// Tracks whether or not expected responses have been received.  Maps from
-    /// a response identifer to a boolean value.  The value is true, if the
-    /// response has been received and false if the response is expected but
-    /// has not yet been received.
-    std::unordered_map<Proto::ResponseId, bool, Proto::ResponseId::Hasher>
-        expectedResponses;
+    /// Tracks whether or not expected responses have been received, grouped by
+    /// the id of the task that sends the responses.
+    SmallMap<Proto::TaskId, TaskResponses, INLINE_CAPACITY> expectedResponses;
 
     /// The number of expected responses that have not yet been received.
     int responsesOutstanding;
+
+    /// Called once when this RooPC finishes; may be empty.
+    Callback completeCallback;
+
+    /// Called when responses arrive; may be empty.
+    Callback responseCallback;
+
+    /// True once this RooPC's finish has been (or is about to be) reported.
+    bool completeNotified;
+
+    /// True if invokeCallbacks() should report that this RooPC finished and
+    /// invoke completeCallback, if any.
+    bool completePending;
+
+    /// True if responseCallback should be invoked by invokeCallbacks().
+    bool responsePending;
 };
 
+/// RooPC implementation of a thread-safe socket.
+using RooPCImpl = BasicRooPCImpl<SpinLock>;
+
 }  // namespace Roo
 
 #endif  // ROO_ROOPCIMPL_H
@@ -13,9 +13,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <PerfUtils/Cycles.h>
 #include <Roo/Debug.h>
 #include <gtest/gtest.h>
 
+#include <string>
+#include <vector>
+
 #include "Mock/MockHoma.h"
 #include "RooPCImpl.h"
 #include "SocketImpl.h"
@@ -61,6 +65,39 @@ class RooPCImplTest : public ::testing::Test {
         delete socket;
     }
 
+    void addBranch(Proto::BranchId branchId, RooPCImpl::BranchInfo info)
+    {
+        RooPCImpl::BranchInfo* branch =
+            rpc->branches.insert(branchId, info).first;
+        if (!branch->complete) {
+            rpc->incompleteBranches.push_back(&branch->incompleteNode);
+        }
+    }
+
+    void trackResponse(Proto::ResponseId responseId, bool received)
+    {
+        RooPCImpl::TaskResponses* task =
+            rpc->expectedResponses.insert(responseId.taskId, {}).first;
+        task->tracked.set(responseId.sequence);
+        if (received) {
+            task->received.set(responseId.sequence);
+        }
+    }
+
+    bool isTracked(Proto::ResponseId responseId)
+    {
+        RooPCImpl::TaskResponses* task =
+            rpc->expectedResponses.find(responseId.taskId);
+        return task != nullptr && task->tracked.test(responseId.sequence);
+    }
+
+    bool isReceived(Proto::ResponseId responseId)
+    {
+        RooPCImpl::TaskResponses* task =
+            rpc->expectedResponses.find(responseId.taskId);
+        return task != nullptr && task->received.test(responseId.sequence);
+    }
+
     Mock::Homa::MockTransport transport;
     Mock::Homa::MockDriver driver;
     Mock::Homa::MockInMessage inMessage;
@@ -95,7 +132,7 @@ TEST_F(RooPCImplTest, send)
     Proto::RequestId requestId{{rooId, 0}, 0};
 
     EXPECT_EQ(0, rpc->requestCount);
-    EXPECT_TRUE(rpc->branches.find(requestId.branchId) == rpc->branches.end());
+    EXPECT_EQ(nullptr, rpc->branches.find(requestId.branchId));
     EXPECT_EQ(0U, rpc->manifestsOutstanding);
 
     EXPECT_CALL(transport, alloc())
@@ -117,19 +154,97 @@ TEST_F(RooPCImplTest, send)
     rpc->send(0xFEED, buffer, sizeof(buffer));
 
     EXPECT_EQ(1, rpc->requestCount);
-    ASSERT_TRUE(rpc->branches.find(requestId.branchId) != rpc->branches.end());
+    ASSERT_NE(nullptr, rpc->branches.find(requestId.branchId));
     EXPECT_FALSE(rpc->branches.at(requestId.branchId).complete);
     EXPECT_EQ(requestId, rpc->branches.at(requestId.branchId).pingReceiverId);
     EXPECT_EQ(0xFEED, rpc->branches.at(requestId.branchId).pingAddress);
     EXPECT_EQ(0, rpc->branches.at(requestId.branchId).pingTimeouts);
+    EXPECT_NE(0U, rpc->branches.at(requestId.branchId).requestCycleTime);
     EXPECT_EQ(1U, rpc->manifestsOutstanding);
+    EXPECT_EQ(RooPC::Status::IN_PROGRESS, rpc->checkStatus());
+}
+
+TEST_F(RooPCImplTest, send_fragments)
+{
+    char header[16];
+    char payload[64];
+    struct iovec fragments[2] = {{header, sizeof(header)},
+                                 {payload, sizeof(payload)}};
+    Proto::RequestId requestId{{rooId, 0}, 0};
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    EXPECT_CALL(transport, getDriver()).Times(2);
+    EXPECT_CALL(driver, getLocalAddress()).WillOnce(Return(replyAddress));
+    EXPECT_CALL(driver,
+                addressToWireFormat(Eq(replyAddress),
+                                    An<Homa::Driver::WireFormatAddress*>()));
+    {
+        InSequence s;
+        EXPECT_CALL(outMessage, append(An<const void*>(),
+                                       Eq(sizeof(Proto::RequestHeader))));
+        EXPECT_CALL(outMessage, append(Eq(header), Eq(sizeof(header))));
+        EXPECT_CALL(outMessage, append(Eq(payload), Eq(sizeof(payload))));
+        EXPECT_CALL(outMessage,
+                    send(Eq(0xFEED), Eq(Homa::OutMessage::NO_RETRY |
+                                        Homa::OutMessage::NO_KEEP_ALIVE)));
+    }
+    EXPECT_CALL(outMessage, release());
+
+    rpc->send(0xFEED, fragments, 2);
+
+    EXPECT_EQ(1, rpc->requestCount);
+    ASSERT_NE(nullptr, rpc->branches.find(requestId.branchId));
+    EXPECT_EQ(1U, rpc->manifestsOutstanding);
+}
+
+TEST_F(RooPCImplTest, sendMany)
+{
+    char buffer[64];
+    Homa::Driver::Address destinations[2] = {0xFEED, 0xBEEF};
+    Mock::Homa::MockOutMessage outMessages[2];
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(Return(
+            ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessages[0]))))
+        .WillOnce(Return(
+            ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessages[1]))));
+    EXPECT_CALL(transport, getDriver()).Times(2);
+    EXPECT_CALL(driver, getLocalAddress()).WillOnce(Return(replyAddress));
+    EXPECT_CALL(driver,
+                addressToWireFormat(Eq(replyAddress),
+                                    An<Homa::Driver::WireFormatAddress*>()));
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_CALL(outMessages[i], append(An<const void*>(),
+                                           Eq(sizeof(Proto::RequestHeader))));
+        EXPECT_CALL(outMessages[i], append(Eq(buffer), Eq(sizeof(buffer))));
+        EXPECT_CALL(outMessages[i],
+                    send(Eq(destinations[i]),
+                         Eq(Homa::OutMessage::NO_RETRY |
+                            Homa::OutMessage::NO_KEEP_ALIVE)));
+        EXPECT_CALL(outMessages[i], release());
+    }
+
+    rpc->sendMany(destinations, 2, buffer, sizeof(buffer));
+
+    EXPECT_EQ(2, rpc->requestCount);
+    for (uint32_t i = 0; i < 2; ++i) {
+        Proto::BranchId branchId(rooId, i);
+        ASSERT_NE(nullptr, rpc->branches.find(branchId));
+        EXPECT_EQ(Proto::RequestId(branchId, 0),
+                  rpc->branches.at(branchId).pingReceiverId);
+        EXPECT_EQ(destinations[i], rpc->branches.at(branchId).pingAddress);
+    }
+    EXPECT_EQ(2U, rpc->manifestsOutstanding);
+    EXPECT_EQ(RooPC::Status::IN_PROGRESS, rpc->checkStatus());
 }
 
 TEST_F(RooPCImplTest, receive)
 {
     Homa::InMessage* message = nullptr;
 
-    rpc->responseQueue.push_back(&inMessage);
+    rpc->responses.push(Homa::unique_ptr<Homa::InMessage>(&inMessage));
 
     message = rpc->receive();
     EXPECT_EQ(&inMessage, message);
@@ -142,15 +257,32 @@ TEST_F(RooPCImplTest, checkStatus)
 {
     EXPECT_EQ(RooPC::Status::NOT_STARTED, rpc->checkStatus());
 
+    // The status only changes once it is published.
+    rpc->requestCount = 1;
+    EXPECT_EQ(RooPC::Status::NOT_STARTED, rpc->checkStatus());
+    rpc->status = RooPC::Status::IN_PROGRESS;
+    EXPECT_EQ(RooPC::Status::IN_PROGRESS, rpc->checkStatus());
+}
+
+TEST_F(RooPCImplTest, updateStatus)
+{
+    SpinLock::Lock lock(rpc->mutex);
+
+    rpc->updateStatus(lock);
+    EXPECT_EQ(RooPC::Status::NOT_STARTED, rpc->status.load());
+
     rpc->requestCount = 1;
-    EXPECT_EQ(RooPC::Status::COMPLETED, rpc->checkStatus());
+    rpc->updateStatus(lock);
+    EXPECT_EQ(RooPC::Status::COMPLETED, rpc->status.load());
 
     rpc->manifestsOutstanding = 1;
     rpc->error = true;
-    EXPECT_EQ(RooPC::Status::FAILED, rpc->checkStatus());
+    rpc->updateStatus(lock);
+    EXPECT_EQ(RooPC::Status::FAILED, rpc->status.load());
 
     rpc->error = false;
-    EXPECT_EQ(RooPC::Status::IN_PROGRESS, rpc->checkStatus());
+    rpc->updateStatus(lock);
+    EXPECT_EQ(RooPC::Status::IN_PROGRESS, rpc->status.load());
 }
 
 TEST_F(RooPCImplTest, wait)
@@ -159,6 +291,93 @@ TEST_F(RooPCImplTest, wait)
     rpc->wait();
 }
 
+TEST_F(RooPCImplTest, onComplete)
+{
+    int calls = 0;
+    rpc->requestCount = 1;
+    rpc->manifestsOutstanding = 1;
+
+    rpc->onComplete([&](RooPC* finished) {
+        EXPECT_EQ(rpc, finished);
+        calls++;
+    });
+    EXPECT_EQ(0, calls);
+    EXPECT_FALSE(rpc->completeNotified);
+
+    // Finish reported but not yet dispatched; left to invokeCallbacks().
+    rpc->manifestsOutstanding = 0;
+    rpc->completeNotified = true;
+    rpc->completePending = true;
+    rpc->onComplete([&](RooPC*) { calls++; });
+    EXPECT_EQ(0, calls);
+    EXPECT_TRUE(rpc->invokeCallbacks());
+    EXPECT_EQ(1, calls);
+
+    // Already finished; called immediately.
+    rpc->onComplete([&](RooPC*) { calls++; });
+    EXPECT_EQ(2, calls);
+    EXPECT_FALSE(rpc->completePending);
+}
+
+TEST_F(RooPCImplTest, onResponse)
+{
+    int calls = 0;
+    rpc->onResponse([&](RooPC*) { calls++; });
+    EXPECT_EQ(0, calls);
+
+    // Undelivered response available; called immediately.
+    rpc->responses.push(Homa::unique_ptr<Homa::InMessage>(&inMessage));
+    rpc->onResponse([&](RooPC* arrived) {
+        EXPECT_EQ(rpc, arrived);
+        calls++;
+    });
+    EXPECT_EQ(1, calls);
+
+    EXPECT_CALL(inMessage, release());
+}
+
+TEST_F(RooPCImplTest, invokeCallbacks)
+{
+    std::vector<std::string> calls;
+    rpc->responseCallback = [&](RooPC*) { calls.push_back("response"); };
+    rpc->completeCallback = [&](RooPC*) { calls.push_back("complete"); };
+
+    // Nothing pending
+    EXPECT_FALSE(rpc->callbacksPending());
+    EXPECT_FALSE(rpc->invokeCallbacks());
+    EXPECT_TRUE(calls.empty());
+
+    // Error makes the completion callback due.
+    rpc->requestCount = 1;
+    rpc->manifestsOutstanding = 1;
+    rpc->responsePending = true;
+    Proto::ErrorHeader header;
+    rpc->handleError(&header, Homa::unique_ptr<Homa::InMessage>());
+    EXPECT_TRUE(rpc->completePending);
+    EXPECT_TRUE(rpc->callbacksPending());
+
+    EXPECT_TRUE(rpc->invokeCallbacks());
+    EXPECT_EQ(std::vector<std::string>({"response", "complete"}), calls);
+    EXPECT_FALSE(rpc->callbacksPending());
+
+    // Completion is only reported once.
+    rpc->handleError(&header, Homa::unique_ptr<Homa::InMessage>());
+    EXPECT_FALSE(rpc->callbacksPending());
+    EXPECT_FALSE(rpc->invokeCallbacks());
+}
+
+TEST_F(RooPCImplTest, invokeCallbacks_noCallback)
+{
+    // The finish is reported even if no completion callback is registered.
+    rpc->requestCount = 1;
+    rpc->manifestsOutstanding = 1;
+    Proto::ErrorHeader header;
+    rpc->handleError(&header, Homa::unique_ptr<Homa::InMessage>());
+    EXPECT_TRUE(rpc->callbacksPending());
+    EXPECT_TRUE(rpc->invokeCallbacks());
+    EXPECT_FALSE(rpc->callbacksPending());
+}
+
 TEST_F(RooPCImplTest, destroy)
 {
     // nothing to test
@@ -178,8 +397,8 @@ TEST_F(RooPCImplTest, handleResponse_basic)
     header.hasManifest = true;
     header.manifest = Proto::Manifest(requestId, branchId.taskId, 2, 0);
 
-    rpc->branches[rootId] = {false, {}, {}, 0};
-    rpc->branches[Proto::BranchId(branchId.taskId, 0)] = {true, {}, {}, 0};
+    addBranch(rootId, {false, {}, {}, 0});
+    addBranch(Proto::BranchId(branchId.taskId, 0), {true, {}, {}, 0});
     rpc->manifestsOutstanding = 1;
 
     Homa::unique_ptr<Homa::InMessage> message(&inMessage);
@@ -190,7 +409,7 @@ TEST_F(RooPCImplTest, handleResponse_basic)
                     &header.manifest.serverAddress)))
         .WillOnce(Return(0xFEED));
 
-    EXPECT_EQ(0, rpc->expectedResponses.count(responseId));
+    EXPECT_FALSE(isTracked(responseId));
     EXPECT_EQ(2, rpc->branches.size());
     EXPECT_EQ(1, rpc->manifestsOutstanding);
     EXPECT_EQ(0, rpc->responsesOutstanding);
@@ -199,13 +418,61 @@ TEST_F(RooPCImplTest, handleResponse_basic)
 
     EXPECT_TRUE(rpc->branches.at(branchId).complete);
     EXPECT_TRUE(rpc->branches.at(rootId).complete);
-    EXPECT_TRUE(rpc->expectedResponses.at(responseId));
+    EXPECT_TRUE(isReceived(responseId));
     EXPECT_EQ(0, rpc->manifestsOutstanding);
     EXPECT_EQ(0, rpc->responsesOutstanding);
 
     EXPECT_CALL(inMessage, release());
 }
 
+TEST_F(RooPCImplTest, handleResponse_outOfRange)
+{
+    Proto::ResponseId responseId(Proto::TaskId(2, 2),
+                                 RooPCImpl::MAX_TASK_RESPONSES);
+    Proto::ResponseHeader header(rooId, Proto::BranchId(rooId, 0), responseId);
+    rpc->requestCount = 1;
+    rpc->manifestsOutstanding = 1;
+
+    Homa::unique_ptr<Homa::InMessage> message(&inMessage);
+    EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
+    EXPECT_CALL(inMessage, release());
+
+    rpc->handleResponse(&header, std::move(message));
+
+    EXPECT_TRUE(rpc->error);
+    EXPECT_EQ(0U, rpc->expectedResponses.size());
+    EXPECT_EQ(0U, rpc->responses.available());
+    EXPECT_EQ(RooPC::Status::FAILED, rpc->checkStatus());
+}
+
+TEST_F(RooPCImplTest, handleResponse_rtt)
+{
+    Proto::BranchId branchId(rooId, 0);
+    Proto::RequestId requestId(branchId, 0);
+    Proto::ResponseHeader header(rooId, branchId,
+                                 Proto::ResponseId(Proto::TaskId(2, 2), 0),
+                                 true);
+
+    addBranch(branchId, {false, requestId, 0xFEED, 0});
+    rpc->branches.at(branchId).requestCycleTime = 1000;
+    rpc->manifestsOutstanding = 1;
+
+    Homa::unique_ptr<Homa::InMessage> message(&inMessage);
+    EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
+
+    PerfUtils::Cycles::mockTscValue = 1500;
+    rpc->handleResponse(&header, std::move(message));
+    PerfUtils::Cycles::mockTscValue = 0;
+
+    EXPECT_EQ(0U, rpc->branches.at(branchId).requestCycleTime);
+    SocketImpl::RttShard* rttShard = socket->getRttShard(0xFEED);
+    ASSERT_EQ(1U, rttShard->peers.count(0xFEED));
+    EXPECT_EQ(1U, rttShard->peers[0xFEED].samples());
+    EXPECT_EQ(500U, rttShard->peers[0xFEED].smoothedRtt);
+
+    EXPECT_CALL(inMessage, release());
+}
+
 TEST_F(RooPCImplTest, handleResponse_unexpected)
 {
     Proto::RooId rooId(0, 0);
@@ -216,19 +483,19 @@ TEST_F(RooPCImplTest, handleResponse_unexpected)
     header.branchId = branchId;
     header.responseId = responseId;
     Homa::unique_ptr<Homa::InMessage> message(&inMessage);
-    rpc->branches[rootId] = {false, {}, {}, 0};
+    addBranch(rootId, {false, {}, {}, 0});
     rpc->manifestsOutstanding = 1;
 
     EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
 
-    EXPECT_EQ(0, rpc->expectedResponses.count(responseId));
+    EXPECT_FALSE(isTracked(responseId));
     EXPECT_EQ(1, rpc->branches.size());
     EXPECT_EQ(1, rpc->manifestsOutstanding);
 
     rpc->handleResponse(&header, std::move(message));
 
-    EXPECT_EQ(1, rpc->expectedResponses.count(responseId));
-    EXPECT_TRUE(rpc->expectedResponses.at(responseId));
+    EXPECT_TRUE(isTracked(responseId));
+    EXPECT_TRUE(isReceived(responseId));
     EXPECT_EQ(1, rpc->branches.size());
     EXPECT_EQ(1, rpc->manifestsOutstanding);
 
@@ -243,16 +510,16 @@ TEST_F(RooPCImplTest, handleResponse_expected)
     Homa::unique_ptr<Homa::InMessage> message(&inMessage);
     EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
 
-    rpc->expectedResponses[responseId] = false;
+    trackResponse(responseId, false);
     rpc->responsesOutstanding = 1;
-    EXPECT_EQ(0, rpc->responseQueue.size());
+    EXPECT_EQ(0, rpc->responses.available());
     EXPECT_EQ(0, rpc->responses.size());
 
     rpc->handleResponse(&header, std::move(message));
 
-    EXPECT_TRUE(rpc->expectedResponses.at(responseId));
+    EXPECT_TRUE(isReceived(responseId));
     EXPECT_EQ(0, rpc->responsesOutstanding);
-    EXPECT_EQ(1, rpc->responseQueue.size());
+    EXPECT_EQ(1, rpc->responses.available());
     EXPECT_EQ(1, rpc->responses.size());
 
     EXPECT_CALL(inMessage, release());
@@ -267,9 +534,9 @@ TEST_F(RooPCImplTest, handleResponse_duplicate)
     EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
     EXPECT_CALL(inMessage, release());
 
-    rpc->expectedResponses[responseId] = true;
+    trackResponse(responseId, true);
     EXPECT_EQ(0, rpc->responsesOutstanding);
-    EXPECT_EQ(0, rpc->responseQueue.size());
+    EXPECT_EQ(0, rpc->responses.available());
     EXPECT_EQ(0, rpc->responses.size());
 
     VectorHandler handler;
@@ -285,9 +552,9 @@ TEST_F(RooPCImplTest, handleResponse_duplicate)
     EXPECT_EQ("Duplicate response received for RooPC (42, 1)", m.message);
     Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
 
-    EXPECT_TRUE(rpc->expectedResponses.at(responseId));
+    EXPECT_TRUE(isReceived(responseId));
     EXPECT_EQ(0, rpc->responsesOutstanding);
-    EXPECT_EQ(0, rpc->responseQueue.size());
+    EXPECT_EQ(0, rpc->responses.available());
     EXPECT_EQ(0, rpc->responses.size());
 }
 
@@ -311,7 +578,7 @@ TEST_F(RooPCImplTest, handleManifest)
     manifest.responseCount = 0;
     Homa::unique_ptr<Homa::InMessage> message(&inMessage);
 
-    rpc->branches[branchId] = {false, {}, {}, 0};
+    addBranch(branchId, {false, {}, {}, 0});
     rpc->manifestsOutstanding = 1;
     rpc->responsesOutstanding = 0;
 
@@ -354,10 +621,10 @@ TEST_F(RooPCImplTest, handlePong_basic)
     header.branchComplete = true;
     Homa::unique_ptr<Homa::InMessage> message(&inMessage);
 
-    rpc->branches[branchId] = {false, {}, {}, 1};
+    addBranch(branchId, {false, {}, {}, 1});
     rpc->manifestsOutstanding = 1;
 
-    rpc->expectedResponses[Proto::ResponseId(taskId, 0)] = true;
+    trackResponse(Proto::ResponseId(taskId, 0), true);
     rpc->responsesOutstanding = 0;
 
     EXPECT_EQ(0, rpc->branches.count(delegatedId.branchId));
@@ -407,9 +674,35 @@ TEST_F(RooPCImplTest, handlePong_basic)
     EXPECT_EQ(1, rpc->manifestsOutstanding);
 
     // Check responses
-    EXPECT_EQ(2, rpc->expectedResponses.size());
-    EXPECT_TRUE(rpc->expectedResponses.at(Proto::ResponseId(taskId, 0)));
-    EXPECT_FALSE(rpc->expectedResponses.at(Proto::ResponseId(taskId, 1)));
+    EXPECT_EQ(1, rpc->expectedResponses.size());
+    EXPECT_TRUE(isReceived(Proto::ResponseId(taskId, 0)));
+    EXPECT_TRUE(isTracked(Proto::ResponseId(taskId, 1)));
+    EXPECT_FALSE(isReceived(Proto::ResponseId(taskId, 1)));
+}
+
+TEST_F(RooPCImplTest, handlePong_rtt)
+{
+    Proto::BranchId branchId(rooId, 0);
+    Proto::RequestId requestId(branchId, 0);
+    Proto::PongHeader header;
+    header.requestId = requestId;
+    Homa::unique_ptr<Homa::InMessage> message(&inMessage);
+
+    addBranch(branchId, {false, requestId, 0xFEED, 1});
+    rpc->branches.at(branchId).pingCycleTime = 1000;
+    rpc->manifestsOutstanding = 1;
+
+    EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::PongHeader))));
+    EXPECT_CALL(inMessage, release());
+
+    PerfUtils::Cycles::mockTscValue = 1300;
+    rpc->handlePong(&header, std::move(message));
+    PerfUtils::Cycles::mockTscValue = 0;
+
+    EXPECT_EQ(0U, rpc->branches.at(branchId).pingCycleTime);
+    EXPECT_EQ(0U, rpc->branches.at(branchId).pingTimeouts);
+    EXPECT_EQ(300U, socket->getRttShard(0xFEED)->peers[0xFEED].smoothedRtt);
+    EXPECT_EQ(300U, socket->getRttShard(0xFEED)->combined.smoothedRtt);
 }
 
 TEST_F(RooPCImplTest, handlePong_unexpected)
@@ -462,7 +755,7 @@ TEST_F(RooPCImplTest, handlePong_single_delegate)
     header.branchComplete = false;
     Homa::unique_ptr<Homa::InMessage> message(&inMessage);
 
-    rpc->branches[branchId] = {false, requestId, {}, 0};
+    addBranch(branchId, {false, requestId, {}, 0});
     rpc->manifestsOutstanding = 1;
 
     Proto::PingHeader pingHeader;
@@ -514,10 +807,13 @@ TEST_F(RooPCImplTest, handleError)
 
     EXPECT_CALL(inMessage, release());
     EXPECT_FALSE(rpc->error);
+    rpc->requestCount = 1;
+    rpc->manifestsOutstanding = 1;
 
     rpc->handleError(&header, std::move(message));
 
     EXPECT_TRUE(rpc->error);
+    EXPECT_EQ(RooPC::Status::FAILED, rpc->checkStatus());
 }
 
 TEST_F(RooPCImplTest, handleTimeout)
@@ -525,8 +821,8 @@ TEST_F(RooPCImplTest, handleTimeout)
     Proto::RooId rooId(0, 0);
     Proto::BranchId rootId(rooId, 0);
     Proto::RequestId requestId(rootId, 0);
-    rpc->branches.insert({requestId.branchId, {false, requestId, 0xFEED, 3}});
-    rpc->branches.insert({{rooId, 1}, {true, {}, {}, {}}});
+    addBranch(requestId.branchId, {false, requestId, 0xFEED, 3});
+    addBranch({rooId, 1}, {true, {}, {}, {}});
     rpc->manifestsOutstanding = 1;
 
     EXPECT_FALSE(rpc->error);
@@ -547,6 +843,8 @@ TEST_F(RooPCImplTest, handleTimeout)
     EXPECT_FALSE(rpc->error);
     EXPECT_FALSE(rpc->branches.at(rootId).complete);
     EXPECT_EQ(4, rpc->branches.at(rootId).pingTimeouts);
+    // Several pings are outstanding; a pong can't be timed.
+    EXPECT_EQ(0U, rpc->branches.at(rootId).pingCycleTime);
 
     // Expect timeout
     EXPECT_FALSE(rpc->handleTimeout());
@@ -573,6 +871,106 @@ TEST_F(RooPCImplTest, handleTimeout)
     EXPECT_FALSE(rpc->error);
 }
 
+TEST_F(RooPCImplTest, handleTimeout_failureBudget)
+{
+    Proto::RequestId requestId({rooId, 0}, 0);
+    addBranch(requestId.branchId, {false, requestId, 0xFEED, 4});
+    rpc->manifestsOutstanding = 1;
+    RooPCImpl::BranchInfo* branch = &rpc->branches.at(requestId.branchId);
+    PerfUtils::Cycles::mockTscValue = 1UL << 40;
+    branch->firstPingCycleTime =
+        PerfUtils::Cycles::mockTscValue - socket->pingFailureCycles + 1;
+
+    // Enough pings but not enough time; e.g. short worry timeouts to a
+    // server whose pongs are delayed by a slow handler.  Keep pinging.
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    EXPECT_CALL(outMessage, append(_, Eq(sizeof(Proto::PingHeader))));
+    EXPECT_CALL(outMessage, send(Eq(0xFEED), _));
+    EXPECT_CALL(outMessage, release());
+    EXPECT_TRUE(rpc->handleTimeout());
+    EXPECT_FALSE(rpc->error);
+    EXPECT_EQ(5, branch->pingTimeouts);
+
+    // Budget exhausted
+    PerfUtils::Cycles::mockTscValue += 1;
+    EXPECT_FALSE(rpc->handleTimeout());
+    EXPECT_TRUE(rpc->error);
+    PerfUtils::Cycles::mockTscValue = 0;
+}
+
+TEST_F(RooPCImplTest, handleTimeout_sharedPingTarget)
+{
+    Proto::RequestId requestId({rooId, 0}, 0);
+    Proto::TaskId taskId(2, 2);
+    Proto::RequestId otherId({rooId, 1}, 0);
+    addBranch({taskId, 0}, {false, requestId, 0xFEED, 0});
+    addBranch({taskId, 1}, {false, requestId, 0xFEED, 0});
+    addBranch({taskId, 2}, {true, requestId, 0xFEED, 0});
+    // Branches sharing a target need not be adjacent; e.g. after a pong
+    // retargets only some of them.
+    addBranch({taskId, 3}, {false, otherId, 0xBEEF, 0});
+    addBranch({taskId, 4}, {false, requestId, 0xFEED, 0});
+    rpc->manifestsOutstanding = 4;
+
+    // Expect a single ping per target
+    Mock::Homa::MockOutMessage otherMessage;
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))))
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&otherMessage))));
+    EXPECT_CALL(outMessage, append(_, Eq(sizeof(Proto::PingHeader))));
+    EXPECT_CALL(outMessage, send(Eq(0xFEED), _));
+    EXPECT_CALL(outMessage, release());
+    EXPECT_CALL(otherMessage, append(_, Eq(sizeof(Proto::PingHeader))));
+    EXPECT_CALL(otherMessage, send(Eq(0xBEEF), _));
+    EXPECT_CALL(otherMessage, release());
+    EXPECT_TRUE(rpc->handleTimeout());
+
+    EXPECT_EQ(1, rpc->branches.at({taskId, 0}).pingTimeouts);
+    EXPECT_EQ(1, rpc->branches.at({taskId, 1}).pingTimeouts);
+    EXPECT_EQ(0, rpc->branches.at({taskId, 2}).pingTimeouts);
+    EXPECT_EQ(1, rpc->branches.at({taskId, 3}).pingTimeouts);
+    EXPECT_EQ(1, rpc->branches.at({taskId, 4}).pingTimeouts);
+    EXPECT_NE(0U, rpc->branches.at({taskId, 0}).pingCycleTime);
+}
+
+TEST_F(RooPCImplTest, worryTimeout)
+{
+    // No branches
+    EXPECT_EQ(socket->initialWorryTimeoutCycles, rpc->worryTimeout());
+
+    socket->recordRtt(0xFEED, socket->minWorryTimeoutCycles);
+    socket->recordRtt(0xBEEF, socket->maxWorryTimeoutCycles);
+    addBranch({rooId, 0}, {false, {}, 0xFEED, 0});
+    EXPECT_EQ(socket->worryTimeout(0xFEED), rpc->worryTimeout());
+
+    // Longest timeout among the incomplete branches.
+    addBranch({rooId, 1}, {false, {}, 0xBEEF, 0});
+    addBranch({rooId, 2}, {false, {}, 0xFEED, 0});
+    EXPECT_EQ(socket->maxWorryTimeoutCycles, rpc->worryTimeout());
+}
+
+TEST_F(RooPCImplTest, markBranchComplete)
+{
+    Proto::BranchId branchId({2, 2}, 0);
+    addBranch(branchId, {false, {}, {}, 0});
+    rpc->manifestsOutstanding = 1;
+    RooPCImpl::BranchInfo* branch = &rpc->branches.at(branchId);
+    EXPECT_EQ(1, rpc->incompleteBranches.size());
+
+    {
+        SpinLock::Lock lock(rpc->mutex);
+        rpc->markBranchComplete(branch, lock);
+    }
+
+    EXPECT_TRUE(branch->complete);
+    EXPECT_EQ(0, rpc->incompleteBranches.size());
+    EXPECT_EQ(0, rpc->manifestsOutstanding);
+}
+
 TEST_F(RooPCImplTest, BranchInfo_updatePingTarget)
 {
     Proto::BranchId branchId{{2, 2}, 1};
@@ -582,9 +980,7 @@ TEST_F(RooPCImplTest, BranchInfo_updatePingTarget)
     Homa::Driver::Address address = 0xFEED;
     Homa::Driver::Address delegateAddress = 0xBEEF;
     Homa::Driver::Address parentAddress = 0xDEAD;
-    RooPCImpl::BranchInfo info;
-    info.pingReceiverId = parentRequestId;
-    info.pingAddress = parentAddress;
+    RooPCImpl::BranchInfo info(false, parentRequestId, parentAddress, 0);
 
     bool ret = false;
 
@@ -610,6 +1006,26 @@ TEST_F(RooPCImplTest, BranchInfo_updatePingTarget)
     EXPECT_EQ(delegateAddress, info.pingAddress);
 }
 
+TEST_F(RooPCImplTest, processManifest_tooManyResponses)
+{
+    Proto::Manifest manifest;
+    manifest.requestId = Proto::RequestId({Proto::TaskId(1, 1), 1}, 0);
+    manifest.taskId = Proto::TaskId(2, 2);
+    manifest.responseCount = RooPCImpl::MAX_TASK_RESPONSES + 1;
+
+    EXPECT_CALL(transport, getDriver());
+    EXPECT_CALL(driver,
+                getAddress(An<const Homa::Driver::WireFormatAddress*>()))
+        .WillOnce(Return(0xFEED));
+
+    SpinLock::Lock lock(rpc->mutex);
+    rpc->processManifest(&manifest, lock);
+
+    EXPECT_TRUE(rpc->error);
+    EXPECT_EQ(0U, rpc->expectedResponses.size());
+    EXPECT_EQ(0U, rpc->responsesOutstanding);
+}
+
 TEST_F(RooPCImplTest, processManifest)
 {
     Proto::BranchId branchId(Proto::TaskId(1, 1), 1);
@@ -621,8 +1037,8 @@ TEST_F(RooPCImplTest, processManifest)
     manifest.requestCount = 2;
     manifest.responseCount = 2;
 
-    rpc->branches[Proto::BranchId(taskId, 0)] = {true, {}, {}, 0};
-    rpc->expectedResponses[Proto::ResponseId(taskId, 0)] = true;
+    addBranch(Proto::BranchId(taskId, 0), {true, {}, {}, 0});
+    trackResponse(Proto::ResponseId(taskId, 0), true);
 
     EXPECT_EQ(1, rpc->branches.size());
     EXPECT_EQ(1, rpc->expectedResponses.size());
@@ -652,9 +1068,10 @@ TEST_F(RooPCImplTest, processManifest)
     EXPECT_TRUE(rpc->branches.at(branchId).complete);
 
     // Check response
-    EXPECT_EQ(2, rpc->expectedResponses.size());
-    EXPECT_TRUE(rpc->expectedResponses.at(Proto::ResponseId(taskId, 0)));
-    EXPECT_FALSE(rpc->expectedResponses.at(Proto::ResponseId(taskId, 1)));
+    EXPECT_EQ(1, rpc->expectedResponses.size());
+    EXPECT_TRUE(isReceived(Proto::ResponseId(taskId, 0)));
+    EXPECT_TRUE(isTracked(Proto::ResponseId(taskId, 1)));
+    EXPECT_FALSE(isReceived(Proto::ResponseId(taskId, 1)));
 }
 
 TEST_F(RooPCImplTest, updateBranchInfo)
@@ -17,6 +17,7 @@
 #include <gtest/gtest.h>
 
 #include "Mock/MockHoma.h"
+#include "SocketImpl.h"
 
 namespace Roo {
 namespace {
@@ -37,6 +38,30 @@ TEST_F(RooTest, Socket_create)
 {
     EXPECT_CALL(transport, getId()).WillOnce(Return(42));
     std::unique_ptr<Roo::Socket> socket = Roo::Socket::create(&transport);
+    SocketImpl* impl = dynamic_cast<SocketImpl*>(socket.get());
+    ASSERT_NE(nullptr, impl);
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(impl->shards) %
+                      CacheAligned::CACHE_LINE_SIZE);
+}
+
+TEST_F(RooTest, Socket_createSingleThreaded)
+{
+    SocketOptions options;
+    options.ownPoller = true;
+    EXPECT_CALL(transport, getId()).WillOnce(Return(42));
+    std::unique_ptr<Roo::Socket> socket =
+        Roo::Socket::createSingleThreaded(&transport, options);
+    BasicSocketImpl<NullLock>* impl =
+        dynamic_cast<BasicSocketImpl<NullLock>*>(socket.get());
+    ASSERT_NE(nullptr, impl);
+    EXPECT_FALSE(impl->poller.joinable());
+
+    Roo::unique_ptr<RooPC> rpc = socket->allocRooPC();
+    EXPECT_EQ(RooPC::Status::NOT_STARTED, rpc->checkStatus());
+
+    // Worker threads would touch the unlocked socket.
+    socket->startWorkers(2, [](Roo::unique_ptr<ServerTask>) {}, -1);
+    EXPECT_FALSE(impl->workers);
 }
 
 }  // namespace
@@ -0,0 +1,111 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_RTTESTIMATOR_H
+#define ROO_RTTESTIMATOR_H
+
+#include <cstdint>
+
+namespace Roo {
+
+/**
+ * Estimates the round-trip time to a peer from a stream of timing samples
+ * and derives a timeout from the estimate.
+ *
+ * The estimator keeps an exponentially weighted moving average of the samples
+ * along with their mean deviation, as TCP does to compute its retransmission
+ * timeout (see RFC 6298).  All times are in cycles.
+ *
+ * This class is not thread-safe.
+ */
+class RttEstimator {
+  public:
+    /**
+     * Construct an estimator that has not yet seen any samples.
+     */
+    RttEstimator()
+        : smoothedRtt(0)
+        , rttVariance(0)
+        , sampleCount(0)
+    {}
+
+    /**
+     * Incorporate a new round-trip time measurement into the estimate.
+     *
+     * @param rtt
+     *      Measured round-trip time in cycles.
+     */
+    void sample(uint64_t rtt)
+    {
+        if (sampleCount == 0) {
+            smoothedRtt = rtt;
+            rttVariance = rtt / 2;
+        } else {
+            uint64_t error =
+                rtt > smoothedRtt ? rtt - smoothedRtt : smoothedRtt - rtt;
+            // rttVariance = 3/4 * rttVariance + 1/4 * error
+            rttVariance = rttVariance - rttVariance / 4 + error / 4;
+            // smoothedRtt = 7/8 * smoothedRtt + 1/8 * rtt
+            smoothedRtt = smoothedRtt - smoothedRtt / 8 + rtt / 8;
+        }
+        sampleCount++;
+    }
+
+    /**
+     * Return the time after which a peer that has not responded should be
+     * considered late.
+     *
+     * @param initial
+     *      Timeout returned if no samples have been taken.
+     * @param min
+     *      Lower bound on the returned timeout.
+     * @param max
+     *      Upper bound on the returned timeout.
+     */
+    uint64_t timeout(uint64_t initial, uint64_t min, uint64_t max) const
+    {
+        uint64_t timeout =
+            sampleCount == 0 ? initial : smoothedRtt + 4 * rttVariance;
+        if (timeout < min) {
+            return min;
+        } else if (timeout > max) {
+            return max;
+        }
+        return timeout;
+    }
+
+    /**
+     * Return the number of samples incorporated into the estimate.
+     */
+    uint64_t samples() const
+    {
+        return sampleCount;
+    }
+
+  private:
+    /// Smoothed round-trip time; only valid if sampleCount > 0.
+    uint64_t smoothedRtt;
+
+    /// Smoothed mean deviation of the round-trip time samples; only valid if
+    /// sampleCount > 0.
+    uint64_t rttVariance;
+
+    /// Number of samples taken.
+    uint64_t sampleCount;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_RTTESTIMATOR_H
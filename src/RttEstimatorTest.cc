@@ -0,0 +1,61 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "RttEstimator.h"
+
+namespace Roo {
+namespace {
+
+TEST(RttEstimatorTest, sample)
+{
+    RttEstimator estimator;
+
+    estimator.sample(800);
+    EXPECT_EQ(800U, estimator.smoothedRtt);
+    EXPECT_EQ(400U, estimator.rttVariance);
+    EXPECT_EQ(1U, estimator.samples());
+
+    estimator.sample(1600);
+    EXPECT_EQ(900U, estimator.smoothedRtt);
+    EXPECT_EQ(500U, estimator.rttVariance);
+    EXPECT_EQ(2U, estimator.samples());
+
+    // Converges to a steady round-trip time.
+    for (int i = 0; i < 200; ++i) {
+        estimator.sample(1000);
+    }
+    EXPECT_NEAR(1000, estimator.smoothedRtt, 10);
+    EXPECT_LT(estimator.rttVariance, 10U);
+}
+
+TEST(RttEstimatorTest, timeout)
+{
+    RttEstimator estimator;
+
+    // No samples
+    EXPECT_EQ(5000U, estimator.timeout(5000, 100, 10000));
+
+    estimator.sample(800);
+    EXPECT_EQ(800U + 4 * 400U, estimator.timeout(5000, 100, 10000));
+
+    // Bounded
+    EXPECT_EQ(3000U, estimator.timeout(5000, 3000, 10000));
+    EXPECT_EQ(1000U, estimator.timeout(5000, 100, 1000));
+}
+
+}  // namespace
+}  // namespace Roo
@@ -15,6 +15,7 @@
 
 #include "ServerTaskImpl.h"
 
+#include <algorithm>
 #include <vector>
 
 #include "ControlMessage.h"
@@ -24,6 +25,9 @@
 
 namespace Roo {
 
+template <typename MutexType>
+const std::size_t BasicServerTaskImpl<MutexType>::FORWARD_CHUNK_SIZE;
+
 /**
  * ServerTaskImpl constructor.
  *
@@ -37,9 +41,11 @@ namespace Roo {
  * @param request
  *      The request message associated with this ServerTask.
  */
-ServerTaskImpl::ServerTaskImpl(SocketImpl* socket, Proto::TaskId taskId,
-                               Proto::RequestHeader const* requestHeader,
-                               Homa::unique_ptr<Homa::InMessage> request)
+template <typename MutexType>
+BasicServerTaskImpl<MutexType>::BasicServerTaskImpl(
+    SocketImpl* socket, Proto::TaskId taskId,
+    Proto::RequestHeader const* requestHeader,
+    Homa::unique_ptr<Homa::InMessage> request)
     : detached(false)
     , socket(socket)
     , rooId(requestHeader->rooId)
@@ -55,6 +61,8 @@ ServerTaskImpl::ServerTaskImpl(SocketImpl* socket, Proto::TaskId taskId,
     , bufferedMessageAddress()
     , bufferedMessageHeader()
     , bufferedMessage()
+    , pendingReply()
+    , eagerSend(socket->eagerSend)
     , hasUnsentManifest(requestHeader->hasManifest)
     , delegatedManifest(requestHeader->manifest)
 {
@@ -64,13 +72,15 @@ ServerTaskImpl::ServerTaskImpl(SocketImpl* socket, Proto::TaskId taskId,
 /**
  * ServerTaskImpl destructor.
  */
-ServerTaskImpl::~ServerTaskImpl() = default;
+template <typename MutexType>
+BasicServerTaskImpl<MutexType>::~BasicServerTaskImpl() = default;
 
 /**
  * @copydoc ServerTask::getRequest()
  */
+template <typename MutexType>
 Homa::InMessage*
-ServerTaskImpl::getRequest()
+BasicServerTaskImpl<MutexType>::getRequest()
 {
     return request.get();
 }
@@ -78,8 +88,9 @@ ServerTaskImpl::getRequest()
 /**
  * @copydoc ServerTask::reply()
  */
+template <typename MutexType>
 void
-ServerTaskImpl::reply(const void* response, std::size_t length)
+BasicServerTaskImpl<MutexType>::reply(const void* response, std::size_t length)
 {
     Perf::Timer timer;
 
@@ -89,34 +100,57 @@ ServerTaskImpl::reply(const void* response, std::size_t length)
     // next calls either reply() or delegate() or when server is done processing
     // the ServerTask.
 
-    // Send out any previously buffered message
-    sendBufferedMessage();
-
     // Format the response message
-    bufferedMessageIsRequest = false;
     Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
     message->reserve(sizeof(Proto::ResponseHeader));
     message->append(response, length);
-    new (bufferedResponseHeader) Proto::ResponseHeader(
-        rooId, requestId.branchId, Proto::ResponseId(taskId, responseCount));
-    responseCount += 1;
-    if (hasUnsentManifest) {
-        // piggy-back the delegated manifest
-        bufferedResponseHeader->hasManifest = true;
-        bufferedResponseHeader->manifest = delegatedManifest;
-        hasUnsentManifest = false;
+    bufferResponse(std::move(message));
+    Perf::counters.server_api_cycles.add(timer.split());
+}
+
+/**
+ * @copydoc ServerTask::allocReply()
+ */
+template <typename MutexType>
+ReplyBuffer
+BasicServerTaskImpl<MutexType>::allocReply()
+{
+    Perf::Timer timer;
+    if (pendingReply) {
+        // Keep the uncommitted reply rather than silently dropping it.
+        ERROR("allocReply() called again before commitReply()");
+        return ReplyBuffer(pendingReply.get());
     }
-    bufferedMessageAddress = replyAddress;
-    bufferedMessage = std::move(message);
+    pendingReply = socket->transport->alloc();
+    pendingReply->reserve(sizeof(Proto::ResponseHeader));
+    Perf::counters.server_api_cycles.add(timer.split());
+    return ReplyBuffer(pendingReply.get());
+}
+
+/**
+ * @copydoc ServerTask::commitReply()
+ */
+template <typename MutexType>
+void
+BasicServerTaskImpl<MutexType>::commitReply()
+{
+    Perf::Timer timer;
+    if (!pendingReply) {
+        ERROR("commitReply() called without a preceding allocReply()");
+        return;
+    }
+    bufferResponse(std::move(pendingReply));
     Perf::counters.server_api_cycles.add(timer.split());
 }
 
 /**
  * @copydoc ServerTask::delegate()
  */
+template <typename MutexType>
 void
-ServerTaskImpl::delegate(Homa::Driver::Address destination, const void* request,
-                         std::size_t length)
+BasicServerTaskImpl<MutexType>::delegate(Homa::Driver::Address destination,
+                                         const void* request,
+                                         std::size_t length)
 {
     Perf::Timer timer;
 
@@ -126,29 +160,131 @@ ServerTaskImpl::delegate(Homa::Driver::Address destination, const void* request,
     // next calls either reply() or delegate() or when server is done processing
     // the ServerTask.
 
+    // Format the delegated request message
+    Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
+    message->reserve(sizeof(Proto::RequestHeader));
+    message->append(request, length);
+    bufferRequest(destination, std::move(message));
+    Perf::counters.server_api_cycles.add(timer.split());
+}
+
+/**
+ * @copydoc ServerTask::delegate(Homa::Driver::Address, const iovec*, size_t)
+ */
+template <typename MutexType>
+void
+BasicServerTaskImpl<MutexType>::delegate(Homa::Driver::Address destination,
+                                         const struct iovec* fragments,
+                                         std::size_t count)
+{
+    Perf::Timer timer;
+
+    // Format the delegated request message
+    Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
+    message->reserve(sizeof(Proto::RequestHeader));
+    for (std::size_t i = 0; i < count; ++i) {
+        message->append(fragments[i].iov_base, fragments[i].iov_len);
+    }
+    bufferRequest(destination, std::move(message));
+    Perf::counters.server_api_cycles.add(timer.split());
+}
+
+/**
+ * @copydoc ServerTask::delegateMany()
+ */
+template <typename MutexType>
+void
+BasicServerTaskImpl<MutexType>::delegateMany(
+    const Homa::Driver::Address destinations[], std::size_t count,
+    const void* request, std::size_t length)
+{
+    Perf::Timer timer;
+    if (count == 0) {
+        return;
+    }
+
     // Send out any previously buffered message
     sendBufferedMessage();
 
-    // Format the delegated request message
-    bufferedMessageIsRequest = true;
+    // All but the last request are sent right away; they share the same
+    // header except for the BranchId.  The delegated manifest, if any, is
+    // piggy-backed on the first request as it would be with delegate().
+    Proto::RequestHeader header(rooId, Proto::RequestId());
+    socket->transport->getDriver()->addressToWireFormat(
+        replyAddress, &header.replyAddress);
+    for (std::size_t i = 0; i + 1 < count; ++i) {
+        header.requestId =
+            Proto::RequestId(Proto::BranchId(taskId, requestCount), 0);
+        requestCount += 1;
+        header.hasManifest = hasUnsentManifest;
+        if (hasUnsentManifest) {
+            // piggy-back the delegated manifest
+            header.manifest = delegatedManifest;
+            hasUnsentManifest = false;
+        }
+        Homa::unique_ptr<Homa::OutMessage> message =
+            socket->transport->alloc();
+        message->append(&header, sizeof(Proto::RequestHeader));
+        message->append(request, length);
+        Perf::counters.tx_message_bytes.add(sizeof(Proto::RequestHeader) +
+                                            length);
+        message->send(destinations[i], Homa::OutMessage::NO_RETRY |
+                                           Homa::OutMessage::NO_KEEP_ALIVE);
+    }
+    if (count > 1) {
+        // Record the destinations only once their requests are out so that a
+        // ping is never answered with a branch that has not been sent.
+        Lock lock(pingInfo.mutex);
+        pingInfo.destinations.insert(pingInfo.destinations.end(), destinations,
+                                     destinations + count - 1);
+    }
+
+    // Buffer the last request so that this task's manifest can still be
+    // piggy-backed on it.
     Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
     message->reserve(sizeof(Proto::RequestHeader));
     message->append(request, length);
-    Proto::BranchId newBranchId(taskId, requestCount);
-    requestCount += 1;
-    Proto::RequestId newRequestId(newBranchId, 0);
-    new (bufferedRequestHeader) Proto::RequestHeader(rooId, newRequestId);
-    socket->transport->getDriver()->addressToWireFormat(
-        replyAddress, &bufferedRequestHeader->replyAddress);
-    if (hasUnsentManifest) {
-        // piggy-back the delegated manifest
-        bufferedRequestHeader->hasManifest = true;
-        bufferedRequestHeader->manifest = delegatedManifest;
-        hasUnsentManifest = false;
+    bufferRequest(destinations[count - 1], std::move(message));
+    if (count > 1) {
+        // The transport needs the polling thread to finish sending.
+        socket->wakeup();
     }
-    bufferedMessageAddress = destination;
-    bufferedMessage = std::move(message);
+    Perf::counters.server_api_cycles.add(timer.split());
+}
+
+/**
+ * @copydoc ServerTask::forward()
+ */
+template <typename MutexType>
+void
+BasicServerTaskImpl<MutexType>::forward(Homa::Driver::Address destination,
+                                        const void* prefix,
+                                        std::size_t prefixLength)
+{
+    Perf::Timer timer;
+    assert(request);
 
+    // Format the delegated request message; the incoming payload is moved
+    // between the two messages in chunks so that it is never staged in a
+    // buffer sized to the whole request.
+    Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
+    message->reserve(sizeof(Proto::RequestHeader));
+    if (prefixLength > 0) {
+        message->append(prefix, prefixLength);
+    }
+    char chunk[FORWARD_CHUNK_SIZE];
+    const std::size_t length = request->length();
+    std::size_t offset = 0;
+    while (offset < length) {
+        std::size_t count = std::min(FORWARD_CHUNK_SIZE, length - offset);
+        count = request->get(offset, chunk, count);
+        if (count == 0) {
+            break;
+        }
+        message->append(chunk, count);
+        offset += count;
+    }
+    bufferRequest(destination, std::move(message));
     Perf::counters.server_api_cycles.add(timer.split());
 }
 
@@ -160,14 +296,15 @@ ServerTaskImpl::delegate(Homa::Driver::Address destination, const void* request,
  * @param message
  *      The incoming message containing the Ping.
  */
+template <typename MutexType>
 void
-ServerTaskImpl::handlePing(Proto::PingHeader* header,
-                           Homa::unique_ptr<Homa::InMessage> message)
+BasicServerTaskImpl<MutexType>::handlePing(
+    Proto::PingHeader* header, Homa::unique_ptr<Homa::InMessage> message)
 {
     (void)header;
     (void)message;
 
-    SpinLock::Lock lock(pingInfo.mutex);
+    Lock lock(pingInfo.mutex);
     pingInfo.pingCount++;
 
     // Send back a Pong with all availble current information about this task.
@@ -178,10 +315,12 @@ ServerTaskImpl::handlePing(Proto::PingHeader* header,
     // the client pings will not succeed.
 
     // Branch is complete if detached and not in the special case where the task
-    // has only a single delegate request.
+    // has only a single delegate request (which then continues the branch
+    // unless messages are sent eagerly).
     const bool isTaskComplete = detached;
     const bool isBranchComplete =
-        isTaskComplete && !(requestCount == 1 && responseCount == 0);
+        isTaskComplete &&
+        (eagerSend || !(requestCount == 1 && responseCount == 0));
     const uint32_t requestsSent = pingInfo.destinations.size();
     std::vector<Homa::Driver::WireFormatAddress> destinations;
     for (auto& destination : pingInfo.destinations) {
@@ -204,10 +343,11 @@ ServerTaskImpl::handlePing(Proto::PingHeader* header,
  *      True if the ServerTask timeout should be reset; false if the ServerTask
  *      has expired.
  */
+template <typename MutexType>
 bool
-ServerTaskImpl::handleTimeout()
+BasicServerTaskImpl<MutexType>::handleTimeout()
 {
-    SpinLock::Lock lock(pingInfo.mutex);
+    Lock lock(pingInfo.mutex);
     if (!detached.load()) {
         return true;
     } else if (pingInfo.pingCount > 0) {
@@ -221,27 +361,20 @@ ServerTaskImpl::handleTimeout()
 /**
  * @copydoc ServerTask::destroy()
  */
+template <typename MutexType>
 void
-ServerTaskImpl::destroy()
+BasicServerTaskImpl<MutexType>::destroy()
 {
     Perf::Timer timer;
 
     if (responseCount + requestCount == 0) {
         // Task didn't generate any outbound messages; send Manifest message.
-        Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
-        Proto::ManifestHeader header(rooId, hasUnsentManifest ? 2 : 1);
-        Proto::Manifest manifest(requestId, taskId, requestCount,
-                                 responseCount);
-        socket->transport->getDriver()->addressToWireFormat(
-            socket->transport->getDriver()->getLocalAddress(),
-            &manifest.serverAddress);
-        message->append(&header, sizeof(Proto::ManifestHeader));
-        if (hasUnsentManifest) {
-            message->append(&delegatedManifest, sizeof(Proto::Manifest));
-        }
-        message->append(&manifest, sizeof(Proto::Manifest));
-        message->send(replyAddress, Homa::OutMessage::NO_RETRY |
-                                        Homa::OutMessage::NO_KEEP_ALIVE);
+        sendManifest();
+    } else if (eagerSend) {
+        // Every outbound message has already been sent; the manifest has
+        // nothing to ride along with.
+        assert(!bufferedMessage);
+        sendManifest();
     } else if (responseCount + requestCount == 1) {
         // Only a single outbound message; use Manifest elimination.
         assert(bufferedMessage);
@@ -275,8 +408,9 @@ ServerTaskImpl::destroy()
         sendBufferedMessage();
     }
 
-    // Request mesage no longer needed.
+    // Request mesage no longer needed; an uncommitted reply is never sent.
     request.reset();
+    pendingReply.reset();
 
     // Don't delete the ServerTask yet; mark it as detached so that the Socket
     // will know when it asks this ServerTask to handle the task timeout.
@@ -284,18 +418,114 @@ ServerTaskImpl::destroy()
     Perf::counters.server_api_cycles.add(timer.split());
 }
 
+/**
+ * Buffer a formatted response message in place of any previously buffered
+ * message, which is sent out first.
+ *
+ * @param message
+ *      Response message with space reserved for the Proto::ResponseHeader.
+ */
+template <typename MutexType>
+void
+BasicServerTaskImpl<MutexType>::bufferResponse(
+    Homa::unique_ptr<Homa::OutMessage> message)
+{
+    // Send out any previously buffered message
+    sendBufferedMessage();
+
+    bufferedMessageIsRequest = false;
+    new (bufferedResponseHeader) Proto::ResponseHeader(
+        rooId, requestId.branchId, Proto::ResponseId(taskId, responseCount));
+    responseCount += 1;
+    if (hasUnsentManifest) {
+        // piggy-back the delegated manifest
+        bufferedResponseHeader->hasManifest = true;
+        bufferedResponseHeader->manifest = delegatedManifest;
+        hasUnsentManifest = false;
+    }
+    bufferedMessageAddress = replyAddress;
+    bufferedMessage = std::move(message);
+    if (eagerSend) {
+        sendBufferedMessage();
+    }
+}
+
+/**
+ * Send this task's manifest, along with any manifest still pending from the
+ * incoming request, in a separate Manifest message.
+ */
+template <typename MutexType>
+void
+BasicServerTaskImpl<MutexType>::sendManifest()
+{
+    Homa::unique_ptr<Homa::OutMessage> message = socket->transport->alloc();
+    Proto::ManifestHeader header(rooId, hasUnsentManifest ? 2 : 1);
+    Proto::Manifest manifest(requestId, taskId, requestCount, responseCount);
+    socket->transport->getDriver()->addressToWireFormat(
+        socket->transport->getDriver()->getLocalAddress(),
+        &manifest.serverAddress);
+    message->append(&header, sizeof(Proto::ManifestHeader));
+    if (hasUnsentManifest) {
+        message->append(&delegatedManifest, sizeof(Proto::Manifest));
+        hasUnsentManifest = false;
+    }
+    message->append(&manifest, sizeof(Proto::Manifest));
+    message->send(replyAddress,
+                  Homa::OutMessage::NO_RETRY | Homa::OutMessage::NO_KEEP_ALIVE);
+    socket->wakeup();
+}
+
+/**
+ * Buffer a formatted request message in place of any previously buffered
+ * message, which is sent out first.
+ *
+ * @param destination
+ *      Address to which the request message should be sent.
+ * @param message
+ *      Request message with space reserved for the Proto::RequestHeader.
+ */
+template <typename MutexType>
+void
+BasicServerTaskImpl<MutexType>::bufferRequest(
+    Homa::Driver::Address destination,
+    Homa::unique_ptr<Homa::OutMessage> message)
+{
+    // Send out any previously buffered message
+    sendBufferedMessage();
+
+    bufferedMessageIsRequest = true;
+    Proto::BranchId newBranchId(taskId, requestCount);
+    requestCount += 1;
+    Proto::RequestId newRequestId(newBranchId, 0);
+    new (bufferedRequestHeader) Proto::RequestHeader(rooId, newRequestId);
+    socket->transport->getDriver()->addressToWireFormat(
+        replyAddress, &bufferedRequestHeader->replyAddress);
+    if (hasUnsentManifest) {
+        // piggy-back the delegated manifest
+        bufferedRequestHeader->hasManifest = true;
+        bufferedRequestHeader->manifest = delegatedManifest;
+        hasUnsentManifest = false;
+    }
+    bufferedMessageAddress = destination;
+    bufferedMessage = std::move(message);
+    if (eagerSend) {
+        sendBufferedMessage();
+    }
+}
+
 /**
  * Send the buffered message.
  */
+template <typename MutexType>
 void
-ServerTaskImpl::sendBufferedMessage()
+BasicServerTaskImpl<MutexType>::sendBufferedMessage()
 {
     if (bufferedMessage) {
         Perf::counters.tx_message_bytes.add(bufferedMessage->length());
         if (bufferedMessageIsRequest) {
             bufferedMessage->prepend(bufferedRequestHeader,
                                      sizeof(Proto::RequestHeader));
-            SpinLock::Lock lock(pingInfo.mutex);
+            Lock lock(pingInfo.mutex);
             // Assert that the destinations are added in order.
             assert(
                 (Proto::RequestId{
@@ -313,7 +543,12 @@ ServerTaskImpl::sendBufferedMessage()
             bufferedMessageAddress,
             Homa::OutMessage::NO_RETRY | Homa::OutMessage::NO_KEEP_ALIVE);
         bufferedMessage.reset();
+        // The transport needs the polling thread to finish sending.
+        socket->wakeup();
     }
 }
 
+template class BasicServerTaskImpl<SpinLock>;
+template class BasicServerTaskImpl<NullLock>;
+
 }  // namespace Roo
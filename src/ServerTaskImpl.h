@@ -21,29 +21,50 @@
 
 #include <vector>
 
+#include "NullLock.h"
 #include "Proto.h"
 #include "SpinLock.h"
 
 namespace Roo {
 
 // Forward declaration
-class SocketImpl;
+template <typename MutexType>
+class BasicSocketImpl;
 
 /**
  * Implementation of Roo::ServerTask.
  *
  * This class is NOT thread-safe.
+ *
+ * @tparam MutexType
+ *      Lock type of the managing BasicSocketImpl.
  */
-class ServerTaskImpl : public ServerTask {
+template <typename MutexType>
+class BasicServerTaskImpl : public ServerTask {
   public:
-    explicit ServerTaskImpl(SocketImpl* socket, Proto::TaskId taskId,
-                            Proto::RequestHeader const* requestHeader,
-                            Homa::unique_ptr<Homa::InMessage> request);
-    virtual ~ServerTaskImpl();
+    /// Socket implementation that manages this ServerTask.
+    using SocketImpl = BasicSocketImpl<MutexType>;
+
+    /// RAII guard that holds a MutexType.
+    using Lock = typename MutexType::Lock;
+
+    explicit BasicServerTaskImpl(SocketImpl* socket, Proto::TaskId taskId,
+                                 Proto::RequestHeader const* requestHeader,
+                                 Homa::unique_ptr<Homa::InMessage> request);
+    virtual ~BasicServerTaskImpl();
     virtual Homa::InMessage* getRequest();
     virtual void reply(const void* response, std::size_t length);
+    virtual ReplyBuffer allocReply();
+    virtual void commitReply();
     virtual void delegate(Homa::Driver::Address destination,
                           const void* request, std::size_t length);
+    virtual void delegate(Homa::Driver::Address destination,
+                          const struct iovec* fragments, std::size_t count);
+    virtual void delegateMany(const Homa::Driver::Address destinations[],
+                              std::size_t count, const void* request,
+                              std::size_t length);
+    virtual void forward(Homa::Driver::Address destination,
+                         const void* prefix, std::size_t prefixLength);
     void handlePing(Proto::PingHeader* header,
                     Homa::unique_ptr<Homa::InMessage> message);
     bool handleTimeout();
@@ -60,8 +81,16 @@ class ServerTaskImpl : public ServerTask {
     virtual void destroy();
 
   private:
+    void sendManifest();
+    void bufferRequest(Homa::Driver::Address destination,
+                       Homa::unique_ptr<Homa::OutMessage> message);
+    void bufferResponse(Homa::unique_ptr<Homa::OutMessage> message);
     void sendBufferedMessage();
 
+    /// Size of the fixed buffer through which forward() copies the incoming
+    /// request so that the whole request is never staged in one buffer.
+    static const std::size_t FORWARD_CHUNK_SIZE = 1024;
+
     /// True if the ServerTask is no longer held by the application and is being
     /// processed by the Socket.
     std::atomic<bool> detached;
@@ -95,7 +124,7 @@ class ServerTaskImpl : public ServerTask {
     /// Hold information used to handle pings and timeouts.
     struct {
         /// Protects access to this structure.
-        SpinLock mutex;
+        MutexType mutex;
 
         /// Destination address for each delegated request in increasing order
         /// of RequestId.
@@ -127,6 +156,14 @@ class ServerTaskImpl : public ServerTask {
     /// A request or response message that has been buffered to be sent later.
     Homa::unique_ptr<Homa::OutMessage> bufferedMessage;
 
+    /// Response message returned by allocReply() that the application is
+    /// still filling in; buffered once commitReply() is called.
+    Homa::unique_ptr<Homa::OutMessage> pendingReply;
+
+    /// True if outbound messages are sent right away instead of buffered; the
+    /// manifest is then sent in its own message.
+    bool const eagerSend;
+
     /// True if a manifest that was piggy-backed on the incoming request still
     /// needs to be sent.
     bool hasUnsentManifest;
@@ -135,6 +172,9 @@ class ServerTaskImpl : public ServerTask {
     Proto::Manifest delegatedManifest;
 };
 
+/// ServerTask implementation of a thread-safe socket.
+using ServerTaskImpl = BasicServerTaskImpl<SpinLock>;
+
 }  // namespace Roo
 
 #endif  // ROO_SERVERTASKIMPL_H
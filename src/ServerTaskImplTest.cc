@@ -16,6 +16,8 @@
 #include <gtest/gtest.h>
 
 #include <cstring>
+#include <string>
+#include <vector>
 
 #include "Mock/MockHoma.h"
 #include "ServerTaskImpl.h"
@@ -29,6 +31,7 @@ using ::testing::An;
 using ::testing::ByMove;
 using ::testing::Eq;
 using ::testing::InSequence;
+using ::testing::Invoke;
 using ::testing::NiceMock;
 using ::testing::Return;
 using ::testing::TypedEq;
@@ -56,7 +59,7 @@ class ServerTaskImplTest : public ::testing::Test {
     ~ServerTaskImplTest()
     {
         if (handle != nullptr) {
-            socket->taskPool.destroy(handle);
+            socket->shards[0].taskPool.destroy(handle);
         }
         delete socket;
     }
@@ -72,11 +75,20 @@ class ServerTaskImplTest : public ::testing::Test {
         header.rooId = Proto::RooId(1, 1);
         header.requestId = Proto::RequestId{{{2, 2}, 3}, 0};
         Homa::unique_ptr<Homa::InMessage> request(&mockRequest);
-        handle = socket->taskPool.construct(socket, Proto::TaskId(42, 1),
-                                            &header, std::move(request));
+        handle = socket->shards[0].taskPool.construct(
+            socket, Proto::TaskId(42, 1), &header, std::move(request));
         task = &handle->task;
     }
 
+    void enableEagerSend()
+    {
+        delete socket;
+        SocketOptions options;
+        options.eagerSend = true;
+        EXPECT_CALL(transport, getId());
+        socket = new SocketImpl(&transport, options);
+    }
+
     Mock::Homa::MockTransport transport;
     Mock::Homa::MockDriver driver;
     NiceMock<Mock::Homa::MockInMessage> mockRequest;
@@ -163,6 +175,187 @@ TEST_F(ServerTaskImplTest, reply)
     EXPECT_CALL(outMessage, release());
 }
 
+TEST_F(ServerTaskImplTest, commitReply_notAllocated)
+{
+    initDefaultTask();
+
+    task->commitReply();
+
+    EXPECT_EQ(0, task->responseCount);
+    EXPECT_FALSE(task->bufferedMessage);
+}
+
+TEST_F(ServerTaskImplTest, reply_eagerSend)
+{
+    enableEagerSend();
+    initDefaultTask();
+
+    char buffer[64];
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    EXPECT_CALL(outMessage, reserve(Eq(sizeof(Proto::ResponseHeader))));
+    EXPECT_CALL(outMessage, append(Eq(buffer), Eq(sizeof(buffer))));
+    EXPECT_CALL(outMessage, length());
+    EXPECT_CALL(outMessage, prepend(Eq(task->bufferedResponseHeader),
+                                    Eq(sizeof(Proto::ResponseHeader))));
+    EXPECT_CALL(outMessage,
+                send(Eq(replyAddress), Eq(Homa::OutMessage::NO_RETRY |
+                                          Homa::OutMessage::NO_KEEP_ALIVE)));
+    EXPECT_CALL(outMessage, release());
+
+    task->reply(buffer, sizeof(buffer));
+
+    EXPECT_EQ(1, task->responseCount);
+    EXPECT_FALSE(task->bufferedMessage);
+}
+
+TEST_F(ServerTaskImplTest, allocReply)
+{
+    initDefaultTask();
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    EXPECT_CALL(outMessage, reserve(Eq(sizeof(Proto::ResponseHeader))));
+
+    ReplyBuffer reply = task->allocReply();
+
+    EXPECT_EQ(&outMessage, reply.message);
+    EXPECT_EQ(&outMessage, task->pendingReply.get());
+    EXPECT_EQ(0, task->responseCount);
+    EXPECT_FALSE(task->bufferedMessage);
+
+    EXPECT_CALL(outMessage, release());
+}
+
+TEST_F(ServerTaskImplTest, allocReply_alreadyAllocated)
+{
+    initDefaultTask();
+    task->pendingReply = Homa::unique_ptr<Homa::OutMessage>(&outMessage);
+
+    EXPECT_CALL(transport, alloc()).Times(0);
+
+    EXPECT_EQ(&outMessage, task->allocReply().message);
+    EXPECT_EQ(&outMessage, task->pendingReply.get());
+
+    EXPECT_CALL(outMessage, release());
+}
+
+TEST_F(ServerTaskImplTest, commitReply)
+{
+    initDefaultTask();
+
+    task->hasUnsentManifest = true;
+    task->delegatedManifest.taskId = task->rooId;
+    task->pendingReply = Homa::unique_ptr<Homa::OutMessage>(&outMessage);
+
+    task->commitReply();
+
+    EXPECT_FALSE(task->pendingReply);
+    EXPECT_FALSE(task->bufferedMessageIsRequest);
+    EXPECT_EQ(task->rooId, task->bufferedResponseHeader->rooId);
+    EXPECT_EQ(task->requestId.branchId, task->bufferedResponseHeader->branchId);
+    EXPECT_EQ(Proto::ResponseId(task->taskId, 0),
+              task->bufferedResponseHeader->responseId);
+    EXPECT_EQ(1, task->responseCount);
+    EXPECT_TRUE(task->bufferedResponseHeader->hasManifest);
+    EXPECT_EQ(task->delegatedManifest.taskId,
+              task->bufferedResponseHeader->manifest.taskId);
+    EXPECT_FALSE(task->hasUnsentManifest);
+    EXPECT_EQ(replyAddress, task->bufferedMessageAddress);
+    EXPECT_EQ(&outMessage, task->bufferedMessage.get());
+
+    EXPECT_CALL(outMessage, release());
+}
+
+/**
+ * Stands in for the bytes a Homa::OutMessage puts on the wire.
+ */
+struct FakeWire {
+    FakeWire()
+        : reserved(0)
+        , bytes()
+        , sent()
+    {}
+    void reserve(std::size_t count)
+    {
+        reserved += count;
+    }
+    void append(const void* source, std::size_t count)
+    {
+        bytes.append(static_cast<const char*>(source), count);
+    }
+    void prepend(const void* source, std::size_t count)
+    {
+        ASSERT_GE(reserved, count);
+        reserved -= count;
+        bytes.insert(0, static_cast<const char*>(source), count);
+    }
+    std::size_t length() const
+    {
+        return bytes.size();
+    }
+    void send(Homa::Driver::Address, Homa::OutMessage::Options)
+    {
+        EXPECT_EQ(0U, reserved);
+        sent.push_back(bytes);
+        bytes.clear();
+    }
+
+    std::size_t reserved;
+    std::string bytes;
+    std::vector<std::string> sent;
+};
+
+TEST_F(ServerTaskImplTest, commitReply_matchesReply)
+{
+    enableEagerSend();
+    initDefaultTask();
+    FakeWire wire;
+    const char payload[] = "response payload";
+
+    EXPECT_CALL(transport, alloc())
+        .Times(2)
+        .WillRepeatedly(Invoke([this] {
+            return Homa::unique_ptr<Homa::OutMessage>(&outMessage);
+        }));
+    EXPECT_CALL(outMessage, reserve(_))
+        .WillRepeatedly(Invoke(&wire, &FakeWire::reserve));
+    EXPECT_CALL(outMessage, append(_, _))
+        .WillRepeatedly(Invoke(&wire, &FakeWire::append));
+    EXPECT_CALL(outMessage, prepend(_, _))
+        .WillRepeatedly(Invoke(&wire, &FakeWire::prepend));
+    EXPECT_CALL(outMessage, length())
+        .WillRepeatedly(Invoke(&wire, &FakeWire::length));
+    EXPECT_CALL(outMessage, send(_, _))
+        .WillRepeatedly(Invoke(&wire, &FakeWire::send));
+    EXPECT_CALL(outMessage, release()).Times(2);
+
+    task->reply(payload, sizeof(payload));
+    ReplyBuffer reply = task->allocReply();
+    reply.append(payload, 4);
+    reply.append(payload + 4, sizeof(payload) - 4);
+    task->commitReply();
+
+    ASSERT_EQ(2U, wire.sent.size());
+    ASSERT_EQ(sizeof(Proto::ResponseHeader) + sizeof(payload),
+              wire.sent[1].size());
+    EXPECT_EQ(wire.sent[0].size(), wire.sent[1].size());
+
+    // Same header apart from the response's sequence number, then the payload.
+    Proto::ResponseHeader headers[2];
+    for (int i = 0; i < 2; ++i) {
+        std::memcpy(&headers[i], wire.sent[i].data(), sizeof(headers[i]));
+        EXPECT_EQ(Proto::ResponseId(task->taskId, i), headers[i].responseId);
+        EXPECT_EQ(0, std::memcmp(wire.sent[i].data() + sizeof(headers[i]),
+                                 payload, sizeof(payload)));
+    }
+    headers[1].responseId = headers[0].responseId;
+    EXPECT_EQ(0, std::memcmp(&headers[0], &headers[1], sizeof(headers[0])));
+}
+
 TEST_F(ServerTaskImplTest, delegate)
 {
     initDefaultTask();
@@ -202,11 +395,153 @@ TEST_F(ServerTaskImplTest, delegate)
     EXPECT_CALL(outMessage, release());
 }
 
+TEST_F(ServerTaskImplTest, delegate_fragments)
+{
+    initDefaultTask();
+
+    char header[16];
+    char payload[64];
+    struct iovec fragments[2] = {{header, sizeof(header)},
+                                 {payload, sizeof(payload)}};
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    {
+        InSequence s;
+        EXPECT_CALL(outMessage, reserve(Eq(sizeof(Proto::RequestHeader))));
+        EXPECT_CALL(outMessage, append(Eq(header), Eq(sizeof(header))));
+        EXPECT_CALL(outMessage, append(Eq(payload), Eq(sizeof(payload))));
+    }
+    EXPECT_CALL(transport, getDriver());
+    EXPECT_CALL(driver,
+                addressToWireFormat(Eq(replyAddress),
+                                    An<Homa::Driver::WireFormatAddress*>()));
+
+    task->delegate(0xFEED, fragments, 2);
+
+    EXPECT_TRUE(task->bufferedMessageIsRequest);
+    EXPECT_EQ(1, task->requestCount);
+    EXPECT_EQ(Proto::RequestId({task->taskId, 0}, 0),
+              task->bufferedRequestHeader->requestId);
+    EXPECT_EQ(0xFEED, task->bufferedMessageAddress);
+    EXPECT_EQ(&outMessage, task->bufferedMessage.get());
+
+    EXPECT_CALL(outMessage, release());
+}
+
 ACTION_P(SaveBlob, pointer)
 {
     std::memcpy(pointer, arg0, arg1);
 }
 
+TEST_F(ServerTaskImplTest, delegateMany)
+{
+    initDefaultTask();
+
+    task->hasUnsentManifest = true;
+    task->delegatedManifest.taskId = task->rooId;
+
+    char buffer[64];
+    Homa::Driver::Address destinations[2] = {0xFEED, 0xBEEF};
+    Proto::RequestHeader sentHeader;
+    Mock::Homa::MockOutMessage firstMessage;
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&firstMessage))))
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    EXPECT_CALL(transport, getDriver()).Times(2);
+    EXPECT_CALL(driver,
+                addressToWireFormat(Eq(replyAddress),
+                                    An<Homa::Driver::WireFormatAddress*>()))
+        .Times(2);
+    EXPECT_CALL(firstMessage,
+                append(An<const void*>(), Eq(sizeof(Proto::RequestHeader))))
+        .WillOnce(SaveBlob(&sentHeader));
+    EXPECT_CALL(firstMessage, append(Eq(buffer), Eq(sizeof(buffer))));
+    std::size_t destinationsAtSend = 1;
+    EXPECT_CALL(firstMessage,
+                send(Eq(0xFEED), Eq(Homa::OutMessage::NO_RETRY |
+                                    Homa::OutMessage::NO_KEEP_ALIVE)))
+        .WillOnce(Invoke([&](Homa::Driver::Address, Homa::OutMessage::Options) {
+            destinationsAtSend = task->pingInfo.destinations.size();
+        }));
+    EXPECT_CALL(firstMessage, release());
+    EXPECT_CALL(outMessage, reserve(Eq(sizeof(Proto::RequestHeader))));
+    EXPECT_CALL(outMessage, append(Eq(buffer), Eq(sizeof(buffer))));
+
+    task->delegateMany(destinations, 2, buffer, sizeof(buffer));
+
+    EXPECT_EQ(Proto::RequestId({task->taskId, 0}, 0), sentHeader.requestId);
+    EXPECT_TRUE(sentHeader.hasManifest);
+    EXPECT_EQ(task->delegatedManifest.taskId, sentHeader.manifest.taskId);
+    // Destinations are only recorded once their requests have been sent.
+    EXPECT_EQ(0U, destinationsAtSend);
+    EXPECT_EQ(1U, task->pingInfo.destinations.size());
+    EXPECT_EQ(0xFEED, task->pingInfo.destinations.at(0));
+
+    EXPECT_EQ(2, task->requestCount);
+    EXPECT_TRUE(task->bufferedMessageIsRequest);
+    EXPECT_EQ(Proto::RequestId({task->taskId, 1}, 0),
+              task->bufferedRequestHeader->requestId);
+    EXPECT_FALSE(task->bufferedRequestHeader->hasManifest);
+    EXPECT_EQ(0xBEEF, task->bufferedMessageAddress);
+    EXPECT_EQ(&outMessage, task->bufferedMessage.get());
+
+    EXPECT_CALL(outMessage, release());
+}
+
+TEST_F(ServerTaskImplTest, forward)
+{
+    initDefaultTask();
+
+    task->hasUnsentManifest = true;
+    task->delegatedManifest.taskId = task->rooId;
+
+    char prefix[16];
+    const std::size_t length = ServerTaskImpl::FORWARD_CHUNK_SIZE + 10;
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    EXPECT_CALL(outMessage, reserve(Eq(sizeof(Proto::RequestHeader))));
+    EXPECT_CALL(outMessage, append(Eq(prefix), Eq(sizeof(prefix))));
+    EXPECT_CALL(mockRequest, length()).WillOnce(Return(length));
+    {
+        InSequence s;
+        EXPECT_CALL(mockRequest,
+                    get(Eq(0), _, Eq(ServerTaskImpl::FORWARD_CHUNK_SIZE)))
+            .WillOnce(Return(ServerTaskImpl::FORWARD_CHUNK_SIZE));
+        EXPECT_CALL(outMessage,
+                    append(_, Eq(ServerTaskImpl::FORWARD_CHUNK_SIZE)));
+        EXPECT_CALL(mockRequest,
+                    get(Eq(ServerTaskImpl::FORWARD_CHUNK_SIZE), _, Eq(10)))
+            .WillOnce(Return(10));
+        EXPECT_CALL(outMessage, append(_, Eq(10)));
+    }
+    EXPECT_CALL(transport, getDriver());
+    EXPECT_CALL(driver,
+                addressToWireFormat(Eq(replyAddress),
+                                    An<Homa::Driver::WireFormatAddress*>()));
+
+    task->forward(0xFEED, prefix, sizeof(prefix));
+
+    EXPECT_TRUE(task->bufferedMessageIsRequest);
+    EXPECT_EQ(1, task->requestCount);
+    EXPECT_EQ(Proto::RequestId({task->taskId, 0}, 0),
+              task->bufferedRequestHeader->requestId);
+    EXPECT_TRUE(task->bufferedRequestHeader->hasManifest);
+    EXPECT_EQ(task->delegatedManifest.taskId,
+              task->bufferedRequestHeader->manifest.taskId);
+    EXPECT_FALSE(task->hasUnsentManifest);
+    EXPECT_EQ(0xFEED, task->bufferedMessageAddress);
+    EXPECT_EQ(&outMessage, task->bufferedMessage.get());
+
+    EXPECT_CALL(outMessage, release());
+}
+
 TEST_F(ServerTaskImplTest, handlePing)
 {
     initDefaultTask();
@@ -306,6 +641,40 @@ TEST_F(ServerTaskImplTest, destroy_noMessages)
     EXPECT_TRUE(task->detached);
 }
 
+TEST_F(ServerTaskImplTest, destroy_eagerSend)
+{
+    enableEagerSend();
+    initDefaultTask();
+
+    task->requestCount = 1;
+    task->responseCount = 1;
+    Proto::Manifest manifest;
+
+    EXPECT_CALL(transport, alloc())
+        .WillOnce(
+            Return(ByMove(Homa::unique_ptr<Homa::OutMessage>(&outMessage))));
+    EXPECT_CALL(transport, getDriver()).Times(2);
+    EXPECT_CALL(driver, getLocalAddress()).WillOnce(Return(0xFEED));
+    EXPECT_CALL(driver,
+                addressToWireFormat(Eq(0xFEED),
+                                    An<Homa::Driver::WireFormatAddress*>()));
+    EXPECT_CALL(outMessage, append(_, Eq(sizeof(Proto::ManifestHeader))));
+    EXPECT_CALL(outMessage, append(_, Eq(sizeof(Proto::Manifest))))
+        .WillOnce(SaveBlob(&manifest));
+    EXPECT_CALL(outMessage,
+                send(Eq(replyAddress), Eq(Homa::OutMessage::NO_RETRY |
+                                          Homa::OutMessage::NO_KEEP_ALIVE)));
+    EXPECT_CALL(outMessage, release());
+    EXPECT_CALL(mockRequest, release());
+
+    task->destroy();
+
+    EXPECT_EQ(task->requestId, manifest.requestId);
+    EXPECT_EQ(1U, manifest.requestCount);
+    EXPECT_EQ(1U, manifest.responseCount);
+    EXPECT_TRUE(task->detached);
+}
+
 TEST_F(ServerTaskImplTest, destroy_request_single)
 {
     initDefaultTask();
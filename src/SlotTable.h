@@ -0,0 +1,207 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_SLOTTABLE_H
+#define ROO_SLOTTABLE_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "Intrusive.h"
+
+namespace Roo {
+
+/**
+ * Maps keys that are allocated in (roughly) increasing order to pointers.
+ *
+ * Each key maps to a slot in a fixed size ring using the index returned by
+ * the Index function object; consecutive keys should have consecutive
+ * indexes.  As long as keys are removed before the ring wraps, a lookup is a
+ * single array access validated by comparing the full key; no hashing is
+ * performed.  If a key's slot is still occupied by an older key (e.g. a long
+ * lived entry), the newer key is stored in a fallback hash table instead; the
+ * fallback is intrusive so neither path allocates memory.
+ *
+ * This class is NOT thread-safe.
+ *
+ * @tparam Key
+ *      Type of the keys; must be equality comparable, default constructible
+ *      and provide a Key::Hasher.
+ * @tparam Element
+ *      Type of the mapped objects.
+ * @tparam Index
+ *      Function object that maps a Key to a uint64_t slot index.
+ * @tparam FallbackNode
+ *      Member of Element used to link the element into the fallback table.
+ */
+template <typename Key, typename Element, typename Index,
+          typename Intrusive::HashTable<Key, Element>::Node Element::*
+              FallbackNode>
+class SlotTable {
+  public:
+    /**
+     * Construct an empty table.
+     *
+     * @param numSlots
+     *      Number of slots in the ring; must be a power of 2.
+     */
+    explicit SlotTable(std::size_t numSlots)
+        : slots(new Slot[numSlots])
+        , mask(numSlots - 1)
+        , fallback()
+        , count(0)
+    {
+        assert(numSlots > 0);
+        assert((numSlots & (numSlots - 1)) == 0);
+    }
+
+    /**
+     * Return the element mapped to the given key or nullptr if the key is
+     * not in the table.
+     */
+    Element* find(const Key& key) const
+    {
+        const Slot& slot = slots[Index()(key) & mask];
+        if (slot.element != nullptr && slot.key == key) {
+            return slot.element;
+        }
+        if (fallback.empty()) {
+            return nullptr;
+        }
+        return fallback.find(key);
+    }
+
+    /**
+     * Add a mapping from the given key to the given element.  The key must
+     * not already be in the table.
+     */
+    void insert(const Key& key, Element* element)
+    {
+        assert(element != nullptr);
+        assert(find(key) == nullptr);
+        Slot& slot = slots[Index()(key) & mask];
+        if (slot.element == nullptr) {
+            slot.key = key;
+            slot.element = element;
+        } else {
+            fallback.insert(key, &(element->*FallbackNode));
+        }
+        count++;
+    }
+
+    /**
+     * Remove the mapping for the given key.
+     *
+     * @return
+     *      True if the key was removed; false if the key was not in the table.
+     */
+    bool remove(const Key& key)
+    {
+        Slot& slot = slots[Index()(key) & mask];
+        if (slot.element != nullptr && slot.key == key) {
+            slot.element = nullptr;
+            count--;
+            return true;
+        }
+        if (!fallback.empty() && fallback.remove(key) != nullptr) {
+            count--;
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Call func(element) for every element in the table.  The function may
+     * remove the element it is given (and destroy it) but must not otherwise
+     * modify the table.
+     */
+    template <typename Function>
+    void forEach(Function func)
+    {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            if (slots[i].element != nullptr) {
+                func(slots[i].element);
+            }
+        }
+        fallback.forEach(func);
+    }
+
+    /**
+     * Remove all entries from the table.
+     */
+    void clear()
+    {
+        for (std::size_t i = 0; i <= mask; ++i) {
+            slots[i].element = nullptr;
+        }
+        fallback.clear();
+        count = 0;
+    }
+
+    /**
+     * Return the number of entries in the table.
+     */
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    /**
+     * Return true if the table has no entries.
+     */
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+  private:
+    /**
+     * A single entry in the ring.
+     */
+    struct Slot {
+        Slot()
+            : key()
+            , element(nullptr)
+        {}
+
+        /// Key of the entry occupying this slot; only valid if element is set.
+        Key key;
+
+        /// Element mapped to key or nullptr if the slot is unoccupied.
+        Element* element;
+    };
+
+    /// Ring of slots indexed by the key's Index.
+    std::unique_ptr<Slot[]> const slots;
+
+    /// Number of slots minus one; used to map an Index to a slot.
+    std::size_t const mask;
+
+    /// Entries whose slot was occupied at the time of insertion.
+    Intrusive::HashTable<Key, Element> fallback;
+
+    /// Number of entries in the table.
+    std::size_t count;
+
+    // Disable copy and assign
+    SlotTable(const SlotTable&) = delete;
+    SlotTable& operator=(const SlotTable&) = delete;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_SLOTTABLE_H
@@ -0,0 +1,139 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <set>
+
+#include "Proto.h"
+#include "SlotTable.h"
+
+namespace Roo {
+namespace {
+
+struct SequenceIndex {
+    uint64_t operator()(const Proto::RooId& rooId) const
+    {
+        return rooId.sequence;
+    }
+};
+
+struct Foo {
+    Foo()
+        : tableNode(this)
+    {}
+
+    Intrusive::HashTable<Proto::RooId, Foo>::Node tableNode;
+};
+
+using Table = SlotTable<Proto::RooId, Foo, SequenceIndex, &Foo::tableNode>;
+
+TEST(SlotTableTest, constructor)
+{
+    Table table(4);
+    EXPECT_EQ(3U, table.mask);
+    EXPECT_TRUE(table.empty());
+    for (std::size_t i = 0; i < 4; ++i) {
+        EXPECT_EQ(nullptr, table.slots[i].element);
+    }
+}
+
+TEST(SlotTableTest, find)
+{
+    Foo a, b;
+    Table table(4);
+    table.insert({1, 1}, &a);
+    table.insert({1, 5}, &b);
+
+    EXPECT_EQ(&a, table.find({1, 1}));
+    EXPECT_EQ(&b, table.find({1, 5}));
+    // Same slot, different key
+    EXPECT_EQ(nullptr, table.find({2, 1}));
+    EXPECT_EQ(nullptr, table.find({1, 9}));
+    // Empty slot
+    EXPECT_EQ(nullptr, table.find({1, 2}));
+}
+
+TEST(SlotTableTest, insert)
+{
+    Foo a, b;
+    Table table(4);
+
+    table.insert({1, 1}, &a);
+    EXPECT_EQ(&a, table.slots[1].element);
+    EXPECT_EQ(Proto::RooId(1, 1), table.slots[1].key);
+    EXPECT_TRUE(table.fallback.empty());
+    EXPECT_EQ(1U, table.size());
+
+    // Slot already occupied
+    table.insert({1, 5}, &b);
+    EXPECT_EQ(&a, table.slots[1].element);
+    EXPECT_EQ(1U, table.fallback.size());
+    EXPECT_TRUE(table.fallback.contains(&b.tableNode));
+    EXPECT_EQ(2U, table.size());
+}
+
+TEST(SlotTableTest, remove)
+{
+    Foo a, b;
+    Table table(4);
+    table.insert({1, 1}, &a);
+    table.insert({1, 5}, &b);
+
+    EXPECT_FALSE(table.remove({1, 9}));
+    EXPECT_EQ(2U, table.size());
+
+    EXPECT_TRUE(table.remove({1, 1}));
+    EXPECT_EQ(nullptr, table.slots[1].element);
+    EXPECT_EQ(&b, table.find({1, 5}));
+    EXPECT_EQ(1U, table.size());
+
+    EXPECT_TRUE(table.remove({1, 5}));
+    EXPECT_TRUE(table.fallback.empty());
+    EXPECT_FALSE(table.fallback.contains(&b.tableNode));
+    EXPECT_TRUE(table.empty());
+
+    EXPECT_FALSE(table.remove({1, 5}));
+}
+
+TEST(SlotTableTest, forEach)
+{
+    Foo a, b, c;
+    Table table(4);
+    table.insert({1, 0}, &a);
+    table.insert({1, 3}, &b);
+    table.insert({1, 4}, &c);
+
+    std::set<Foo*> elements;
+    table.forEach([&](Foo* element) { elements.insert(element); });
+    EXPECT_EQ(std::set<Foo*>({&a, &b, &c}), elements);
+}
+
+TEST(SlotTableTest, clear)
+{
+    Foo a, b;
+    Table table(4);
+    table.insert({1, 1}, &a);
+    table.insert({1, 5}, &b);
+
+    table.clear();
+
+    EXPECT_TRUE(table.empty());
+    EXPECT_EQ(nullptr, table.find({1, 1}));
+    EXPECT_EQ(nullptr, table.find({1, 5}));
+}
+
+}  // namespace
+}  // namespace Roo
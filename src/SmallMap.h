@@ -0,0 +1,185 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef ROO_SMALLMAP_H
+#define ROO_SMALLMAP_H
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "SmallVector.h"
+
+namespace Roo {
+
+/**
+ * An insert-only map optimized for holding a few entries.
+ *
+ * Entries are kept in insertion order in a SmallVector.  Lookups scan the
+ * entries linearly until the map holds more than INDEX_THRESHOLD entries, at
+ * which point a hash index is built and used for all subsequent lookups.  A
+ * SmallMap that never holds more than N entries never allocates memory.
+ * Entries never move once added.
+ *
+ * This class is NOT thread-safe.
+ *
+ * @tparam Key
+ *      Type of the keys; must be equality comparable and copyable.
+ * @tparam Value
+ *      Type of the mapped values; must be copy constructible.
+ * @tparam N
+ *      Number of entries stored inline.
+ * @tparam Hash
+ *      Function object used to hash keys once the index is built.
+ */
+template <typename Key, typename Value, std::size_t N,
+          typename Hash = typename Key::Hasher>
+class SmallMap {
+  public:
+    /**
+     * A key and its mapped value.
+     */
+    struct Entry {
+        /// Constructor
+        Entry(const Key& key, const Value& value)
+            : key(key)
+            , value(value)
+        {}
+
+        /// Key of this entry.
+        Key key;
+        /// Value mapped to the key.
+        Value value;
+    };
+
+    /**
+     * Construct an empty SmallMap.
+     */
+    SmallMap()
+        : entries()
+        , index()
+    {}
+
+    /**
+     * Return the value mapped to the given key or nullptr if the key is not
+     * in the map.
+     */
+    Value* find(const Key& key)
+    {
+        if (index) {
+            auto it = index->find(key);
+            return it == index->end() ? nullptr : &entries[it->second].value;
+        }
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].key == key) {
+                return &entries[i].value;
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * Return the value mapped to the given key; the key must be in the map.
+     */
+    Value& at(const Key& key)
+    {
+        Value* value = find(key);
+        assert(value != nullptr);
+        return *value;
+    }
+
+    /**
+     * Return 1 if the key is in the map; 0 otherwise.
+     */
+    std::size_t count(const Key& key)
+    {
+        return find(key) != nullptr ? 1 : 0;
+    }
+
+    /**
+     * Map the key to the given value if the key is not already in the map.
+     *
+     * @return
+     *      A pointer to the value mapped to the key and true if the value was
+     *      inserted or false if the key was already in the map.
+     */
+    std::pair<Value*, bool> insert(const Key& key, const Value& value)
+    {
+        Value* existing = find(key);
+        if (existing != nullptr) {
+            return std::make_pair(existing, false);
+        }
+        std::size_t pos = entries.size();
+        Entry& entry = entries.emplace_back(key, value);
+        if (index) {
+            index->insert({key, pos});
+        } else if (entries.size() > INDEX_THRESHOLD) {
+            // Too many entries to scan; switch to indexed lookups.
+            index.reset(new std::unordered_map<Key, std::size_t, Hash>());
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                index->insert({entries[i].key, i});
+            }
+        }
+        return std::make_pair(&entry.value, true);
+    }
+
+    /**
+     * Return the entry at the given position in insertion order.
+     */
+    Entry& operator[](std::size_t pos)
+    {
+        return entries[pos];
+    }
+
+    /**
+     * Return the number of entries in the map.
+     */
+    std::size_t size() const
+    {
+        return entries.size();
+    }
+
+    /**
+     * Return true if the map has no entries.
+     */
+    bool empty() const
+    {
+        return entries.empty();
+    }
+
+  private:
+    /// Largest number of entries looked up by a linear scan; at least 8 so
+    /// that a small N only moves entries out of line rather than paying for
+    /// the index.
+    static const std::size_t INDEX_THRESHOLD = N > 8 ? N : 8;
+
+    /// Entries in insertion order.
+    SmallVector<Entry, N> entries;
+
+    /// Maps keys to their position in entries; only built once the map holds
+    /// more than INDEX_THRESHOLD entries.
+    std::unique_ptr<std::unordered_map<Key, std::size_t, Hash> > index;
+
+    // Disable copy and assign
+    SmallMap(const SmallMap&) = delete;
+    SmallMap& operator=(const SmallMap&) = delete;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_SMALLMAP_H
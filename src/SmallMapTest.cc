@@ -0,0 +1,92 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include "Proto.h"
+#include "SmallMap.h"
+
+namespace Roo {
+namespace {
+
+using Map = SmallMap<Proto::BranchId, int, 2>;
+
+TEST(SmallMapTest, find)
+{
+    Map map;
+    EXPECT_EQ(nullptr, map.find({{1, 1}, 0}));
+
+    map.insert({{1, 1}, 0}, 10);
+    map.insert({{1, 1}, 1}, 11);
+    EXPECT_EQ(10, *map.find({{1, 1}, 0}));
+    EXPECT_EQ(11, *map.find({{1, 1}, 1}));
+    EXPECT_EQ(nullptr, map.find({{1, 1}, 2}));
+    EXPECT_FALSE(map.index);
+
+    // Spilled but still scanned
+    map.insert({{1, 1}, 2}, 12);
+    EXPECT_EQ(12, *map.find({{1, 1}, 2}));
+    EXPECT_FALSE(map.index);
+
+    // Indexed
+    for (uint32_t i = 3; i <= Map::INDEX_THRESHOLD; ++i) {
+        map.insert({{1, 1}, i}, 10 + i);
+    }
+    ASSERT_TRUE(map.index);
+    EXPECT_EQ(10, *map.find({{1, 1}, 0}));
+    EXPECT_EQ(12, *map.find({{1, 1}, 2}));
+    EXPECT_EQ(nullptr, map.find({{1, 1}, 100}));
+    EXPECT_EQ(1U, map.count({{1, 1}, 2}));
+    EXPECT_EQ(0U, map.count({{1, 1}, 100}));
+}
+
+TEST(SmallMapTest, insert)
+{
+    Map map;
+
+    auto ret = map.insert({{1, 1}, 0}, 10);
+    EXPECT_TRUE(ret.second);
+    EXPECT_EQ(&map.entries[0].value, ret.first);
+    EXPECT_EQ(1U, map.size());
+
+    // Duplicate
+    ret = map.insert({{1, 1}, 0}, 20);
+    EXPECT_FALSE(ret.second);
+    EXPECT_EQ(10, *ret.first);
+    EXPECT_EQ(1U, map.size());
+
+    for (uint32_t i = 1; i < Map::INDEX_THRESHOLD; ++i) {
+        map.insert({{1, 1}, i}, 10 + i);
+    }
+    EXPECT_FALSE(map.index);
+
+    // Growing past the threshold builds the index.
+    uint32_t last = Map::INDEX_THRESHOLD;
+    ret = map.insert({{1, 1}, last}, 10 + last);
+    EXPECT_TRUE(ret.second);
+    ASSERT_TRUE(map.index);
+    EXPECT_EQ(last + 1, map.index->size());
+    EXPECT_EQ(last, map.index->at({{1, 1}, last}));
+
+    map.insert({{1, 1}, last + 1}, 11 + last);
+    EXPECT_EQ(last + 2, map.index->size());
+    EXPECT_EQ(last + 2, map.size());
+    EXPECT_EQ(Proto::BranchId({1, 1}, last + 1), map[last + 1].key);
+    EXPECT_EQ(11 + last, map[last + 1].value);
+}
+
+}  // namespace
+}  // namespace Roo
@@ -0,0 +1,186 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef ROO_SMALLVECTOR_H
+#define ROO_SMALLVECTOR_H
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace Roo {
+
+/**
+ * An append-only sequence that stores its first N elements inline.
+ *
+ * Elements beyond the first N are stored in heap allocated blocks that double
+ * in size, starting at N elements, so a SmallVector that never holds more
+ * than N elements never allocates memory and a large one allocates only a
+ * logarithmic number of blocks.  Elements never move once added; references
+ * to elements remain valid until the SmallVector is destroyed.
+ *
+ * This class is NOT thread-safe.
+ *
+ * @tparam ElementType
+ *      Type of the elements.
+ * @tparam N
+ *      Number of elements stored inline.
+ */
+template <typename ElementType, std::size_t N>
+class SmallVector {
+  public:
+    /**
+     * Construct an empty SmallVector.
+     */
+    SmallVector()
+        : inlineElements()
+        , blocks()
+        , count(0)
+    {}
+
+    /**
+     * Destruct the SmallVector and all of its elements.
+     */
+    ~SmallVector()
+    {
+        for (std::size_t i = 0; i < count; ++i) {
+            (*this)[i].~ElementType();
+        }
+    }
+
+    /**
+     * Construct a new element in place at the end of the SmallVector.
+     *
+     * @param args
+     *      Arguments forwarded to the element's constructor.
+     * @return
+     *      Reference to the added element.
+     */
+    template <typename... Args>
+    ElementType& emplace_back(Args&&... args)
+    {
+        if (count >= N && blockOffset(count - N) == 0) {
+            blocks.emplace_back(new Storage[N << blocks.size()]);
+        }
+        ElementType* element =
+            new (slot(count)) ElementType(std::forward<Args>(args)...);
+        count++;
+        return *element;
+    }
+
+    /**
+     * Append an element to the end of the SmallVector.
+     *
+     * @return
+     *      Reference to the added element.
+     */
+    template <typename T>
+    ElementType& push_back(T&& element)
+    {
+        return emplace_back(std::forward<T>(element));
+    }
+
+    /**
+     * Return a reference to the element at the given position.
+     */
+    ElementType& operator[](std::size_t pos)
+    {
+        assert(pos < count);
+        return *reinterpret_cast<ElementType*>(slot(pos));
+    }
+
+    /**
+     * Return a const reference to the element at the given position.
+     */
+    const ElementType& operator[](std::size_t pos) const
+    {
+        return const_cast<SmallVector*>(this)->operator[](pos);
+    }
+
+    /**
+     * Return the number of elements in the SmallVector.
+     */
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    /**
+     * Return true if the SmallVector has no elements.
+     */
+    bool empty() const
+    {
+        return count == 0;
+    }
+
+  private:
+    /// Uninitialized memory for a single element.
+    using Storage = typename std::aligned_storage<sizeof(ElementType),
+                                                  alignof(ElementType)>::type;
+
+    /**
+     * Return the memory that holds (or will hold) the element at the given
+     * position.
+     */
+    Storage* slot(std::size_t pos)
+    {
+        if (pos < N) {
+            return &inlineElements[pos];
+        }
+        pos -= N;
+        return &blocks[blockIndex(pos)][blockOffset(pos)];
+    }
+
+    /**
+     * Return the index of the block that holds the given spilled position;
+     * i.e. the position counted from the first element after the inline
+     * ones.  Block k holds N * 2^k elements.
+     */
+    static std::size_t blockIndex(std::size_t spilled)
+    {
+        return 63 - __builtin_clzll(spilled / N + 1);
+    }
+
+    /**
+     * Return the offset of the given spilled position within its block.
+     */
+    static std::size_t blockOffset(std::size_t spilled)
+    {
+        return spilled - N * ((std::size_t(1) << blockIndex(spilled)) - 1);
+    }
+
+    /// Storage for the first N elements.
+    Storage inlineElements[N];
+
+    /// Storage for any elements after the first N; block k holds N * 2^k
+    /// elements.
+    std::vector<std::unique_ptr<Storage[]> > blocks;
+
+    /// Number of elements in the SmallVector.
+    std::size_t count;
+
+    // Disable copy and assign
+    SmallVector(const SmallVector&) = delete;
+    SmallVector& operator=(const SmallVector&) = delete;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_SMALLVECTOR_H
@@ -0,0 +1,109 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <memory>
+
+#include "SmallVector.h"
+
+namespace Roo {
+namespace {
+
+TEST(SmallVectorTest, constructor)
+{
+    SmallVector<int, 2> vector;
+    EXPECT_TRUE(vector.empty());
+    EXPECT_EQ(0U, vector.size());
+    EXPECT_TRUE(vector.blocks.empty());
+}
+
+TEST(SmallVectorTest, push_back)
+{
+    SmallVector<int, 2> vector;
+
+    EXPECT_EQ((void*)&vector.inlineElements[0], &vector.push_back(1));
+    EXPECT_EQ((void*)&vector.inlineElements[1], &vector.push_back(2));
+    EXPECT_TRUE(vector.blocks.empty());
+
+    int* third = &vector.push_back(3);
+    EXPECT_EQ(1U, vector.blocks.size());
+    EXPECT_EQ((void*)&vector.blocks[0][0], third);
+    vector.push_back(4);
+    EXPECT_EQ(1U, vector.blocks.size());
+
+    // Blocks double in size.
+    int* fifth = &vector.push_back(5);
+    EXPECT_EQ(2U, vector.blocks.size());
+    EXPECT_EQ((void*)&vector.blocks[1][0], fifth);
+    for (int i = 6; i <= 8; ++i) {
+        vector.push_back(i);
+    }
+    EXPECT_EQ(2U, vector.blocks.size());
+    EXPECT_EQ((void*)&vector.blocks[1][3], &vector[7]);
+    vector.push_back(9);
+    EXPECT_EQ(3U, vector.blocks.size());
+
+    // Earlier elements don't move.
+    EXPECT_EQ(third, &vector[2]);
+    EXPECT_EQ(9U, vector.size());
+    for (int i = 0; i < 9; ++i) {
+        EXPECT_EQ(i + 1, vector[i]);
+    }
+}
+
+TEST(SmallVectorTest, destructor)
+{
+    std::shared_ptr<int> element(new int(1));
+    {
+        SmallVector<std::shared_ptr<int>, 1> vector;
+        vector.push_back(element);
+        vector.push_back(element);
+        EXPECT_EQ(3, element.use_count());
+    }
+    EXPECT_EQ(1, element.use_count());
+}
+
+TEST(SmallVectorTest, emplace_back)
+{
+    struct Foo {
+        Foo(int a, int b)
+            : self(this)
+            , sum(a + b)
+        {}
+        Foo* self;
+        int sum;
+    };
+    SmallVector<Foo, 1> vector;
+    Foo& foo = vector.emplace_back(1, 2);
+    EXPECT_EQ(&foo, foo.self);
+    EXPECT_EQ(3, foo.sum);
+    Foo& bar = vector.emplace_back(3, 4);
+    EXPECT_EQ(&bar, bar.self);
+    EXPECT_EQ(&bar, &vector[1]);
+}
+
+TEST(SmallVectorTest, push_back_moveOnly)
+{
+    SmallVector<std::unique_ptr<int>, 1> vector;
+    vector.push_back(std::unique_ptr<int>(new int(1)));
+    vector.push_back(std::unique_ptr<int>(new int(2)));
+    EXPECT_EQ(1, *vector[0]);
+    EXPECT_EQ(2, *vector[1]);
+}
+
+}  // namespace
+}  // namespace Roo
@@ -16,185 +16,818 @@
 #include "SocketImpl.h"
 
 #include <PerfUtils/Cycles.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <type_traits>
 
 #include "Debug.h"
 #include "Perf.h"
 #include "RooPCImpl.h"
 #include "ServerTaskImpl.h"
+#include "ThreadId.h"
 
 namespace Roo {
 
 using PerfUtils::Cycles;
 
-// Basic timeout unit.
-const uint64_t BASE_TIMEOUT_US{2000};
-/// Microseconds to wait before pinging to check on requests.
-const uint64_t WORRY_TIMEOUT_US{BASE_TIMEOUT_US};
-/// Microseconds of inactive before garbage collecting a task.
-const uint64_t TASK_TIMEOUT_US{3 * BASE_TIMEOUT_US};
+/// Resolution of the timeout wheels; timeouts may fire up to this late.
+const uint64_t TIMEOUT_TICK_US{20};
+
+/// Number of maximum worry timeouts a RooPC branch's pings may go unanswered
+/// before the RooPC fails.
+const uint64_t PING_FAILURE_TIMEOUTS{4};
+
+template <typename MutexType>
+const std::size_t BasicSocketImpl<MutexType>::NUM_SHARDS;
+template <typename MutexType>
+const std::size_t BasicSocketImpl<MutexType>::RPC_SLOTS;
+template <typename MutexType>
+const std::size_t BasicSocketImpl<MutexType>::PENDING_TASKS_CAPACITY;
+template <typename MutexType>
+const int BasicSocketImpl<MutexType>::THREAD_SLOT_SHIFT;
+template <typename MutexType>
+const std::size_t BasicSocketImpl<MutexType>::MAX_THREAD_SLOTS;
+template <typename MutexType>
+const std::size_t BasicSocketImpl<MutexType>::INBOUND_QUEUE_CAPACITY;
 
 /**
  * Construct a SocketImpl.
  *
  * @param transport
  *      Homa transport to which this socket has exclusive access.
+ * @param options
+ *      Settings for this socket.
  */
-SocketImpl::SocketImpl(Homa::Transport* transport)
+template <typename MutexType>
+BasicSocketImpl<MutexType>::BasicSocketImpl(Homa::Transport* transport,
+                                            const SocketOptions& options)
     : transport(transport)
+    , eagerSend(options.eagerSend)
+    , pingFailureCycles(Cycles::fromMicroseconds(PING_FAILURE_TIMEOUTS *
+                                                 options.maxWorryTimeoutUs))
     , socketId(transport->getId())
     , nextSequenceNumber(1)
-    , mutex()
-    , rpcPool()
-    , taskPool()
-    , rpcs()
-    , tasks()
-    , rpcTimeouts(Cycles::fromMicroseconds(WORRY_TIMEOUT_US))
-    , taskTimeouts(Cycles::fromMicroseconds(TASK_TIMEOUT_US))
-    , pendingTasks()
-{}
+    , shards()
+    , initialWorryTimeoutCycles(
+          Cycles::fromMicroseconds(options.initialWorryTimeoutUs))
+    , minWorryTimeoutCycles(Cycles::fromMicroseconds(options.minWorryTimeoutUs))
+    , maxWorryTimeoutCycles(Cycles::fromMicroseconds(options.maxWorryTimeoutUs))
+    , worryJitterPercent(options.worryJitterPercent)
+    , taskTimeoutCycles(Cycles::fromMicroseconds(options.taskTimeoutUs))
+    , idleSpinCycles(Cycles::fromMicroseconds(options.idleSpinUs))
+    , idleBlockCycles(Cycles::fromMicroseconds(options.idleBlockUs))
+    , wakeupFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , inboundQueues(options.responseAffinity && !options.ownPoller
+                        ? new std::atomic<InboundQueue*>[MAX_THREAD_SLOTS]()
+                        : nullptr)
+    , sleepers(0)
+    , mayBlock(false)
+    , rttShards()
+    , socketWorryTimeout(
+          RttEstimator().timeout(initialWorryTimeoutCycles,
+                                 minWorryTimeoutCycles, maxWorryTimeoutCycles))
+    , requestHandler()
+    , workers()
+    , pendingTasks(PENDING_TASKS_CAPACITY)
+    , overflowMutex()
+    , overflowTasks()
+    , overflowCount(0)
+    , trackCompletions(options.trackCompletions)
+    , completionMutex()
+    , completions()
+    , completionCount(0)
+    , pollerState(POLLER_RUN)
+    , poller()
+{
+    if (options.ownPoller) {
+        poller =
+            std::thread(&BasicSocketImpl::runPoller, this, options.pollerCpu);
+    }
+}
 
 /**
  * SocketImpl destructor.
  */
-SocketImpl::~SocketImpl()
+template <typename MutexType>
+BasicSocketImpl<MutexType>::~BasicSocketImpl()
 {
-    SpinLock::Lock lock(mutex);
-    while (!rpcs.empty()) {
-        auto it = rpcs.begin();
-        rpcTimeouts.cancelTimeout(&it->second->timeout);
-        rpcs.erase(it);
-        rpcPool.destroy(it->second);
+    if (poller.joinable()) {
+        pollerState.store(POLLER_STOP, std::memory_order_release);
+        poller.join();
+    }
+    workers.reset();
+    if (inboundQueues) {
+        for (std::size_t i = 0; i < MAX_THREAD_SLOTS; ++i) {
+            InboundQueue* queue = inboundQueues[i].load();
+            Homa::InMessage* message;
+            while (queue != nullptr && queue->pop(&message)) {
+                Homa::unique_ptr<Homa::InMessage> discard(message);
+            }
+            delete queue;
+        }
+    }
+    completions.clear();
+    for (Shard& shard : shards) {
+        Lock lock_shard(shard.mutex);
+        shard.rpcs.forEach([&shard](RpcHandle* handle) {
+            shard.rpcTimeouts.cancelTimeout(&handle->timeout);
+            shard.rpcs.remove(handle->rpc.getId());
+            shard.rpcPool.destroy(handle);
+        });
+        shard.tasks.forEach([&shard](ServerTaskHandle* handle) {
+            shard.taskTimeouts.cancelTimeout(&handle->timeout);
+            shard.tasks.remove(&handle->tableNode);
+            shard.taskPool.destroy(handle);
+        });
     }
-    while (!tasks.empty()) {
-        auto it = tasks.begin();
-        taskTimeouts.cancelTimeout(&it->second->timeout);
-        tasks.erase(it);
-        taskPool.destroy(it->second);
+    if (wakeupFd >= 0) {
+        close(wakeupFd);
     }
 }
 
 /**
  * @copydoc Roo::Socket::allocRooPC()
  */
+template <typename MutexType>
 Roo::unique_ptr<RooPC>
-SocketImpl::allocRooPC()
+BasicSocketImpl<MutexType>::allocRooPC()
 {
     Perf::Timer timer;
-    SpinLock::Lock lock_socket(mutex);
     Proto::RooId rooId = allocTaskId();
-    RpcHandle* handle = rpcPool.construct(this, rooId);
-    rpcs.insert({rooId, handle});
-    rpcTimeouts.setTimeout(&handle->timeout);
+    rooId.sequence |= allocThreadTag();
+    Shard* shard = getShard(rooId);
+    Lock lock_shard(shard->mutex);
+    RpcHandle* handle = shard->rpcPool.construct(this, rooId);
+    shard->rpcs.insert(rooId, handle);
+    shard->rpcTimeouts.setTimeout(&handle->timeout, addJitter(worryTimeout()));
     Perf::counters.client_api_cycles.add(timer.split());
     return Roo::unique_ptr<RooPC>(&handle->rpc);
 }
 
+/**
+ * @copydoc Roo::Socket::allocRooPCs()
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::allocRooPCs(Roo::unique_ptr<RooPC> rpcs[],
+                                        std::size_t count)
+{
+    // Release any RooPCs the array still holds before taking a shard lock;
+    // destroying them takes the shard locks itself.
+    destroyRooPCs(rpcs, count);
+
+    Perf::Timer timer;
+    if (count == 0) {
+        return;
+    }
+    // Reserve a contiguous block of ids and then visit each shard only once.
+    uint64_t firstSequence =
+        nextSequenceNumber.fetch_add(count, std::memory_order_relaxed) |
+        allocThreadTag();
+    uint64_t timeoutCycles = worryTimeout();
+    for (std::size_t i = 0; i < count && i < NUM_SHARDS; ++i) {
+        Shard* shard = getShard(Proto::RooId(socketId, firstSequence + i));
+        Lock lock_shard(shard->mutex);
+        for (std::size_t j = i; j < count; j += NUM_SHARDS) {
+            Proto::RooId rooId(socketId, firstSequence + j);
+            RpcHandle* handle = shard->rpcPool.construct(this, rooId);
+            shard->rpcs.insert(rooId, handle);
+            shard->rpcTimeouts.setTimeout(&handle->timeout,
+                                          addJitter(timeoutCycles));
+            rpcs[j] = Roo::unique_ptr<RooPC>(&handle->rpc);
+        }
+    }
+    Perf::counters.client_api_cycles.add(timer.split());
+}
+
+/**
+ * @copydoc Roo::Socket::destroyRooPCs()
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::destroyRooPCs(Roo::unique_ptr<RooPC> rpcs[],
+                                          std::size_t count)
+{
+    Perf::Timer timer;
+    // Find the set of shards involved so that each is locked only once.
+    uint64_t shardMask = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        if (rpcs[i]) {
+            RooPCImpl* rpc = static_cast<RooPCImpl*>(rpcs[i].get());
+            shardMask |= 1UL << (getShard(rpc->getId()) - shards);
+        }
+    }
+    for (std::size_t s = 0; s < NUM_SHARDS; ++s) {
+        if ((shardMask & (1UL << s)) == 0) {
+            continue;
+        }
+        Shard* shard = &shards[s];
+        Lock lock_shard(shard->mutex);
+        for (std::size_t i = 0; i < count; ++i) {
+            if (!rpcs[i]) {
+                continue;
+            }
+            RooPCImpl* rpc = static_cast<RooPCImpl*>(rpcs[i].get());
+            if (getShard(rpc->getId()) == shard) {
+                rpcs[i].release();
+                dropRooPC(shard, rpc, lock_shard);
+            }
+        }
+    }
+    Perf::counters.client_api_cycles.add(timer.split());
+}
+
+/**
+ * @copydoc Roo::Socket::pollCompletions()
+ */
+template <typename MutexType>
+std::size_t
+BasicSocketImpl<MutexType>::pollCompletions(RooPC* completed[], std::size_t max)
+{
+    if (completionCount.load(std::memory_order_acquire) == 0) {
+        return 0;
+    }
+    Perf::Timer timer;
+    std::size_t count = 0;
+    Lock lock_completions(completionMutex);
+    while (count < max && !completions.empty()) {
+        completed[count] = &completions.front().rpc;
+        completions.pop_front();
+        count++;
+    }
+    completionCount.store(completions.size(), std::memory_order_release);
+    Perf::counters.client_api_cycles.add(timer.split());
+    return count;
+}
+
 /**
  * @copydoc Roo::Socket::receive()
  */
+template <typename MutexType>
 Roo::unique_ptr<ServerTask>
-SocketImpl::receive()
+BasicSocketImpl<MutexType>::receive()
 {
     Perf::Timer timer;
-    SpinLock::Lock lock_socket(mutex);
     Roo::unique_ptr<ServerTask> task;
-    if (!pendingTasks.empty()) {
-        task = Roo::unique_ptr<ServerTask>(pendingTasks.front());
-        pendingTasks.pop_front();
+    ServerTaskImpl* pending;
+    if (pendingTasks.pop(&pending)) {
+        task = Roo::unique_ptr<ServerTask>(pending);
         Perf::counters.server_api_cycles.add(timer.split());
     }
     return task;
 }
 
+/**
+ * @copydoc Roo::Socket::receive(Roo::unique_ptr<ServerTask>[], std::size_t)
+ */
+template <typename MutexType>
+std::size_t
+BasicSocketImpl<MutexType>::receive(Roo::unique_ptr<ServerTask> tasks[],
+                                    std::size_t max)
+{
+    Perf::Timer timer;
+    std::size_t count = 0;
+    ServerTaskImpl* pending;
+    while (count < max && pendingTasks.pop(&pending)) {
+        tasks[count] = Roo::unique_ptr<ServerTask>(pending);
+        count++;
+    }
+    if (count > 0) {
+        Perf::counters.server_api_cycles.add(timer.split());
+    }
+    return count;
+}
+
+/**
+ * @copydoc Roo::Socket::registerHandler()
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::registerHandler(RequestHandler handler)
+{
+    if (poller.joinable()) {
+        // The poller reads requestHandler; keep it out of the way.
+        pausePoller();
+        requestHandler = std::move(handler);
+        resumePoller();
+    } else {
+        requestHandler = std::move(handler);
+    }
+}
+
+/**
+ * @copydoc Roo::Socket::startWorkers()
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::startWorkers(std::size_t numWorkers,
+                                         RequestHandler handler, int firstCpu)
+{
+    if (std::is_same<MutexType, NullLock>::value) {
+        ERROR("Worker threads cannot share a single-threaded socket");
+        return;
+    }
+    assert(!workers);
+    std::unique_ptr<WorkerPool> pool(
+        new WorkerPool(numWorkers, std::move(handler), firstCpu));
+    if (poller.joinable()) {
+        // The poller reads workers; keep it out of the way.
+        pausePoller();
+        workers = std::move(pool);
+        resumePoller();
+    } else {
+        workers = std::move(pool);
+    }
+}
+
 /**
  * @copydoc Roo::Socket::poll()
  */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::poll()
+{
+    if (poller.joinable()) {
+        // The background poller makes all progress.
+        return;
+    }
+    pollOnce();
+}
+
+/**
+ * @copydoc Roo::Socket::waitForWork()
+ */
+template <typename MutexType>
 void
-SocketImpl::poll()
+BasicSocketImpl<MutexType>::waitForWork()
+{
+    if (poller.joinable()) {
+        std::this_thread::yield();
+        return;
+    }
+    Perf::Timer timer;
+    uint64_t spinDeadline = timer.read() + idleSpinCycles;
+    while (!pollOnce()) {
+        if (Cycles::rdtsc() < spinDeadline) {
+            continue;
+        }
+        Perf::counters.idle_spin_cycles.add(timer.split());
+
+        // Advertise the sleep before polling a final time so that a wakeup()
+        // for work that arrives after this poll signals wakeupFd.  A wakeup()
+        // racing with the very first sleep may still miss mayBlock; that
+        // sleep is bounded by idleBlockCycles.
+        if (!mayBlock.load(std::memory_order_relaxed)) {
+            mayBlock.store(true);
+        }
+        sleepers.fetch_add(1);
+        if (pollOnce()) {
+            sleepers.fetch_sub(1);
+            return;
+        }
+        blockForWork(nextDeadline());
+        sleepers.fetch_sub(1);
+        Perf::counters.idle_blocked_cycles.add(timer.split());
+        pollOnce();
+        return;
+    }
+}
+
+/**
+ * @copydoc Roo::Socket::wakeup()
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::wakeup()
+{
+    if (std::is_same<MutexType, NullLock>::value) {
+        // Only the thread that would be blocked can use the socket.
+        return;
+    }
+    if (!mayBlock.load(std::memory_order_relaxed)) {
+        // No thread has ever blocked in waitForWork() (e.g. the socket has
+        // its own poller or is only ever polled); skip the fence.
+        return;
+    }
+    // Order the caller's preceding work before the check for sleepers;
+    // pairs with the fetch_add in waitForWork().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) > 0 && wakeupFd >= 0) {
+        uint64_t value = 1;
+        ssize_t ret = write(wakeupFd, &value, sizeof(value));
+        (void)ret;
+    }
+}
+
+/**
+ * Discard a previously allocated RooPC.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::dropRooPC(RooPCImpl* rpc)
+{
+    Shard* shard = getShard(rpc->getId());
+    Lock lock_shard(shard->mutex);
+    dropRooPC(shard, rpc, lock_shard);
+}
+
+/**
+ * Record a round-trip time measured to a peer.
+ *
+ * Takes only the lock of the peer's RttShard, which may be acquired with the
+ * Shard and RooPC locks held.
+ *
+ * @param peer
+ *      Address of the peer that responded.
+ * @param rttCycles
+ *      Cycles between sending a request or ping to the peer and receiving
+ *      the corresponding response or pong.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::recordRtt(Homa::Driver::Address peer,
+                                      uint64_t rttCycles)
+{
+    RttShard* rttShard = getRttShard(peer);
+    {
+        Lock lock_rtt(rttShard->mutex);
+        rttShard->peers[peer].sample(rttCycles);
+        rttShard->combined.sample(rttCycles);
+        rttShard->timeout.store(
+            rttShard->combined.timeout(initialWorryTimeoutCycles,
+                                       minWorryTimeoutCycles,
+                                       maxWorryTimeoutCycles),
+            std::memory_order_relaxed);
+    }
+
+    // Cover the slowest measured peers rather than whichever were sampled
+    // last; concurrent samples may briefly publish a slightly stale value.
+    uint64_t timeout = 0;
+    for (RttShard& other : rttShards) {
+        timeout =
+            std::max(timeout, other.timeout.load(std::memory_order_relaxed));
+    }
+    socketWorryTimeout.store(timeout, std::memory_order_relaxed);
+}
+
+/**
+ * Return the number of cycles a RooPC should wait for progress from the
+ * given peer before pinging it.
+ *
+ * @param peer
+ *      Address of the peer.
+ */
+template <typename MutexType>
+uint64_t
+BasicSocketImpl<MutexType>::worryTimeout(Homa::Driver::Address peer)
+{
+    RttShard* rttShard = getRttShard(peer);
+    Lock lock_rtt(rttShard->mutex);
+    auto it = rttShard->peers.find(peer);
+    if (it == rttShard->peers.end()) {
+        return worryTimeout();
+    }
+    return it->second.timeout(initialWorryTimeoutCycles, minWorryTimeoutCycles,
+                              maxWorryTimeoutCycles);
+}
+
+/**
+ * Return the number of cycles a RooPC should wait for progress before
+ * pinging when its peers are not yet known.
+ */
+template <typename MutexType>
+uint64_t
+BasicSocketImpl<MutexType>::worryTimeout()
+{
+    return socketWorryTimeout.load(std::memory_order_relaxed);
+}
+
+/**
+ * Return the thread slot bits to add to the sequence of the RooPCs the
+ * calling thread allocates, creating the thread's inbound queue on first use.
+ *
+ * @return
+ *      The thread slot shifted into place, or 0 if responses are not steered
+ *      to the calling thread.
+ */
+template <typename MutexType>
+uint64_t
+BasicSocketImpl<MutexType>::allocThreadTag()
+{
+    if (!inboundQueues) {
+        return 0;
+    }
+    std::size_t slot = ThreadId::getId();
+    if (slot >= MAX_THREAD_SLOTS) {
+        return 0;
+    }
+    // Only the owning thread creates its queue.
+    if (inboundQueues[slot].load(std::memory_order_relaxed) == nullptr) {
+        inboundQueues[slot].store(new InboundQueue(INBOUND_QUEUE_CAPACITY),
+                                  std::memory_order_release);
+    }
+    return static_cast<uint64_t>(slot) << THREAD_SLOT_SHIFT;
+}
+
+/**
+ * Discard a previously allocated RooPC.
+ *
+ * @param shard
+ *      The Shard that holds the RooPC.
+ * @param rpc
+ *      The RooPC to discard.
+ * @param lock
+ *      Reminds the caller that the Shard::mutex should be held.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::dropRooPC(Shard* shard, RooPCImpl* rpc,
+                                      const Lock& lock)
+{
+    (void)lock;
+    RpcHandle* handle = shard->rpcs.find(rpc->getId());
+    assert(handle != nullptr);
+    if (handle->dispatchCount > 0) {
+        // Callbacks are running on another thread (or this RooPC is being
+        // destroyed from one of its own callbacks); let the dispatcher finish.
+        handle->dropped = true;
+        return;
+    }
+    if (handle->completionQueued) {
+        Lock lock_completions(completionMutex);
+        completions.remove(&handle->completionNode);
+        completionCount.store(completions.size(), std::memory_order_release);
+    }
+    shard->rpcTimeouts.cancelTimeout(&handle->timeout);
+    shard->rpcs.remove(rpc->getId());
+    shard->rpcPool.destroy(handle);
+}
+
+/**
+ * Prevent a RooPC with pending callbacks from being destroyed until
+ * dispatchCallbacks() has invoked them.
+ *
+ * @param handle
+ *      Handle of the RooPC that was just updated.
+ * @param lock
+ *      Reminds the caller that the Shard::mutex should be held.
+ * @return
+ *      The handle, which must be passed to dispatchCallbacks() once the
+ *      Shard::mutex is released, or nullptr if there is nothing to invoke.
+ */
+template <typename MutexType>
+typename BasicSocketImpl<MutexType>::RpcHandle*
+BasicSocketImpl<MutexType>::holdForCallbacks(RpcHandle* handle,
+                                             const Lock& lock)
+{
+    (void)lock;
+    if (handle->dropped || !handle->rpc.callbacksPending()) {
+        return nullptr;
+    }
+    handle->dispatchCount++;
+    return handle;
+}
+
+/**
+ * Invoke the pending callbacks of a RooPC previously held with
+ * holdForCallbacks() and release the hold; if the RooPC finished, it is also
+ * added to the completion queue.  Must be called without holding the
+ * Shard::mutex.
+ *
+ * @param shard
+ *      The Shard that holds the RooPC.
+ * @param handle
+ *      Handle returned by holdForCallbacks().
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::dispatchCallbacks(Shard* shard, RpcHandle* handle)
+{
+    bool finished = handle->rpc.invokeCallbacks();
+    Lock lock_shard(shard->mutex);
+    handle->dispatchCount--;
+    if (handle->dropped) {
+        if (handle->dispatchCount == 0) {
+            handle->dropped = false;
+            dropRooPC(shard, &handle->rpc, lock_shard);
+        }
+    } else if (finished) {
+        queueCompletion(handle, lock_shard);
+    }
+}
+
+/**
+ * Add a finished RooPC to the completion queue returned by pollCompletions(),
+ * if completions are tracked.
+ *
+ * @param handle
+ *      Handle of the RooPC that finished.
+ * @param lock
+ *      Reminds the caller that the Shard::mutex should be held.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::queueCompletion(RpcHandle* handle, const Lock& lock)
+{
+    (void)lock;
+    if (!trackCompletions) {
+        return;
+    }
+    handle->completionQueued = true;
+    Lock lock_completions(completionMutex);
+    completions.push_back(&handle->completionNode);
+    completionCount.store(completions.size(), std::memory_order_release);
+}
+
+/**
+ * Main loop of the background poller thread; polls until told to stop.
+ *
+ * @param cpu
+ *      CPU to which the thread should be pinned; -1 to leave it unpinned.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::runPoller(int cpu)
+{
+    ThreadId::setName("poller");
+    if (cpu >= 0 && !ThreadId::setCpuAffinity(cpu)) {
+        WARNING("Unable to pin the socket poller to CPU %d", cpu);
+    }
+    while (true) {
+        int state = pollerState.load(std::memory_order_acquire);
+        if (state == POLLER_RUN) {
+            pollOnce();
+        } else if (state == POLLER_PAUSE) {
+            pollerState.store(POLLER_PAUSED, std::memory_order_release);
+        } else if (state == POLLER_STOP) {
+            break;
+        }
+    }
+}
+
+/**
+ * Stop the background poller thread and wait until it is no longer polling.
+ * Must not be called from the poller thread.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::pausePoller()
+{
+    pollerState.store(POLLER_PAUSE, std::memory_order_release);
+    while (pollerState.load(std::memory_order_acquire) != POLLER_PAUSED) {
+    }
+}
+
+/**
+ * Restart a background poller thread stopped by pausePoller().
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::resumePoller()
+{
+    pollerState.store(POLLER_RUN, std::memory_order_release);
+}
+
+/**
+ * Make incremental progress performing Socket management.
+ *
+ * @return
+ *      True if any useful work was done; false if the Socket was idle.
+ */
+template <typename MutexType>
+bool
+BasicSocketImpl<MutexType>::pollOnce()
 {
     // Let the transport make incremental progress.
     transport->poll();
 
     Perf::Timer timer;
-    processIncomingMessages();
-    checkClientTimeouts();
-    checkTaskTimeouts();
+    bool progress = processInboundMessages();
+    progress |= processIncomingMessages();
+    progress |= checkClientTimeouts();
+    progress |= checkTaskTimeouts();
     Perf::counters.poll_total_cycles.add(timer.split());
+    return progress;
 }
 
 /**
- * Discard a previously allocated RooPC.
+ * Return the cycle time at which the next RooPC or ServerTask timeout may
+ * be due, or UINT64_MAX if there are none.
+ */
+template <typename MutexType>
+uint64_t
+BasicSocketImpl<MutexType>::nextDeadline()
+{
+    uint64_t deadline = UINT64_MAX;
+    for (Shard& shard : shards) {
+        deadline = std::min(deadline, shard.rpcTimeouts.nextDeadline());
+        deadline = std::min(deadline, shard.taskTimeouts.nextDeadline());
+    }
+    return deadline;
+}
+
+/**
+ * Block the calling thread until wakeup() is called, the given deadline
+ * passes, or idleBlockCycles elapse, whichever comes first.
+ *
+ * @param deadline
+ *      Cycle time at which the thread must stop blocking.
  */
+template <typename MutexType>
 void
-SocketImpl::dropRooPC(RooPCImpl* rpc)
+BasicSocketImpl<MutexType>::blockForWork(uint64_t deadline)
 {
-    SpinLock::Lock lock_socket(mutex);
-    auto it = rpcs.find(rpc->getId());
-    assert(it != rpcs.end());
-    RpcHandle* handle = it->second;
-    rpcTimeouts.cancelTimeout(&handle->timeout);
-    rpcs.erase(it);
-    rpcPool.destroy(handle);
+    uint64_t now = Cycles::rdtsc();
+    if (deadline <= now) {
+        return;
+    }
+    uint64_t ns =
+        Cycles::toNanoseconds(std::min(idleBlockCycles, deadline - now));
+    struct timespec timeout;
+    timeout.tv_sec = ns / 1000000000;
+    timeout.tv_nsec = ns % 1000000000;
+    struct pollfd event;
+    event.fd = wakeupFd;
+    event.events = POLLIN;
+    event.revents = 0;
+    ppoll(&event, wakeupFd >= 0 ? 1 : 0, &timeout, nullptr);
+    if (wakeupFd >= 0) {
+        // Reset the eventfd; fails harmlessly if it was not signaled.
+        uint64_t value;
+        ssize_t ret = read(wakeupFd, &value, sizeof(value));
+        (void)ret;
+    }
 }
 
 /**
  * Check and dispatch any incoming messages; separated from poll() for testing.
+ *
+ * @return
+ *      True if any messages were processed; false otherwise.
  */
-void
-SocketImpl::processIncomingMessages()
+template <typename MutexType>
+bool
+BasicSocketImpl<MutexType>::processIncomingMessages()
 {
     // Keep track of time spent doing active processing versus idle.
     Perf::Timer activityTimer;
+    bool progress = false;
+
+    // Make room for new requests if the application has caught up.
+    if (overflowCount.load(std::memory_order_relaxed) > 0) {
+        flushOverflowTasks();
+        Perf::counters.poll_active_cycles.add(activityTimer.split());
+    }
 
     // Process incoming messages
     for (Homa::unique_ptr<Homa::InMessage> message = transport->receive();
          message; message = std::move(transport->receive())) {
         Proto::HeaderCommon common;
         message->get(0, &common, sizeof(common));
-        if (common.opcode == Proto::Opcode::Request) {
+        if (steerToOwner(common.opcode, &message)) {
+            // Handed over to the thread that issued the RooPC.
+        } else if (common.opcode == Proto::Opcode::Request) {
             // Incoming message is a request.
             Proto::RequestHeader header;
             message->get(0, &header, sizeof(header));
             Perf::counters.rx_message_bytes.add(message->length() -
                                                 sizeof(header));
-            ServerTaskHandle* handle = taskPool.construct(
-                this, allocTaskId(), &header, std::move(message));
-            SpinLock::Lock lock_socket(mutex);
-            tasks.insert({handle->task.getRequestId(), handle});
-            taskTimeouts.setTimeout(&handle->timeout);
-            pendingTasks.push_back(&handle->task);
-        } else if (common.opcode == Proto::Opcode::Response) {
-            // Incoming message is a response
-            Proto::ResponseHeader header;
-            message->get(0, &header, sizeof(header));
-            Perf::counters.rx_message_bytes.add(message->length() -
-                                                sizeof(header));
-            SpinLock::Lock lock_socket(mutex);
-            auto it = rpcs.find(header.rooId);
-            if (it != rpcs.end()) {
-                RooPCImpl* rpc = &it->second->rpc;
-                rpc->handleResponse(&header, std::move(message));
-            } else {
-                // There is no RooPC waiting for this message.
+            Shard* shard = getShard(header.requestId);
+            ServerTaskImpl* task = nullptr;
+            {
+                Lock lock_shard(shard->mutex);
+                ServerTaskHandle* handle = shard->taskPool.construct(
+                    this, allocTaskId(), &header, std::move(message));
+                shard->tasks.insert(handle->task.getRequestId(),
+                                    &handle->tableNode);
+                shard->taskTimeouts.setTimeout(&handle->timeout,
+                                               taskTimeoutCycles);
+                task = &handle->task;
             }
-        } else if (common.opcode == Proto::Opcode::Manifest) {
-            Proto::ManifestHeader manifest;
-            message->get(0, &manifest, sizeof(manifest));
-            SpinLock::Lock lock_socket(mutex);
-            auto it = rpcs.find(manifest.rooId);
-            if (it != rpcs.end()) {
-                RooPCImpl* rpc = &it->second->rpc;
-                rpc->handleManifest(&manifest, std::move(message));
+            if (workers) {
+                workers->submit(task);
+            } else if (requestHandler) {
+                // Run-to-completion on the polling thread.
+                requestHandler(Roo::unique_ptr<ServerTask>(task));
             } else {
-                // There is no RooPC waiting for this manifest.
+                queuePendingTask(task);
             }
+        } else if (common.opcode == Proto::Opcode::Response) {
+            handleResponse(std::move(message));
+        } else if (common.opcode == Proto::Opcode::Manifest) {
+            handleManifest(std::move(message));
         } else if (common.opcode == Proto::Opcode::Ping) {
             Proto::PingHeader header;
             message->get(0, &header, sizeof(header));
-            SpinLock::Lock lock_socket(mutex);
-            auto it = tasks.find(header.requestId);
-            if (it != tasks.end()) {
-                ServerTaskImpl* task = &it->second->task;
+            Shard* shard = getShard(header.requestId);
+            Lock lock_shard(shard->mutex);
+            ServerTaskHandle* handle = shard->tasks.find(header.requestId);
+            if (handle != nullptr) {
+                ServerTaskImpl* task = &handle->task;
                 task->handlePing(&header, std::move(message));
             } else {
                 // There is no associated active ServerTask.
@@ -202,111 +835,368 @@ SocketImpl::processIncomingMessages()
         } else if (common.opcode == Proto::Opcode::Pong) {
             Proto::PongHeader header;
             message->get(0, &header, sizeof(header));
-            SpinLock::Lock lock_socket(mutex);
-            auto it = rpcs.find(header.rooId);
-            if (it != rpcs.end()) {
-                RooPCImpl* rpc = &it->second->rpc;
-                rpc->handlePong(&header, std::move(message));
-            } else {
-                // There is no RooPC waiting for this message.
+            Shard* shard = getShard(header.rooId);
+            RpcHandle* held = nullptr;
+            {
+                Lock lock_shard(shard->mutex);
+                RpcHandle* handle = shard->rpcs.find(header.rooId);
+                if (handle != nullptr) {
+                    RooPCImpl* rpc = &handle->rpc;
+                    rpc->handlePong(&header, std::move(message));
+                    held = holdForCallbacks(handle, lock_shard);
+                } else {
+                    // There is no RooPC waiting for this message.
+                }
+            }
+            if (held != nullptr) {
+                dispatchCallbacks(shard, held);
             }
         } else if (common.opcode == Proto::Opcode::Error) {
             Proto::ErrorHeader header;
             message->get(0, &header, sizeof(header));
-            SpinLock::Lock lock_socket(mutex);
-            auto it = rpcs.find(header.rooId);
-            if (it != rpcs.end()) {
-                RooPCImpl* rpc = &it->second->rpc;
-                rpc->handleError(&header, std::move(message));
-            } else {
-                // There is no RooPC waiting for this message.
+            Shard* shard = getShard(header.rooId);
+            RpcHandle* held = nullptr;
+            {
+                Lock lock_shard(shard->mutex);
+                RpcHandle* handle = shard->rpcs.find(header.rooId);
+                if (handle != nullptr) {
+                    RooPCImpl* rpc = &handle->rpc;
+                    rpc->handleError(&header, std::move(message));
+                    held = holdForCallbacks(handle, lock_shard);
+                } else {
+                    // There is no RooPC waiting for this message.
+                }
+            }
+            if (held != nullptr) {
+                dispatchCallbacks(shard, held);
             }
         } else {
             WARNING("Unexpected protocol message received.");
         }
+        progress = true;
         Perf::counters.poll_active_cycles.add(activityTimer.split());
     }
+    return progress;
 }
 
 /**
- * Process any expired RooPC timeouts; seperated out of poll() for testing.
+ * Process the responses and manifests other threads handed over to the
+ * calling thread; separated from poll() for testing.
+ *
+ * @return
+ *      True if any messages were processed; false otherwise.
+ */
+template <typename MutexType>
+bool
+BasicSocketImpl<MutexType>::processInboundMessages()
+{
+    if (!inboundQueues) {
+        return false;
+    }
+    std::size_t slot = ThreadId::getId();
+    if (slot >= MAX_THREAD_SLOTS) {
+        return false;
+    }
+    InboundQueue* queue = inboundQueues[slot].load(std::memory_order_acquire);
+    if (queue == nullptr) {
+        return false;
+    }
+    Perf::Timer activityTimer;
+    bool progress = false;
+    Homa::InMessage* raw;
+    while (queue->pop(&raw)) {
+        Homa::unique_ptr<Homa::InMessage> message(raw);
+        Proto::HeaderCommon common;
+        message->get(0, &common, sizeof(common));
+        if (common.opcode == Proto::Opcode::Response) {
+            handleResponse(std::move(message));
+        } else {
+            handleManifest(std::move(message));
+        }
+        progress = true;
+        Perf::counters.poll_active_cycles.add(activityTimer.split());
+    }
+    return progress;
+}
+
+/**
+ * Hand an incoming response or manifest over to the thread that issued its
+ * RooPC if response affinity is enabled and that thread is not the caller.
+ *
+ * @param opcode
+ *      Opcode of the incoming message.
+ * @param message
+ *      Incoming message; released if the message was handed over.
+ * @return
+ *      True if the message was handed over; false if the caller should
+ *      process the message itself.
+ */
+template <typename MutexType>
+bool
+BasicSocketImpl<MutexType>::steerToOwner(
+    Proto::Opcode opcode, Homa::unique_ptr<Homa::InMessage>* message)
+{
+    if (!inboundQueues || (opcode != Proto::Opcode::Response &&
+                           opcode != Proto::Opcode::Manifest)) {
+        return false;
+    }
+    // Both ResponseHeader and ManifestHeader start with the RooId.
+    Proto::RooId rooId;
+    (*message)->get(sizeof(Proto::HeaderCommon), &rooId, sizeof(rooId));
+    std::size_t slot = getThreadSlot(rooId);
+    if (slot == 0 || slot == ThreadId::getId()) {
+        return false;
+    }
+    InboundQueue* queue = inboundQueues[slot].load(std::memory_order_acquire);
+    if (queue == nullptr || !queue->push(message->get())) {
+        // Process a message that cannot be handed over rather than wait.
+        return false;
+    }
+    message->release();
+    wakeup();
+    return true;
+}
+
+/**
+ * Deliver an incoming response to the RooPC to which it belongs.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::handleResponse(
+    Homa::unique_ptr<Homa::InMessage> message)
+{
+    Proto::ResponseHeader header;
+    message->get(0, &header, sizeof(header));
+    Perf::counters.rx_message_bytes.add(message->length() - sizeof(header));
+    Shard* shard = getShard(header.rooId);
+    RpcHandle* held = nullptr;
+    {
+        Lock lock_shard(shard->mutex);
+        RpcHandle* handle = shard->rpcs.find(header.rooId);
+        if (handle != nullptr) {
+            RooPCImpl* rpc = &handle->rpc;
+            rpc->handleResponse(&header, std::move(message));
+            held = holdForCallbacks(handle, lock_shard);
+        } else {
+            // There is no RooPC waiting for this message.
+        }
+    }
+    if (held != nullptr) {
+        dispatchCallbacks(shard, held);
+    }
+}
+
+/**
+ * Deliver an incoming manifest to the RooPC to which it belongs.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::handleManifest(
+    Homa::unique_ptr<Homa::InMessage> message)
+{
+    Proto::ManifestHeader manifest;
+    message->get(0, &manifest, sizeof(manifest));
+    Shard* shard = getShard(manifest.rooId);
+    RpcHandle* held = nullptr;
+    {
+        Lock lock_shard(shard->mutex);
+        RpcHandle* handle = shard->rpcs.find(manifest.rooId);
+        if (handle != nullptr) {
+            RooPCImpl* rpc = &handle->rpc;
+            rpc->handleManifest(&manifest, std::move(message));
+            held = holdForCallbacks(handle, lock_shard);
+        } else {
+            // There is no RooPC waiting for this manifest.
+        }
+    }
+    if (held != nullptr) {
+        dispatchCallbacks(shard, held);
+    }
+}
+
+/**
+ * Make an incoming request available to the application via receive().
+ *
+ * @param task
+ *      ServerTask for the incoming request.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::queuePendingTask(ServerTaskImpl* task)
+{
+    // Preserve arrival order; only bypass the overflow when it is empty.
+    if (overflowCount.load(std::memory_order_relaxed) == 0 &&
+        pendingTasks.push(task)) {
+        return;
+    }
+    Lock lock_overflow(overflowMutex);
+    overflowTasks.push_back(task);
+    overflowCount.store(overflowTasks.size(), std::memory_order_relaxed);
+    flushOverflowTasks(lock_overflow);
+}
+
+/**
+ * Move as many ServerTask objects as will fit from overflowTasks into
+ * pendingTasks.
+ */
+template <typename MutexType>
+void
+BasicSocketImpl<MutexType>::flushOverflowTasks()
+{
+    Lock lock_overflow(overflowMutex);
+    flushOverflowTasks(lock_overflow);
+}
+
+/**
+ * Move as many ServerTask objects as will fit from overflowTasks into
+ * pendingTasks.
+ *
+ * @param lock
+ *      Reminds the caller that the SocketImpl::overflowMutex should be held.
  */
+template <typename MutexType>
 void
-SocketImpl::checkClientTimeouts()
+BasicSocketImpl<MutexType>::flushOverflowTasks(const Lock& lock)
+{
+    (void)lock;
+    while (!overflowTasks.empty() && pendingTasks.push(overflowTasks.front())) {
+        overflowTasks.pop_front();
+    }
+    overflowCount.store(overflowTasks.size(), std::memory_order_relaxed);
+}
+
+/**
+ * Process any expired RooPC timeouts; seperated out of poll() for testing.
+ *
+ * @return
+ *      True if any timeouts were processed; false otherwise.
+ */
+template <typename MutexType>
+bool
+BasicSocketImpl<MutexType>::checkClientTimeouts()
 {
     // Keep track of time spent doing active processing versus idle.
     Perf::Timer activityTimer;
 
     // Avoid calling rdtsc() again and use the activityTimer time instead.
     uint64_t now = activityTimer.read();
+    bool progress = false;
 
-    // Fast path check if there are any timeouts about to expire.
-    if (!rpcTimeouts.anyElapsed(now)) {
-        return;
-    }
+    for (Shard& shard : shards) {
+        // Fast path check if there are any timeouts about to expire.
+        if (!shard.rpcTimeouts.anyElapsed(now)) {
+            continue;
+        }
 
-    SpinLock::Lock lock_socket(mutex);
-    while (!rpcTimeouts.empty()) {
-        Timeout<RpcHandle*>* timeout = rpcTimeouts.front();
-        if (!timeout->hasElapsed(now)) {
-            break;
-        } else {
-            RpcHandle* handle = timeout->object;
-            if (handle->rpc.handleTimeout()) {
-                rpcTimeouts.setTimeout(timeout);
-            } else {
-                rpcTimeouts.cancelTimeout(timeout);
-            }
-            Perf::counters.poll_active_cycles.add(activityTimer.split());
+        // RooPCs that failed and have a completion callback to invoke.
+        SmallVector<RpcHandle*, 8> held;
+        {
+            Lock lock_shard(shard.mutex);
+            progress |= shard.rpcTimeouts.processExpired(
+                now, [&](Timeout<RpcHandle*>* timeout) {
+                    RpcHandle* handle = timeout->object;
+                    if (handle->rpc.handleTimeout()) {
+                        shard.rpcTimeouts.setTimeout(
+                            timeout, addJitter(handle->rpc.worryTimeout()));
+                    } else if (holdForCallbacks(handle, lock_shard)) {
+                        held.push_back(handle);
+                    }
+                    Perf::counters.poll_active_cycles.add(
+                        activityTimer.split());
+                });
+        }
+        for (std::size_t i = 0; i < held.size(); ++i) {
+            dispatchCallbacks(&shard, held[i]);
         }
     }
+    return progress;
 }
 
 /**
  * Process any expired task timeouts; seperated out of poll() for testing.
+ *
+ * @return
+ *      True if any timeouts were processed; false otherwise.
  */
-void
-SocketImpl::checkTaskTimeouts()
+template <typename MutexType>
+bool
+BasicSocketImpl<MutexType>::checkTaskTimeouts()
 {
     // Keep track of time spent doing active processing versus idle.
     Perf::Timer activityTimer;
 
     // Avoid calling rdtsc() again and use the activityTimer time instead.
     uint64_t now = activityTimer.read();
+    bool progress = false;
 
-    // Fast path check if there are any timeouts about to expire.
-    if (!taskTimeouts.anyElapsed(now)) {
-        return;
+    for (Shard& shard : shards) {
+        // Fast path check if there are any timeouts about to expire.
+        if (!shard.taskTimeouts.anyElapsed(now)) {
+            continue;
+        }
+
+        Lock lock_shard(shard.mutex);
+        progress |= shard.taskTimeouts.processExpired(
+            now, [&](Timeout<ServerTaskHandle*>* timeout) {
+                ServerTaskHandle* handle = timeout->object;
+                if (handle->task.handleTimeout()) {
+                    // Timeout handled and reset
+                    shard.taskTimeouts.setTimeout(timeout, taskTimeoutCycles);
+                } else {
+                    shard.tasks.remove(&handle->tableNode);
+                    shard.taskPool.destroy(handle);
+                }
+                Perf::counters.poll_active_cycles.add(activityTimer.split());
+            });
     }
+    return progress;
+}
 
-    SpinLock::Lock lock_socket(mutex);
-    while (!taskTimeouts.empty()) {
-        Timeout<ServerTaskHandle*>* timeout = taskTimeouts.front();
-        if (!timeout->hasElapsed(now)) {
-            break;
-        } else {
-            ServerTaskHandle* handle = timeout->object;
-            if (handle->task.handleTimeout()) {
-                // Timeout handled and reset
-                taskTimeouts.setTimeout(timeout);
-            } else {
-                taskTimeouts.cancelTimeout(timeout);
-                tasks.erase(handle->task.getRequestId());
-                taskPool.destroy(handle);
-            }
-            Perf::counters.poll_active_cycles.add(activityTimer.split());
-        }
+/**
+ * Shard constructor.
+ */
+template <typename MutexType>
+BasicSocketImpl<MutexType>::Shard::Shard()
+    : mutex()
+    , rpcPool()
+    , taskPool()
+    , rpcs(RPC_SLOTS)
+    , tasks()
+    , rpcTimeouts(Cycles::fromMicroseconds(TIMEOUT_TICK_US))
+    , taskTimeouts(Cycles::fromMicroseconds(TIMEOUT_TICK_US))
+{}
+
+/**
+ * Extend a worry timeout by a random amount of up to worryJitterPercent of
+ * the timeout so that RooPCs started together spread out their pings.
+ */
+template <typename MutexType>
+uint64_t
+BasicSocketImpl<MutexType>::addJitter(uint64_t cycles)
+{
+    if (worryJitterPercent == 0) {
+        return cycles;
     }
+    // Per-thread xorshift generator; cheap and needs no synchronization.
+    thread_local uint64_t state = Cycles::rdtsc() | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return cycles + state % (cycles * worryJitterPercent / 100 + 1);
 }
 
 /**
  * Return a new unique TaskId.
  */
+template <typename MutexType>
 Proto::TaskId
-SocketImpl::allocTaskId()
+BasicSocketImpl<MutexType>::allocTaskId()
 {
     return Proto::TaskId(
         socketId, nextSequenceNumber.fetch_add(1, std::memory_order_relaxed));
 }
 
+template class BasicSocketImpl<SpinLock>;
+template class BasicSocketImpl<NullLock>;
+
 }  // namespace Roo
@@ -24,37 +24,88 @@
 #include <deque>
 #include <list>
 #include <memory>
+#include <thread>
 #include <unordered_map>
 
+#include "CacheAligned.h"
+#include "Intrusive.h"
+#include "MpmcQueue.h"
+#include "NullLock.h"
 #include "ObjectPool.h"
 #include "Proto.h"
 #include "RooPCImpl.h"
+#include "RttEstimator.h"
 #include "ServerTaskImpl.h"
+#include "SlotTable.h"
+#include "SmallVector.h"
 #include "SpinLock.h"
 #include "Timeout.h"
+#include "WorkerPool.h"
 
 namespace Roo {
 
 /**
  * Implementation of Roo::Socket.
+ *
+ * The socket embeds cache line aligned Shards, so it is allocated through
+ * CacheAligned to keep that alignment on the heap.
+ *
+ * @tparam MutexType
+ *      Lock used to protect the socket's state and that of its RooPCs and
+ *      ServerTasks; SpinLock for a thread-safe socket or NullLock for a
+ *      socket that is only used by a single thread.
  */
-class SocketImpl : public Socket {
+template <typename MutexType>
+class BasicSocketImpl : public Socket, public CacheAligned {
   public:
-    explicit SocketImpl(Homa::Transport* transport);
-    virtual ~SocketImpl();
+    /// RooPC implementation managed by this socket.
+    using RooPCImpl = BasicRooPCImpl<MutexType>;
+
+    /// ServerTask implementation managed by this socket.
+    using ServerTaskImpl = BasicServerTaskImpl<MutexType>;
+
+    /// RAII guard that holds a MutexType.
+    using Lock = typename MutexType::Lock;
+
+    explicit BasicSocketImpl(Homa::Transport* transport,
+                             const SocketOptions& options = SocketOptions());
+    virtual ~BasicSocketImpl();
     virtual Roo::unique_ptr<RooPC> allocRooPC();
+    virtual void allocRooPCs(Roo::unique_ptr<RooPC> rpcs[], std::size_t count);
+    virtual void destroyRooPCs(Roo::unique_ptr<RooPC> rpcs[],
+                               std::size_t count);
+    virtual std::size_t pollCompletions(RooPC* completed[], std::size_t max);
     virtual Roo::unique_ptr<ServerTask> receive();
+    virtual std::size_t receive(Roo::unique_ptr<ServerTask> tasks[],
+                                std::size_t max);
+    virtual void registerHandler(RequestHandler handler);
+    virtual void startWorkers(std::size_t numWorkers, RequestHandler handler,
+                              int firstCpu);
     virtual void poll();
+    virtual void waitForWork();
+    virtual void wakeup();
     virtual Homa::Driver* getDriver()
     {
         return transport->getDriver();
     }
 
     void dropRooPC(RooPCImpl* rpc);
+    void recordRtt(Homa::Driver::Address peer, uint64_t rttCycles);
+    uint64_t worryTimeout(Homa::Driver::Address peer);
+    uint64_t worryTimeout();
 
     /// Transport through which messages can be sent and received.
     Homa::Transport* const transport;
 
+    /// True if ServerTasks send outbound messages without buffering them.
+    bool const eagerSend;
+
+    /// Cycles a RooPC branch's pings may go unanswered before the RooPC
+    /// fails.  Fixed at several maximum worry timeouts so that an adaptive
+    /// worry timeout only makes pings more frequent and a slow handler on a
+    /// server that answers pings late does not fail the RooPC sooner.
+    uint64_t const pingFailureCycles;
+
   private:
     /**
      * Collection of all socket state for a single RooPC.
@@ -65,6 +116,11 @@ class SocketImpl : public Socket {
         RpcHandle(Args&&... args)
             : rpc(static_cast<Args&&>(args)...)
             , timeout(this)
+            , tableNode(this)
+            , completionNode(this)
+            , dispatchCount(0)
+            , dropped(false)
+            , completionQueued(false)
         {}
 
         /// Destructor
@@ -75,6 +131,24 @@ class SocketImpl : public Socket {
 
         /// Timeout entry associated with this RooPC
         Timeout<RpcHandle*> timeout;
+
+        /// Links this RooPC into the Shard::rpcs fallback table.
+        typename Intrusive::HashTable<Proto::RooId, RpcHandle>::Node tableNode;
+
+        /// Links this RooPC into SocketImpl::completions once it finishes.
+        typename Intrusive::List<RpcHandle>::Node completionNode;
+
+        /// Number of threads invoking this RooPC's callbacks; the handle
+        /// must not be destroyed while this is non-zero.
+        int dispatchCount;
+
+        /// True if the application destroyed the RooPC while its callbacks
+        /// were being invoked; the last dispatching thread finishes the drop.
+        bool dropped;
+
+        /// True if this RooPC was added to SocketImpl::completions; it may
+        /// since have been removed by pollCompletions().
+        bool completionQueued;
     };
 
     /**
@@ -86,6 +160,7 @@ class SocketImpl : public Socket {
         ServerTaskHandle(Args&&... args)
             : task(static_cast<Args&&>(args)...)
             , timeout(this)
+            , tableNode(this)
         {}
 
         /// Destructor
@@ -96,11 +171,174 @@ class SocketImpl : public Socket {
 
         /// Timeout entry associated with this ServerTask
         Timeout<ServerTaskHandle*> timeout;
+
+        /// Links this ServerTask into Shard::tasks.
+        typename Intrusive::HashTable<Proto::RequestId, ServerTaskHandle>::Node
+            tableNode;
+    };
+
+    /**
+     * Maps a RooId to its slot in a Shard's rpcs table.
+     *
+     * A Shard holds every NUM_SHARDS-th RooId so consecutive RooPCs in a Shard
+     * occupy consecutive slots.  The thread slot in the high order bits of
+     * the sequence is masked off by the table.
+     */
+    struct RpcSlotIndex {
+        /// Return the slot index of the given RooId.
+        uint64_t operator()(const Proto::RooId& rooId) const
+        {
+            return rooId.sequence / NUM_SHARDS;
+        }
     };
 
-    void processIncomingMessages();
-    void checkClientTimeouts();
-    void checkTaskTimeouts();
+    /// Number of slots in each Shard's rpcs table; must be a power of 2.
+    static const std::size_t RPC_SLOTS = 256;
+
+    /**
+     * Holds the portion of the socket state associated with a subset of the
+     * RooPC and ServerTask identifiers.
+     *
+     * Each Shard is protected by its own lock and is aligned to its own cache
+     * line so that threads operating on different shards do not contend.
+     */
+    struct alignas(CACHE_LINE_SIZE) Shard {
+        Shard();
+        ~Shard() = default;
+
+        /// Monitor style mutex; protects all other members of this Shard.
+        MutexType mutex;
+
+        /// RooPC allocator
+        ObjectPool<RpcHandle> rpcPool;
+
+        /// ServerTask allocator
+        ObjectPool<ServerTaskHandle> taskPool;
+
+        /// Tracks the set of RooPC objects in this shard that were initiated
+        /// by this socket.
+        SlotTable<Proto::RooId, RpcHandle, RpcSlotIndex, &RpcHandle::tableNode>
+            rpcs;
+
+        /// Tracks the set of live ServerTask objects in this shard.
+        Intrusive::HashTable<Proto::RequestId, ServerTaskHandle> tasks;
+
+        /// RooPC ids in increasing timeout order.
+        TimeoutManager<RpcHandle*> rpcTimeouts;
+
+        /// ServerTask objects have completed transmission and are waiting to
+        /// be garbage collected after a timeout. ServerTask objects are held
+        /// in timeout order.
+        TimeoutManager<ServerTaskHandle*> taskTimeouts;
+    };
+
+    /// Number of Shard instances per socket; must be a power of 2.
+    static const std::size_t NUM_SHARDS = 16;
+
+    /**
+     * Return the Shard that holds the state for the given RooPC.
+     *
+     * RooIds are allocated sequentially by this socket so consecutive RooPCs
+     * are spread round-robin across the shards.
+     */
+    inline Shard* getShard(const Proto::RooId& rooId)
+    {
+        return &shards[rooId.sequence & (NUM_SHARDS - 1)];
+    }
+
+    /**
+     * Return the Shard that holds the state for the given ServerTask.
+     */
+    inline Shard* getShard(const Proto::RequestId& requestId)
+    {
+        // The low order bits of the hash select the bucket within the
+        // Shard::tasks table; use the high order bits to select the Shard.
+        uint64_t hash = Proto::RequestId::Hasher()(requestId);
+        return &shards[(hash >> 32) & (NUM_SHARDS - 1)];
+    }
+
+    /**
+     * Holds the round-trip time estimates of a subset of the peers, selected
+     * by address, so that every RooPC shares one estimate per peer without
+     * all of them contending for a single lock.
+     */
+    struct alignas(CACHE_LINE_SIZE) RttShard {
+        RttShard()
+            : mutex()
+            , peers()
+            , combined()
+            , timeout(0)
+        {}
+
+        /// Protects peers and combined; a leaf lock that may be acquired with
+        /// Shard and RooPC locks held.
+        MutexType mutex;
+
+        /// Round-trip time estimate of each measured peer in this RttShard.
+        std::unordered_map<Homa::Driver::Address, RttEstimator> peers;
+
+        /// Round-trip time estimate across all peers in this RttShard.
+        RttEstimator combined;
+
+        /// Worry timeout derived from combined; 0 until the first sample.
+        std::atomic<uint64_t> timeout;
+    };
+
+    /**
+     * Return the RttShard that holds the estimate for the given peer.
+     */
+    inline RttShard* getRttShard(Homa::Driver::Address peer)
+    {
+        // Addresses may differ only in a few bits; mix them before selecting.
+        uint64_t hash = uint64_t(peer) * 0x9E3779B97F4A7C15UL;
+        return &rttShards[(hash >> 32) & (NUM_SHARDS - 1)];
+    }
+
+    /// Bit position of the thread slot within a RooId's sequence.
+    static const int THREAD_SLOT_SHIFT = 56;
+
+    /// Number of thread slots that can be encoded in a RooId; threads whose
+    /// ThreadId does not fit use slot 0, which has no response affinity.
+    static const std::size_t MAX_THREAD_SLOTS = 256;
+
+    /// Capacity of each per-thread inbound queue.
+    static const std::size_t INBOUND_QUEUE_CAPACITY = 256;
+
+    /**
+     * Return the slot of the thread that allocated the given RooPC.
+     */
+    static inline std::size_t getThreadSlot(const Proto::RooId& rooId)
+    {
+        return rooId.sequence >> THREAD_SLOT_SHIFT;
+    }
+
+    /// Holds responses and manifests handed over to the thread that issued
+    /// the RooPCs to which they belong.
+    using InboundQueue = MpmcQueue<Homa::InMessage*>;
+
+    uint64_t allocThreadTag();
+    void dropRooPC(Shard* shard, RooPCImpl* rpc, const Lock& lock);
+    RpcHandle* holdForCallbacks(RpcHandle* handle, const Lock& lock);
+    void dispatchCallbacks(Shard* shard, RpcHandle* handle);
+    void queueCompletion(RpcHandle* handle, const Lock& lock);
+    void runPoller(int cpu);
+    void pausePoller();
+    void resumePoller();
+    bool pollOnce();
+    uint64_t nextDeadline();
+    void blockForWork(uint64_t deadline);
+    bool processIncomingMessages();
+    bool processInboundMessages();
+    bool steerToOwner(Proto::Opcode opcode,
+                      Homa::unique_ptr<Homa::InMessage>* message);
+    void handleResponse(Homa::unique_ptr<Homa::InMessage> message);
+    void handleManifest(Homa::unique_ptr<Homa::InMessage> message);
+    void queuePendingTask(ServerTaskImpl* task);
+    void flushOverflowTasks();
+    void flushOverflowTasks(const Lock& lock);
+    bool checkClientTimeouts();
+    bool checkTaskTimeouts();
+    uint64_t addJitter(uint64_t cycles);
     Proto::TaskId allocTaskId();
 
     /// Identifer for this socket.  This identifer must be unique among all
@@ -110,36 +348,117 @@ class SocketImpl : public Socket {
     /// Used to generate socket unique identifiers.
     std::atomic<uint64_t> nextSequenceNumber;
 
-    /// Monitor style mutex.
-    SpinLock mutex;
+    /// Socket state partitioned by RooPC and ServerTask identifier.
+    Shard shards[NUM_SHARDS];
+
+    /// Worry timeout, in cycles, used for peers with no RTT samples.
+    uint64_t const initialWorryTimeoutCycles;
 
-    /// RooPC allocator
-    ObjectPool<RpcHandle> rpcPool;
+    /// Lower bound, in cycles, on the adaptive worry timeout.
+    uint64_t const minWorryTimeoutCycles;
 
-    /// ServerTask allocator
-    ObjectPool<ServerTaskHandle> taskPool;
+    /// Upper bound, in cycles, on the adaptive worry timeout.
+    uint64_t const maxWorryTimeoutCycles;
 
-    /// Tracks the set of RooPC objects that were initiated by this socket.
-    std::unordered_map<Proto::RooId, RpcHandle*, Proto::RooId::Hasher> rpcs;
+    /// Maximum random extension of a worry timeout as a percent of the
+    /// timeout.
+    uint32_t const worryJitterPercent;
 
-    /// Tracks the set of live ServerTask objects managed by this socket.
-    std::unordered_map<Proto::RequestId, ServerTaskHandle*,
-                       Proto::RequestId::Hasher>
-        tasks;
+    /// Cycles a detached ServerTask may go without being pinged before it is
+    /// garbage collected.
+    uint64_t const taskTimeoutCycles;
 
-    /// RooPC ids in increasing timeout order.
-    TimeoutManager<RpcHandle*> rpcTimeouts;
+    /// Cycles waitForWork() polls without finding work before blocking.
+    uint64_t const idleSpinCycles;
 
-    /// ServerTask objects have completed transmission and are waiting to be
-    /// garbage collected after a timeout. ServerTask objects are held in
-    /// timeout order.
-    TimeoutManager<ServerTaskHandle*> taskTimeouts;
+    /// Maximum cycles waitForWork() blocks before polling again.
+    uint64_t const idleBlockCycles;
+
+    /// Event file descriptor signaled by wakeup() to unblock waitForWork();
+    /// -1 if it could not be created, in which case waitForWork() sleeps.
+    int const wakeupFd;
+
+    /// Per-thread queues of responses and manifests indexed by thread slot;
+    /// a queue is created by its thread when it first allocates a RooPC.
+    /// Null unless SocketOptions::responseAffinity is in effect.
+    std::unique_ptr<std::atomic<InboundQueue*>[]> inboundQueues;
+
+    /// Number of threads blocked (or about to block) in waitForWork();
+    /// wakeup() only signals wakeupFd when this is non-zero.
+    std::atomic<int> sleepers;
+
+    /// True once some thread has been about to block in waitForWork(); until
+    /// then wakeup() returns without the fence it otherwise needs.
+    std::atomic<bool> mayBlock;
+
+    /// Round-trip time estimates of the peers of this socket's RooPCs.
+    RttShard rttShards[NUM_SHARDS];
+
+    /// Worry timeout, in cycles, for RooPCs whose peers are not yet known;
+    /// the longest timeout of any RttShard, recomputed after every sample so
+    /// that it can be read without a lock.
+    std::atomic<uint64_t> socketWorryTimeout;
+
+    /// If set, called by the polling thread to process each incoming request
+    /// instead of queuing the request in pendingTasks.
+    RequestHandler requestHandler;
+
+    /// If set, runs each incoming request on a worker thread; takes
+    /// precedence over requestHandler.
+    std::unique_ptr<WorkerPool> workers;
+
+    /// Maximum number of ServerTask objects held in pendingTasks.
+    static const std::size_t PENDING_TASKS_CAPACITY = 4096;
 
     /// Collection of ServerTask objects (incoming requests) that haven't been
     /// requested by the application.
-    std::deque<ServerTaskImpl*> pendingTasks;
+    MpmcQueue<ServerTaskImpl*> pendingTasks;
+
+    /// Protects overflowTasks.
+    MutexType overflowMutex;
+
+    /// Incoming requests that arrived while pendingTasks was full; moved to
+    /// pendingTasks by the polling thread as space becomes available.
+    std::deque<ServerTaskImpl*> overflowTasks;
+
+    /// Number of entries in overflowTasks; allows the common case of an empty
+    /// overflow to be checked without acquiring overflowMutex.
+    std::atomic<std::size_t> overflowCount;
+
+    /// True if finished RooPCs are queued in completions; see
+    /// SocketOptions::trackCompletions.
+    bool const trackCompletions;
+
+    /// Protects completions; never held while acquiring another lock.
+    MutexType completionMutex;
+
+    /// RooPCs that have finished but have not yet been returned by
+    /// pollCompletions(), in the order they finished.
+    Intrusive::List<RpcHandle> completions;
+
+    /// Number of entries in completions; allows pollCompletions() to return
+    /// without acquiring completionMutex when there is nothing to return.
+    std::atomic<std::size_t> completionCount;
+
+    /// Requests that the background poller thread changes state.
+    enum PollerState {
+        POLLER_RUN,     ///< Keep polling.
+        POLLER_PAUSE,   ///< Stop polling and acknowledge with POLLER_PAUSED.
+        POLLER_PAUSED,  ///< Not polling; waiting for POLLER_RUN.
+        POLLER_STOP,    ///< Exit the thread.
+    };
+
+    /// Current PollerState of the background poller thread.
+    std::atomic<int> pollerState;
+
+    /// Thread that polls this socket if SocketOptions::ownPoller was set;
+    /// otherwise, not joinable and the application must call poll().
+    std::thread poller;
 };
 
+/// Thread-safe socket implementation.
+using SocketImpl = BasicSocketImpl<SpinLock>;
+
 }  // namespace Roo
 
 #endif  // ROO_SOCKETIMPL_H
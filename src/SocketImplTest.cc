@@ -17,13 +17,18 @@
 #include <Roo/Debug.h>
 #include <gtest/gtest.h>
 
+#include <unistd.h>
+
+#include <atomic>
 #include <cstring>
 #include <functional>
 
 #include "Mock/MockHoma.h"
+#include "Perf.h"
 #include "RooPCImpl.h"
 #include "ServerTaskImpl.h"
 #include "SocketImpl.h"
+#include "ThreadId.h"
 
 namespace Roo {
 namespace {
@@ -68,10 +73,36 @@ class SocketImplTest : public ::testing::Test {
         header.requestId = requestId;
         Homa::unique_ptr<Homa::InMessage> request(&mockIncomingRequest);
 
-        SocketImpl::ServerTaskHandle* handle = socket->taskPool.construct(
+        SocketImpl::Shard* shard = socket->getShard(requestId);
+        SocketImpl::ServerTaskHandle* handle = shard->taskPool.construct(
             socket, socket->allocTaskId(), &header, std::move(request));
-        socket->tasks.insert({requestId, handle});
-        socket->taskTimeouts.setTimeout(&handle->timeout);
+        shard->tasks.insert(requestId, &handle->tableNode);
+        shard->taskTimeouts.setTimeout(&handle->timeout,
+                                       socket->taskTimeoutCycles);
+        return handle;
+    }
+
+    void enableCompletions()
+    {
+        delete socket;
+        SocketOptions options;
+        options.trackCompletions = true;
+        EXPECT_CALL(transport, getId()).WillOnce(Return(42));
+        socket = new SocketImpl(&transport, options);
+    }
+
+    void enableResponseAffinity()
+    {
+        socket->inboundQueues.reset(
+            new std::atomic<SocketImpl::InboundQueue*>
+                [SocketImpl::MAX_THREAD_SLOTS]());
+    }
+
+    SocketImpl::RpcHandle* createRpc(Proto::RooId rooId)
+    {
+        SocketImpl::Shard* shard = socket->getShard(rooId);
+        SocketImpl::RpcHandle* handle = shard->rpcPool.construct(socket, rooId);
+        shard->rpcs.insert(rooId, handle);
         return handle;
     }
 
@@ -103,12 +134,93 @@ TEST_F(SocketImplTest, constructor)
 TEST_F(SocketImplTest, allocRooPC)
 {
     EXPECT_EQ(1U, socket->nextSequenceNumber.load());
-    EXPECT_TRUE(socket->rpcs.empty());
     Proto::RooId rooId(socket->socketId, 1U);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+    EXPECT_TRUE(shard->rpcs.empty());
     Roo::unique_ptr<RooPC> rpc = socket->allocRooPC();
     EXPECT_EQ(2U, socket->nextSequenceNumber.load());
-    EXPECT_FALSE(socket->rpcs.find(rooId) == socket->rpcs.end());
-    EXPECT_EQ(rooId, socket->rpcTimeouts.front()->object->rpc.getId());
+    EXPECT_NE(nullptr, shard->rpcs.find(rooId));
+    EXPECT_NE(Timeout<SocketImpl::RpcHandle*>::UNSCHEDULED,
+              shard->rpcs.find(rooId)->timeout.slot);
+    EXPECT_FALSE(shard->rpcTimeouts.empty());
+}
+
+TEST_F(SocketImplTest, allocRooPCs)
+{
+    const std::size_t count = SocketImpl::NUM_SHARDS + 2;
+    Roo::unique_ptr<RooPC> rpcs[count];
+
+    socket->allocRooPCs(rpcs, count);
+
+    EXPECT_EQ(1U + count, socket->nextSequenceNumber.load());
+    for (std::size_t i = 0; i < count; ++i) {
+        Proto::RooId rooId(socket->socketId, 1U + i);
+        SocketImpl::Shard* shard = socket->getShard(rooId);
+        ASSERT_TRUE(rpcs[i]);
+        EXPECT_EQ(rooId, static_cast<RooPCImpl*>(rpcs[i].get())->getId());
+        EXPECT_NE(nullptr, shard->rpcs.find(rooId));
+    }
+    SocketImpl::Shard* shard = socket->getShard(Proto::RooId(0, 1));
+    EXPECT_EQ(2U, shard->rpcs.size());
+    EXPECT_EQ(2U, shard->rpcTimeouts.count);
+}
+
+TEST_F(SocketImplTest, allocRooPCs_empty)
+{
+    socket->allocRooPCs(nullptr, 0);
+    EXPECT_EQ(1U, socket->nextSequenceNumber.load());
+}
+
+TEST_F(SocketImplTest, allocRooPCs_reuse)
+{
+    // Each new RooPC lands in the same shard as the one it replaces.
+    const std::size_t count = SocketImpl::NUM_SHARDS;
+    Roo::unique_ptr<RooPC> rpcs[count];
+    socket->allocRooPCs(rpcs, count);
+
+    socket->allocRooPCs(rpcs, count);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        Proto::RooId oldId(socket->socketId, 1U + i);
+        Proto::RooId newId(socket->socketId, 1U + count + i);
+        SocketImpl::Shard* shard = socket->getShard(newId);
+        ASSERT_TRUE(rpcs[i]);
+        EXPECT_EQ(newId, static_cast<RooPCImpl*>(rpcs[i].get())->getId());
+        EXPECT_EQ(nullptr, shard->rpcs.find(oldId));
+        EXPECT_EQ(1U, shard->rpcs.size());
+    }
+}
+
+TEST_F(SocketImplTest, allocRooPC_responseAffinity)
+{
+    enableResponseAffinity();
+    std::size_t slot = ThreadId::getId();
+    ASSERT_LT(slot, SocketImpl::MAX_THREAD_SLOTS);
+
+    Roo::unique_ptr<RooPC> rpc = socket->allocRooPC();
+    Proto::RooId rooId = static_cast<RooPCImpl*>(rpc.get())->getId();
+    EXPECT_EQ(slot, SocketImpl::getThreadSlot(rooId));
+    uint64_t counterMask = (1UL << SocketImpl::THREAD_SLOT_SHIFT) - 1;
+    EXPECT_EQ(1U, rooId.sequence & counterMask);
+    EXPECT_NE(nullptr, socket->getShard(rooId)->rpcs.find(rooId));
+}
+
+TEST_F(SocketImplTest, destroyRooPCs)
+{
+    const std::size_t count = SocketImpl::NUM_SHARDS + 2;
+    Roo::unique_ptr<RooPC> rpcs[count];
+    socket->allocRooPCs(rpcs, count);
+    rpcs[1].reset();
+
+    socket->destroyRooPCs(rpcs, count);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        EXPECT_FALSE(rpcs[i]);
+    }
+    for (std::size_t s = 0; s < SocketImpl::NUM_SHARDS; ++s) {
+        EXPECT_TRUE(socket->shards[s].rpcs.empty());
+        EXPECT_EQ(0, socket->shards[s].rpcPool.outstandingObjects);
+    }
 }
 
 TEST_F(SocketImplTest, receive)
@@ -117,7 +229,7 @@ TEST_F(SocketImplTest, receive)
     Proto::RequestId requestId({{2, 2}, 2}, 0);
     SocketImpl::ServerTaskHandle* handle =
         createTask(rooId, requestId, 0xDEADBEEF);
-    socket->pendingTasks.push_back(&handle->task);
+    socket->pendingTasks.push(&handle->task);
     ServerTask* expected_task = &handle->task;
 
     {
@@ -133,6 +245,42 @@ TEST_F(SocketImplTest, receive)
     }
 }
 
+TEST_F(SocketImplTest, receive_batch)
+{
+    SocketImpl::ServerTaskHandle* handles[3];
+    for (int i = 0; i < 3; ++i) {
+        Proto::RequestId requestId({{2, 2}, 2}, i);
+        handles[i] = createTask(Proto::RooId(1, 1), requestId, 0xDEADBEEF);
+        socket->pendingTasks.push(&handles[i]->task);
+    }
+    Roo::unique_ptr<ServerTask> tasks[4];
+
+    EXPECT_EQ(2U, socket->receive(tasks, 2));
+    EXPECT_EQ(&handles[0]->task, tasks[0].get());
+    EXPECT_EQ(&handles[1]->task, tasks[1].get());
+    EXPECT_FALSE(tasks[2]);
+
+    EXPECT_EQ(1U, socket->receive(tasks + 2, 2));
+    EXPECT_EQ(&handles[2]->task, tasks[2].get());
+    EXPECT_TRUE(socket->pendingTasks.empty());
+
+    EXPECT_EQ(0U, socket->receive(tasks + 3, 1));
+    EXPECT_FALSE(tasks[3]);
+
+    for (int i = 0; i < 3; ++i) {
+        tasks[i].release();
+    }
+}
+
+TEST_F(SocketImplTest, registerHandler)
+{
+    EXPECT_FALSE(socket->requestHandler);
+    socket->registerHandler([](Roo::unique_ptr<ServerTask>) {});
+    EXPECT_TRUE(socket->requestHandler);
+    socket->registerHandler(nullptr);
+    EXPECT_FALSE(socket->requestHandler);
+}
+
 TEST_F(SocketImplTest, poll)
 {
     // Nothing to test directly; tested as part of:
@@ -142,16 +290,274 @@ TEST_F(SocketImplTest, poll)
     //      checkTaskTimeouts()
 }
 
+TEST_F(SocketImplTest, waitForWork)
+{
+    PerfUtils::Cycles::mockTscValue = 0;
+    SocketOptions options;
+    options.idleSpinUs = 0;
+    options.idleBlockUs = 10;
+    EXPECT_CALL(transport, getId()).WillOnce(Return(42));
+    SocketImpl idleSocket(&transport, options);
+    EXPECT_CALL(transport, receive()).WillRepeatedly(Invoke([]() {
+        return Homa::unique_ptr<Homa::InMessage>();
+    }));
+    uint64_t blocked = Perf::counters.idle_blocked_cycles.get();
+
+    // Poll, poll again after announcing the sleep, block, and poll on waking.
+    EXPECT_CALL(transport, poll()).Times(3);
+
+    EXPECT_FALSE(idleSocket.mayBlock.load());
+    idleSocket.waitForWork();
+
+    EXPECT_TRUE(idleSocket.mayBlock.load());
+    EXPECT_EQ(0, idleSocket.sleepers.load());
+    EXPECT_LT(blocked, Perf::counters.idle_blocked_cycles.get());
+}
+
+TEST_F(SocketImplTest, ownPoller)
+{
+    SocketOptions options;
+    options.ownPoller = true;
+    std::atomic<int> polls(0);
+    EXPECT_CALL(transport, poll()).WillRepeatedly(Invoke([&]() { polls++; }));
+    EXPECT_CALL(transport, receive()).WillRepeatedly(Invoke([]() {
+        return Homa::unique_ptr<Homa::InMessage>();
+    }));
+    EXPECT_CALL(transport, getId()).WillOnce(Return(42));
+    SocketImpl pollingSocket(&transport, options);
+    EXPECT_TRUE(pollingSocket.poller.joinable());
+    while (polls.load() == 0) {
+    }
+
+    // Replacing the handler pauses the poller.
+    pollingSocket.registerHandler([](Roo::unique_ptr<ServerTask>) {});
+    EXPECT_EQ(SocketImpl::POLLER_RUN, pollingSocket.pollerState.load());
+    EXPECT_TRUE(pollingSocket.requestHandler);
+
+    pollingSocket.pausePoller();
+    int paused = polls.load();
+    pollingSocket.poll();
+    EXPECT_EQ(paused, polls.load());
+    pollingSocket.resumePoller();
+
+    // Waiting only yields to the poller, so wakeup() never needs to signal.
+    pollingSocket.waitForWork();
+    EXPECT_FALSE(pollingSocket.mayBlock.load());
+}
+
+TEST_F(SocketImplTest, wakeup)
+{
+    uint64_t value = 0;
+    ASSERT_LE(0, socket->wakeupFd);
+
+    // No sleepers; nothing signaled.
+    socket->wakeup();
+    EXPECT_GT(0, read(socket->wakeupFd, &value, sizeof(value)));
+
+    // Never blocked in waitForWork(); nothing signaled.
+    socket->sleepers = 1;
+    socket->wakeup();
+    EXPECT_GT(0, read(socket->wakeupFd, &value, sizeof(value)));
+
+    socket->mayBlock = true;
+    socket->wakeup();
+    EXPECT_EQ(sizeof(value), read(socket->wakeupFd, &value, sizeof(value)));
+    EXPECT_EQ(1U, value);
+    socket->sleepers = 0;
+}
+
+TEST_F(SocketImplTest, nextDeadline)
+{
+    EXPECT_EQ(UINT64_MAX, socket->nextDeadline());
+
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+    PerfUtils::Cycles::mockTscValue = 1UL << 32;
+    shard->rpcTimeouts.setTimeout(&handle->timeout, 1000);
+    EXPECT_EQ(shard->rpcTimeouts.nextDeadline(), socket->nextDeadline());
+    EXPECT_LT(1UL << 32, socket->nextDeadline());
+    PerfUtils::Cycles::mockTscValue = 0;
+
+    socket->dropRooPC(&handle->rpc);
+}
+
+TEST_F(SocketImplTest, blockForWork)
+{
+    uint64_t value = 0;
+
+    // Deadline already passed.
+    PerfUtils::Cycles::mockTscValue = 1000;
+    socket->blockForWork(500);
+    PerfUtils::Cycles::mockTscValue = 0;
+
+    // A pending wakeup ends the block and is consumed.
+    socket->sleepers = 1;
+    socket->wakeup();
+    socket->blockForWork(UINT64_MAX);
+    EXPECT_GT(0, read(socket->wakeupFd, &value, sizeof(value)));
+    socket->sleepers = 0;
+}
+
 TEST_F(SocketImplTest, dropRooPC)
 {
     Proto::RooId rooId = socket->allocTaskId();
-    SocketImpl::RpcHandle* handle = socket->rpcPool.construct(socket, rooId);
-    socket->rpcs.insert({rooId, handle});
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
 
     socket->dropRooPC(&handle->rpc);
 
-    EXPECT_EQ(0, socket->rpcs.count(rooId));
-    EXPECT_EQ(0, socket->rpcPool.outstandingObjects);
+    EXPECT_EQ(nullptr, shard->rpcs.find(rooId));
+    EXPECT_EQ(0, shard->rpcPool.outstandingObjects);
+}
+
+TEST_F(SocketImplTest, dropRooPC_dispatching)
+{
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+    handle->dispatchCount = 1;
+
+    socket->dropRooPC(&handle->rpc);
+
+    EXPECT_TRUE(handle->dropped);
+    EXPECT_EQ(handle, shard->rpcs.find(rooId));
+    EXPECT_EQ(1, shard->rpcPool.outstandingObjects);
+
+    handle->dispatchCount = 0;
+    handle->dropped = false;
+    socket->dropRooPC(&handle->rpc);
+}
+
+TEST_F(SocketImplTest, holdForCallbacks)
+{
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+    SpinLock::Lock lock_shard(shard->mutex);
+
+    // Nothing pending
+    EXPECT_EQ(nullptr, socket->holdForCallbacks(handle, lock_shard));
+    EXPECT_EQ(0, handle->dispatchCount);
+
+    handle->rpc.completePending = true;
+    EXPECT_EQ(handle, socket->holdForCallbacks(handle, lock_shard));
+    EXPECT_EQ(1, handle->dispatchCount);
+
+    // Already destroyed by the application.
+    handle->dropped = true;
+    EXPECT_EQ(nullptr, socket->holdForCallbacks(handle, lock_shard));
+    EXPECT_EQ(1, handle->dispatchCount);
+
+    handle->dispatchCount = 0;
+    handle->dropped = false;
+    socket->dropRooPC(shard, &handle->rpc, lock_shard);
+}
+
+TEST_F(SocketImplTest, dispatchCallbacks)
+{
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+    int calls = 0;
+    handle->rpc.completeCallback = [&](RooPC* rpc) {
+        EXPECT_EQ(&handle->rpc, rpc);
+        calls++;
+        // Destroy the RooPC from its own callback.
+        socket->dropRooPC(static_cast<RooPCImpl*>(rpc));
+        EXPECT_EQ(1, shard->rpcPool.outstandingObjects);
+    };
+    handle->rpc.completePending = true;
+    handle->dispatchCount = 1;
+
+    socket->dispatchCallbacks(shard, handle);
+
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ(nullptr, shard->rpcs.find(rooId));
+    EXPECT_EQ(0, shard->rpcPool.outstandingObjects);
+}
+
+TEST_F(SocketImplTest, dispatchCallbacks_completion)
+{
+    enableCompletions();
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+
+    // Nothing finished
+    handle->rpc.responsePending = true;
+    handle->dispatchCount = 1;
+    socket->dispatchCallbacks(shard, handle);
+    EXPECT_FALSE(handle->completionQueued);
+    EXPECT_TRUE(socket->completions.empty());
+
+    handle->rpc.completePending = true;
+    handle->dispatchCount = 1;
+    socket->dispatchCallbacks(shard, handle);
+    EXPECT_EQ(0, handle->dispatchCount);
+    EXPECT_TRUE(handle->completionQueued);
+    EXPECT_EQ(&handle->rpc, &socket->completions.front().rpc);
+    EXPECT_EQ(1U, socket->completionCount.load());
+
+    socket->dropRooPC(&handle->rpc);
+}
+
+TEST_F(SocketImplTest, queueCompletion)
+{
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+    SpinLock::Lock lock_shard(shard->mutex);
+
+    // Not tracked
+    socket->queueCompletion(handle, lock_shard);
+    EXPECT_FALSE(handle->completionQueued);
+    EXPECT_TRUE(socket->completions.empty());
+    EXPECT_EQ(0U, socket->completionCount.load());
+    socket->dropRooPC(shard, &handle->rpc, lock_shard);
+}
+
+TEST_F(SocketImplTest, queueCompletion_tracked)
+{
+    enableCompletions();
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    SocketImpl::Shard* shard = socket->getShard(rooId);
+    SpinLock::Lock lock_shard(shard->mutex);
+
+    socket->queueCompletion(handle, lock_shard);
+
+    EXPECT_TRUE(handle->completionQueued);
+    EXPECT_EQ(1U, socket->completions.size());
+    EXPECT_EQ(1U, socket->completionCount.load());
+
+    socket->dropRooPC(shard, &handle->rpc, lock_shard);
+}
+
+TEST_F(SocketImplTest, pollCompletions)
+{
+    enableCompletions();
+    SocketImpl::RpcHandle* handles[3];
+    for (int i = 0; i < 3; ++i) {
+        Proto::RooId rooId = socket->allocTaskId();
+        handles[i] = createRpc(rooId);
+        SpinLock::Lock lock_shard(socket->getShard(rooId)->mutex);
+        socket->queueCompletion(handles[i], lock_shard);
+    }
+    RooPC* completed[2] = {nullptr, nullptr};
+
+    EXPECT_EQ(2U, socket->pollCompletions(completed, 2));
+    EXPECT_EQ(&handles[0]->rpc, completed[0]);
+    EXPECT_EQ(&handles[1]->rpc, completed[1]);
+    EXPECT_EQ(1U, socket->completionCount.load());
+
+    // Destroying a queued RooPC removes it from the queue.
+    socket->dropRooPC(&handles[2]->rpc);
+    EXPECT_EQ(0U, socket->completionCount.load());
+    EXPECT_EQ(0U, socket->pollCompletions(completed, 2));
+
+    socket->dropRooPC(&handles[0]->rpc);
+    socket->dropRooPC(&handles[1]->rpc);
 }
 
 ACTION_P(FakeGet, pointer)
@@ -179,22 +585,104 @@ TEST_F(SocketImplTest, processIncomingMessages_Request)
                 getAddress(An<const Homa::Driver::WireFormatAddress*>()));
     EXPECT_CALL(mockIncomingRequest, strip(An<size_t>()));
 
-    EXPECT_EQ(0, socket->pendingTasks.size());
-    EXPECT_EQ(0, socket->taskPool.outstandingObjects);
-    EXPECT_EQ(0, socket->taskTimeouts.list.size());
+    SocketImpl::Shard* shard = socket->getShard(header.requestId);
+    EXPECT_TRUE(socket->pendingTasks.empty());
+    EXPECT_EQ(0, shard->taskPool.outstandingObjects);
+    EXPECT_EQ(0, shard->taskTimeouts.count);
+
+    socket->processIncomingMessages();
+
+    EXPECT_FALSE(socket->pendingTasks.empty());
+    EXPECT_EQ(1, shard->taskPool.outstandingObjects);
+    EXPECT_EQ(1, shard->taskTimeouts.count);
+}
+
+TEST_F(SocketImplTest, processIncomingMessages_Request_handler)
+{
+    Proto::RequestHeader header;
+    EXPECT_CALL(transport, receive())
+        .WillOnce(Return(
+            ByMove(Homa::unique_ptr<Homa::InMessage>(&mockIncomingRequest))))
+        .WillOnce(Return(ByMove(Homa::unique_ptr<Homa::InMessage>())));
+    EXPECT_CALL(mockIncomingRequest, get(0, _, Eq(sizeof(Proto::HeaderCommon))))
+        .WillOnce(FakeGet(&header.common));
+    EXPECT_CALL(mockIncomingRequest,
+                get(0, _, Eq(sizeof(Proto::RequestHeader))))
+        .WillOnce(FakeGet(&header));
+    EXPECT_CALL(mockIncomingRequest, length());
+    // ServerTaskImpl construction expected calls
+    EXPECT_CALL(transport, getDriver());
+    EXPECT_CALL(driver,
+                getAddress(An<const Homa::Driver::WireFormatAddress*>()));
+    EXPECT_CALL(mockIncomingRequest, strip(An<size_t>()));
+
+    SocketImpl::Shard* shard = socket->getShard(header.requestId);
+    EXPECT_TRUE(socket->pendingTasks.empty());
+    EXPECT_EQ(0, shard->taskPool.outstandingObjects);
+    EXPECT_EQ(0, shard->taskTimeouts.count);
+
+    ServerTask* handled = nullptr;
+    socket->registerHandler([&](Roo::unique_ptr<ServerTask> task) {
+        handled = task.release();
+    });
+
+    socket->processIncomingMessages();
+
+    EXPECT_TRUE(socket->pendingTasks.empty());
+    EXPECT_EQ(&shard->tasks.find(header.requestId)->task, handled);
+    EXPECT_EQ(1, shard->taskPool.outstandingObjects);
+    EXPECT_EQ(1, shard->taskTimeouts.count);
+}
+
+TEST_F(SocketImplTest, processIncomingMessages_Request_workers)
+{
+    Proto::RequestHeader header;
+    EXPECT_CALL(transport, receive())
+        .WillOnce(Return(
+            ByMove(Homa::unique_ptr<Homa::InMessage>(&mockIncomingRequest))))
+        .WillOnce(Return(ByMove(Homa::unique_ptr<Homa::InMessage>())));
+    EXPECT_CALL(mockIncomingRequest, get(0, _, Eq(sizeof(Proto::HeaderCommon))))
+        .WillOnce(FakeGet(&header.common));
+    EXPECT_CALL(mockIncomingRequest,
+                get(0, _, Eq(sizeof(Proto::RequestHeader))))
+        .WillOnce(FakeGet(&header));
+    EXPECT_CALL(mockIncomingRequest, length());
+    // ServerTaskImpl construction expected calls
+    EXPECT_CALL(transport, getDriver());
+    EXPECT_CALL(driver,
+                getAddress(An<const Homa::Driver::WireFormatAddress*>()));
+    EXPECT_CALL(mockIncomingRequest, strip(An<size_t>()));
+
+    SocketImpl::Shard* shard = socket->getShard(header.requestId);
+
+    // The worker pool takes precedence over the registered handler.
+    bool handlerCalled = false;
+    socket->registerHandler(
+        [&](Roo::unique_ptr<ServerTask>) { handlerCalled = true; });
+    std::atomic<ServerTask*> handled(nullptr);
+    socket->startWorkers(
+        1,
+        [&](Roo::unique_ptr<ServerTask> task) {
+            handled = task.release();
+        },
+        -1);
+    ASSERT_TRUE(socket->workers);
+    EXPECT_EQ(1U, socket->workers->size());
 
     socket->processIncomingMessages();
 
-    EXPECT_EQ(1, socket->pendingTasks.size());
-    EXPECT_EQ(1, socket->taskPool.outstandingObjects);
-    EXPECT_EQ(1, socket->taskTimeouts.list.size());
+    while (handled.load() == nullptr) {
+    }
+    EXPECT_FALSE(handlerCalled);
+    EXPECT_TRUE(socket->pendingTasks.empty());
+    EXPECT_EQ(&shard->tasks.find(header.requestId)->task, handled.load());
+    socket->workers.reset();
 }
 
 TEST_F(SocketImplTest, processIncomingMessages_Response)
 {
     Proto::RooId rooId = socket->allocTaskId();
-    SocketImpl::RpcHandle* handle = socket->rpcPool.construct(socket, rooId);
-    socket->rpcs.insert({rooId, handle});
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
     RooPCImpl* rpc = &handle->rpc;
 
     Mock::Homa::MockInMessage inMessage;
@@ -211,11 +699,45 @@ TEST_F(SocketImplTest, processIncomingMessages_Response)
     // RooPCImpl::handleResponse() expected calls
     EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
 
-    EXPECT_EQ(0, rpc->responseQueue.size());
+    EXPECT_EQ(0, rpc->responses.available());
 
     socket->processIncomingMessages();
 
-    EXPECT_EQ(1, rpc->responseQueue.size());
+    EXPECT_EQ(1, rpc->responses.available());
+
+    EXPECT_CALL(inMessage, release());
+    socket->dropRooPC(rpc);
+}
+
+TEST_F(SocketImplTest, processIncomingMessages_Response_callback)
+{
+    Proto::RooId rooId = socket->allocTaskId();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    RooPCImpl* rpc = &handle->rpc;
+    int calls = 0;
+    rpc->onResponse([&](RooPC* arrived) {
+        EXPECT_EQ(rpc, arrived);
+        EXPECT_EQ(1, handle->dispatchCount);
+        calls++;
+    });
+
+    Mock::Homa::MockInMessage inMessage;
+    Proto::ResponseHeader header;
+    header.rooId = rooId;
+    EXPECT_CALL(transport, receive())
+        .WillOnce(Return(ByMove(Homa::unique_ptr<Homa::InMessage>(&inMessage))))
+        .WillOnce(Return(ByMove(Homa::unique_ptr<Homa::InMessage>())));
+    EXPECT_CALL(inMessage, get(0, _, Eq(sizeof(Proto::HeaderCommon))))
+        .WillOnce(FakeGet(&header.common));
+    EXPECT_CALL(inMessage, get(0, _, Eq(sizeof(Proto::ResponseHeader))))
+        .WillOnce(FakeGet(&header));
+    EXPECT_CALL(inMessage, length());
+    EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
+
+    socket->processIncomingMessages();
+
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ(0, handle->dispatchCount);
 
     EXPECT_CALL(inMessage, release());
     socket->dropRooPC(rpc);
@@ -224,8 +746,7 @@ TEST_F(SocketImplTest, processIncomingMessages_Response)
 TEST_F(SocketImplTest, processIncomingMessages_Manifest)
 {
     Proto::RooId rooId = socket->allocTaskId();
-    SocketImpl::RpcHandle* handle = socket->rpcPool.construct(socket, rooId);
-    socket->rpcs.insert({rooId, handle});
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
     RooPCImpl* rpc = &handle->rpc;
 
     Mock::Homa::MockInMessage inMessage;
@@ -289,8 +810,7 @@ TEST_F(SocketImplTest, processIncomingMessages_Ping)
 TEST_F(SocketImplTest, processIncomingMessages_Pong)
 {
     Proto::RooId rooId = socket->allocTaskId();
-    SocketImpl::RpcHandle* handle = socket->rpcPool.construct(socket, rooId);
-    socket->rpcs.insert({rooId, handle});
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
     RooPCImpl* rpc = &handle->rpc;
 
     Mock::Homa::MockInMessage inMessage;
@@ -323,8 +843,7 @@ TEST_F(SocketImplTest, processIncomingMessages_Pong)
 TEST_F(SocketImplTest, processIncomingMessages_Error)
 {
     Proto::RooId rooId = socket->allocTaskId();
-    SocketImpl::RpcHandle* handle = socket->rpcPool.construct(socket, rooId);
-    socket->rpcs.insert({rooId, handle});
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
     RooPCImpl* rpc = &handle->rpc;
 
     Mock::Homa::MockInMessage inMessage;
@@ -374,43 +893,181 @@ TEST_F(SocketImplTest, processIncomingMessages_invalid)
     Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
 }
 
+TEST_F(SocketImplTest, processInboundMessages)
+{
+    EXPECT_FALSE(socket->processInboundMessages());
+
+    enableResponseAffinity();
+    EXPECT_FALSE(socket->processInboundMessages());
+
+    Proto::RooId rooId = socket->allocTaskId();
+    rooId.sequence |= socket->allocThreadTag();
+    SocketImpl::RpcHandle* handle = createRpc(rooId);
+    RooPCImpl* rpc = &handle->rpc;
+
+    Mock::Homa::MockInMessage inMessage;
+    Proto::ResponseHeader header;
+    header.rooId = rooId;
+    EXPECT_CALL(inMessage, get(0, _, Eq(sizeof(Proto::HeaderCommon))))
+        .WillOnce(FakeGet(&header.common));
+    EXPECT_CALL(inMessage, get(0, _, Eq(sizeof(Proto::ResponseHeader))))
+        .WillOnce(FakeGet(&header));
+    EXPECT_CALL(inMessage, length());
+    EXPECT_CALL(inMessage, strip(Eq(sizeof(Proto::ResponseHeader))));
+    SocketImpl::InboundQueue* queue =
+        socket->inboundQueues[ThreadId::getId()].load();
+    ASSERT_NE(nullptr, queue);
+    queue->push(&inMessage);
+
+    EXPECT_TRUE(socket->processInboundMessages());
+
+    EXPECT_TRUE(queue->empty());
+    EXPECT_EQ(1, rpc->responses.available());
+
+    EXPECT_CALL(inMessage, release());
+    socket->dropRooPC(rpc);
+}
+
+TEST_F(SocketImplTest, steerToOwner)
+{
+    Mock::Homa::MockInMessage inMessage;
+    Homa::unique_ptr<Homa::InMessage> message(&inMessage);
+
+    // Response affinity disabled
+    EXPECT_FALSE(socket->steerToOwner(Proto::Opcode::Response, &message));
+
+    enableResponseAffinity();
+    std::size_t self = ThreadId::getId();
+    std::size_t other = (self + 1) % SocketImpl::MAX_THREAD_SLOTS;
+    if (other == 0) {
+        other = 1;
+    }
+    Proto::ResponseHeader header;
+    header.rooId = Proto::RooId(
+        socket->socketId, (other << SocketImpl::THREAD_SLOT_SHIFT) | 1);
+    EXPECT_CALL(inMessage, get(Eq(sizeof(Proto::HeaderCommon)), _,
+                               Eq(sizeof(Proto::RooId))))
+        .WillRepeatedly(FakeGet(&header.rooId));
+
+    // Not a RooPC message
+    EXPECT_FALSE(socket->steerToOwner(Proto::Opcode::Request, &message));
+
+    // Owner has no queue
+    EXPECT_FALSE(socket->steerToOwner(Proto::Opcode::Response, &message));
+
+    // Handed over
+    SocketImpl::InboundQueue* queue = new SocketImpl::InboundQueue(2);
+    queue->push(nullptr);
+    socket->inboundQueues[other].store(queue);
+    EXPECT_TRUE(socket->steerToOwner(Proto::Opcode::Manifest, &message));
+    EXPECT_FALSE(message);
+    EXPECT_FALSE(queue->empty());
+
+    // Owner's queue is full
+    message.reset(&inMessage);
+    EXPECT_FALSE(socket->steerToOwner(Proto::Opcode::Response, &message));
+    EXPECT_TRUE(message);
+
+    // Caller is the owner
+    header.rooId.sequence =
+        (static_cast<uint64_t>(self) << SocketImpl::THREAD_SLOT_SHIFT) | 1;
+    EXPECT_FALSE(socket->steerToOwner(Proto::Opcode::Response, &message));
+
+    // Untagged RooPC
+    header.rooId.sequence = 1;
+    EXPECT_FALSE(socket->steerToOwner(Proto::Opcode::Response, &message));
+
+    message.release();
+    Homa::InMessage* queued;
+    queue->pop(&queued);
+    queue->pop(&queued);
+    EXPECT_EQ(&inMessage, queued);
+}
+
+TEST_F(SocketImplTest, queuePendingTask)
+{
+    ServerTaskImpl* task[SocketImpl::PENDING_TASKS_CAPACITY + 2];
+    for (std::size_t i = 0; i < SocketImpl::PENDING_TASKS_CAPACITY + 2; ++i) {
+        task[i] = reinterpret_cast<ServerTaskImpl*>(i + 1);
+    }
+
+    // Fits in pendingTasks
+    for (std::size_t i = 0; i < SocketImpl::PENDING_TASKS_CAPACITY; ++i) {
+        socket->queuePendingTask(task[i]);
+    }
+    EXPECT_EQ(0U, socket->overflowCount.load());
+
+    // Overflows
+    socket->queuePendingTask(task[SocketImpl::PENDING_TASKS_CAPACITY]);
+    EXPECT_EQ(1U, socket->overflowCount.load());
+
+    // Stays behind earlier overflow even if space is available.
+    ServerTaskImpl* pending = nullptr;
+    EXPECT_TRUE(socket->pendingTasks.pop(&pending));
+    EXPECT_EQ(task[0], pending);
+    socket->queuePendingTask(task[SocketImpl::PENDING_TASKS_CAPACITY + 1]);
+    EXPECT_EQ(1U, socket->overflowCount.load());
+    EXPECT_EQ(task[SocketImpl::PENDING_TASKS_CAPACITY + 1],
+              socket->overflowTasks.front());
+
+    // Drain everything in order.
+    EXPECT_TRUE(socket->pendingTasks.pop(&pending));
+    socket->flushOverflowTasks();
+    EXPECT_EQ(0U, socket->overflowCount.load());
+    for (std::size_t i = 2; i < SocketImpl::PENDING_TASKS_CAPACITY + 2; ++i) {
+        EXPECT_TRUE(socket->pendingTasks.pop(&pending));
+        EXPECT_EQ(task[i], pending);
+    }
+    EXPECT_FALSE(socket->pendingTasks.pop(&pending));
+}
+
 TEST_F(SocketImplTest, checkClientTimeouts)
 {
     Proto::RooId rooId[3];
     SocketImpl::RpcHandle* handle[3];
     for (int i = 0; i < 3; ++i) {
-        rooId[i] = socket->allocTaskId();
-        handle[i] = socket->rpcPool.construct(socket, rooId[i]);
-        socket->rpcs.insert({rooId[i], handle[i]});
+        // Skip ids so that all RooPCs land in the same shard.
+        rooId[i] = Proto::RooId(socket->socketId,
+                                (i + 1) * SocketImpl::NUM_SHARDS);
+        handle[i] = createRpc(rooId[i]);
     }
+    SocketImpl::Shard* shard = socket->getShard(rooId[0]);
 
-    uint64_t now = 100 * socket->rpcTimeouts.timeoutIntervalCycles;
+    uint64_t interval = socket->initialWorryTimeoutCycles;
+    uint64_t now = 100 * interval;
     uint64_t past = now / 2;
     uint64_t future = now * 2;
 
     // [0] Expired, Reschedule.
     handle[0]->rpc.manifestsOutstanding = 1;
     PerfUtils::Cycles::mockTscValue = past;
-    socket->rpcTimeouts.setTimeout(&handle[0]->timeout);
+    shard->rpcTimeouts.setTimeout(&handle[0]->timeout, interval);
 
     // [1] Expired, No reschedule.
-    handle[1]->rpc.branches.insert({{}, {false, {}, {}, 9001}});
+    RooPCImpl::BranchInfo* branch =
+        handle[1]->rpc.branches.insert({}, {false, {}, {}, 9001}).first;
+    handle[1]->rpc.incompleteBranches.push_back(&branch->incompleteNode);
     handle[1]->rpc.manifestsOutstanding = 1;
     PerfUtils::Cycles::mockTscValue = past;
-    socket->rpcTimeouts.setTimeout(&handle[1]->timeout);
+    shard->rpcTimeouts.setTimeout(&handle[1]->timeout, interval);
 
     // [2] Not expired.
     PerfUtils::Cycles::mockTscValue = future;
-    socket->rpcTimeouts.setTimeout(&handle[2]->timeout);
+    shard->rpcTimeouts.setTimeout(&handle[2]->timeout, interval);
 
-    EXPECT_EQ(3, socket->rpcTimeouts.list.size());
+    EXPECT_EQ(3, shard->rpcTimeouts.count);
 
     PerfUtils::Cycles::mockTscValue = now;
     socket->checkClientTimeouts();
 
-    EXPECT_EQ(2, socket->rpcTimeouts.list.size());
-    EXPECT_EQ(handle[2], socket->rpcTimeouts.list.front().object);
-    EXPECT_EQ(handle[0], socket->rpcTimeouts.list.back().object);
+    EXPECT_EQ(2, shard->rpcTimeouts.count);
+    // Rescheduled with up to worryJitterPercent of jitter.
+    EXPECT_LE(now + interval, handle[0]->timeout.expirationCycleTime);
+    EXPECT_GE(now + interval + interval * socket->worryJitterPercent / 100,
+              handle[0]->timeout.expirationCycleTime);
+    EXPECT_EQ(Timeout<SocketImpl::RpcHandle*>::UNSCHEDULED,
+              handle[1]->timeout.slot);
+    EXPECT_EQ(future + interval, handle[2]->timeout.expirationCycleTime);
 }
 
 TEST_F(SocketImplTest, checkTaskTimeouts)
@@ -419,46 +1076,118 @@ TEST_F(SocketImplTest, checkTaskTimeouts)
     Proto::RequestId requestId[3];
     SocketImpl::ServerTaskHandle* handle[3];
 
+    // Pick request ids that all map to the same shard.
+    SocketImpl::Shard* shard = socket->getShard(Proto::RequestId());
+    uint32_t sequence = 0;
     for (uint i = 0; i < 3; ++i) {
-        requestId[i] = {{{2, 2}, i}, 0};
+        do {
+            requestId[i] = {{{2, 2}, sequence++}, 0};
+        } while (socket->getShard(requestId[i]) != shard);
         handle[i] = createTask(requestId[i].branchId.taskId, requestId[i], {});
         handle[i]->task.detached = true;
     }
 
-    uint64_t now = 100 * socket->taskTimeouts.timeoutIntervalCycles;
+    uint64_t interval = socket->taskTimeoutCycles;
+    uint64_t now = 100 * interval;
     uint64_t past = now / 2;
     uint64_t future = now * 2;
 
     // [0] Expired, reschedule.
     handle[0]->task.pingInfo.pingCount = 9001;
     PerfUtils::Cycles::mockTscValue = past;
-    socket->taskTimeouts.setTimeout(&handle[0]->timeout);
+    shard->taskTimeouts.setTimeout(&handle[0]->timeout, interval);
 
     // [1] Expired, done.
     PerfUtils::Cycles::mockTscValue = past;
-    socket->taskTimeouts.setTimeout(&handle[1]->timeout);
+    shard->taskTimeouts.setTimeout(&handle[1]->timeout, interval);
 
     // [2] Not expired.
     PerfUtils::Cycles::mockTscValue = future;
-    socket->taskTimeouts.setTimeout(&handle[2]->timeout);
+    shard->taskTimeouts.setTimeout(&handle[2]->timeout, interval);
 
-    EXPECT_EQ(3, socket->taskTimeouts.list.size());
-    EXPECT_EQ(3, socket->tasks.size());
+    EXPECT_EQ(3, shard->taskTimeouts.count);
+    EXPECT_EQ(3, shard->tasks.size());
 
     PerfUtils::Cycles::mockTscValue = now;
 
     EXPECT_CALL(mockIncomingRequest, release()).Times(1);
     socket->checkTaskTimeouts();
 
-    EXPECT_EQ(2, socket->taskTimeouts.list.size());
-    EXPECT_EQ(handle[2], socket->taskTimeouts.list.front().object);
-    EXPECT_EQ(handle[0], socket->taskTimeouts.list.back().object);
-    EXPECT_EQ(2, socket->tasks.size());
-    EXPECT_EQ(0, socket->tasks.count(requestId[1]));
+    EXPECT_EQ(2, shard->taskTimeouts.count);
+    EXPECT_EQ(now + interval, handle[0]->timeout.expirationCycleTime);
+    EXPECT_EQ(future + interval, handle[2]->timeout.expirationCycleTime);
+    EXPECT_EQ(2, shard->tasks.size());
+    EXPECT_EQ(nullptr, shard->tasks.find(requestId[1]));
 
     ::testing::Mock::VerifyAndClearExpectations(&mockIncomingRequest);
 }
 
+TEST_F(SocketImplTest, recordRtt)
+{
+    SocketImpl::RttShard* rttShard = socket->getRttShard(0xFEED);
+    uint64_t slowRtt = socket->maxWorryTimeoutCycles / 4;
+    socket->recordRtt(0xFEED, slowRtt);
+    socket->recordRtt(0xFEED, slowRtt);
+
+    EXPECT_EQ(2U, rttShard->peers[0xFEED].samples());
+    EXPECT_EQ(slowRtt, rttShard->peers[0xFEED].smoothedRtt);
+    EXPECT_EQ(2U, rttShard->combined.samples());
+    uint64_t slowTimeout = rttShard->combined.timeout(
+        socket->initialWorryTimeoutCycles, socket->minWorryTimeoutCycles,
+        socket->maxWorryTimeoutCycles);
+    EXPECT_EQ(slowTimeout, rttShard->timeout.load());
+    EXPECT_EQ(slowTimeout, socket->socketWorryTimeout.load());
+
+    // A faster peer in another RttShard doesn't shorten the socket-wide
+    // timeout just by being sampled last.
+    Homa::Driver::Address fastPeer = 0xBEEF;
+    while (socket->getRttShard(fastPeer) == rttShard) {
+        fastPeer++;
+    }
+    socket->recordRtt(fastPeer, 1);
+    EXPECT_EQ(1U, socket->getRttShard(fastPeer)->peers[fastPeer].samples());
+    EXPECT_EQ(0U, rttShard->peers.count(fastPeer));
+    EXPECT_GT(slowTimeout, socket->getRttShard(fastPeer)->timeout.load());
+    EXPECT_EQ(slowTimeout, socket->socketWorryTimeout.load());
+}
+
+TEST_F(SocketImplTest, worryTimeout)
+{
+    uint64_t min = socket->minWorryTimeoutCycles;
+    uint64_t max = socket->maxWorryTimeoutCycles;
+
+    // No samples
+    EXPECT_EQ(socket->initialWorryTimeoutCycles, socket->worryTimeout());
+    EXPECT_EQ(socket->initialWorryTimeoutCycles, socket->worryTimeout(0xFEED));
+
+    // Fast peer; bounded below.
+    socket->recordRtt(0xFEED, 1);
+    EXPECT_EQ(min, socket->worryTimeout(0xFEED));
+
+    // Slow peer; bounded above.
+    socket->recordRtt(0xBEEF, max);
+    EXPECT_EQ(max, socket->worryTimeout(0xBEEF));
+
+    // Unknown peers use the socket-wide estimate.
+    EXPECT_EQ(socket->socketWorryTimeout.load(), socket->worryTimeout(0xCAFE));
+    EXPECT_EQ(socket->worryTimeout(0xCAFE), socket->worryTimeout());
+}
+
+TEST_F(SocketImplTest, addJitter)
+{
+    for (int i = 0; i < 100; ++i) {
+        uint64_t cycles = socket->addJitter(1000);
+        EXPECT_LE(1000U, cycles);
+        EXPECT_GE(1000U + 1000 * socket->worryJitterPercent / 100, cycles);
+    }
+
+    SocketOptions options;
+    options.worryJitterPercent = 0;
+    EXPECT_CALL(transport, getId());
+    SocketImpl noJitter(&transport, options);
+    EXPECT_EQ(1000U, noJitter.addJitter(1000));
+}
+
 TEST_F(SocketImplTest, allocTaskId)
 {
     EXPECT_EQ(Proto::TaskId(42, 1), socket->allocTaskId());
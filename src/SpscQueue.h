@@ -0,0 +1,212 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_SPSCQUEUE_H
+#define ROO_SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Roo {
+
+/**
+ * An unbounded, lock-free, single-producer/single-consumer FIFO queue that
+ * retains its elements.
+ *
+ * Elements are appended to a chain of segments, the first of which holds N
+ * elements and is stored inline; each later segment is twice the size of the
+ * one before it.  Segments never move so a popped element stays valid, and
+ * owned by the queue, until the queue is destroyed.  The producer publishes
+ * each element by advancing a single atomic count which is the only state
+ * shared with the consumer; neither side ever waits for the other.
+ *
+ * At most one thread may call push() and at most one thread may call pop()
+ * and available() at a time; the two may run concurrently.  size() may be
+ * called by either side.
+ *
+ * @tparam ElementType
+ *      Type of the queued elements.
+ * @tparam N
+ *      Number of elements held by the inline segment.
+ */
+template <typename ElementType, std::size_t N>
+class SpscQueue {
+  public:
+    /**
+     * Construct an empty queue.
+     */
+    SpscQueue()
+        : inlineElements()
+        , head(inlineElements, N)
+        , tail(&head)
+        , tailIndex(0)
+        , count(0)
+        , readSegment(&head)
+        , readIndex(0)
+        , popped(0)
+    {}
+
+    /**
+     * Destruct the queue and all the elements it holds.
+     */
+    ~SpscQueue()
+    {
+        std::size_t remaining = count.load(std::memory_order_acquire);
+        Segment* segment = &head;
+        while (segment != nullptr) {
+            for (std::size_t i = 0; i < segment->capacity && remaining > 0;
+                 ++i) {
+                segment->element(i)->~ElementType();
+                remaining--;
+            }
+            Segment* next = segment->next;
+            if (segment != &head) {
+                delete[] segment->elements;
+                delete segment;
+            }
+            segment = next;
+        }
+    }
+
+    /**
+     * Add an element to the back of the queue; called by the producer.
+     *
+     * @param element
+     *      The element to be added.
+     */
+    void push(ElementType&& element)
+    {
+        if (tailIndex == tail->capacity) {
+            std::size_t capacity = tail->capacity * 2;
+            Segment* segment = new Segment(new Storage[capacity], capacity);
+            tail->next = segment;
+            tail = segment;
+            tailIndex = 0;
+        }
+        new (tail->element(tailIndex)) ElementType(std::move(element));
+        tailIndex++;
+        // Publishes both the element and any new segment.
+        count.store(count.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    /**
+     * Return the element at the front of the queue and advance past it;
+     * called by the consumer.
+     *
+     * @return
+     *      The oldest element not yet popped, which remains owned by the
+     *      queue, or nullptr if there is none.
+     */
+    ElementType* pop()
+    {
+        if (popped == count.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        if (readIndex == readSegment->capacity) {
+            readSegment = readSegment->next;
+            readIndex = 0;
+        }
+        ElementType* element = readSegment->element(readIndex);
+        readIndex++;
+        popped++;
+        return element;
+    }
+
+    /**
+     * Return the number of elements that have been pushed but not yet
+     * popped; called by the consumer.
+     */
+    std::size_t available() const
+    {
+        return count.load(std::memory_order_acquire) - popped;
+    }
+
+    /**
+     * Return the number of elements ever pushed to the queue.
+     */
+    std::size_t size() const
+    {
+        return count.load(std::memory_order_acquire);
+    }
+
+  private:
+    /// Uninitialized memory for a single element.
+    using Storage = typename std::aligned_storage<sizeof(ElementType),
+                                                  alignof(ElementType)>::type;
+
+    /**
+     * A block of element storage.
+     */
+    struct Segment {
+        Segment(Storage* elements, std::size_t capacity)
+            : next(nullptr)
+            , capacity(capacity)
+            , elements(elements)
+        {}
+
+        /// Return the memory that holds (or will hold) the i-th element.
+        ElementType* element(std::size_t i)
+        {
+            return reinterpret_cast<ElementType*>(&elements[i]);
+        }
+
+        /// Next segment in the chain; written by the producer before the
+        /// first element in that segment is published.
+        Segment* next;
+
+        /// Number of elements this segment can hold.
+        std::size_t const capacity;
+
+        /// Memory for the elements of this segment; owned by the segment
+        /// unless the segment is the inline head.
+        Storage* const elements;
+    };
+
+    /// Memory for the elements of the first segment.
+    Storage inlineElements[N];
+
+    /// First segment of the chain.
+    Segment head;
+
+    /// Segment to which the producer is appending.
+    Segment* tail;
+
+    /// Index within tail at which the next element will be pushed.
+    std::size_t tailIndex;
+
+    /// Number of elements pushed; the only state shared by both sides.
+    std::atomic<std::size_t> count;
+
+    /// Segment from which the consumer will pop the next element.
+    Segment* readSegment;
+
+    /// Index within readSegment of the next element to pop.
+    std::size_t readIndex;
+
+    /// Number of elements popped.
+    std::size_t popped;
+
+    // Disable copy and assign
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_SPSCQUEUE_H
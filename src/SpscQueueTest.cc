@@ -0,0 +1,116 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <thread>
+
+#include "SpscQueue.h"
+
+namespace Roo {
+namespace {
+
+TEST(SpscQueueTest, constructor)
+{
+    SpscQueue<int, 2> queue;
+    EXPECT_EQ(0U, queue.size());
+    EXPECT_EQ(0U, queue.available());
+    EXPECT_EQ(&queue.head, queue.tail);
+    EXPECT_EQ(&queue.head, queue.readSegment);
+}
+
+TEST(SpscQueueTest, destructor)
+{
+    std::shared_ptr<int> element = std::make_shared<int>(1);
+    {
+        SpscQueue<std::shared_ptr<int>, 2> queue;
+        for (int i = 0; i < 5; ++i) {
+            queue.push(std::shared_ptr<int>(element));
+        }
+        queue.pop();
+        EXPECT_EQ(6, element.use_count());
+    }
+    EXPECT_EQ(1, element.use_count());
+}
+
+TEST(SpscQueueTest, push)
+{
+    SpscQueue<int, 2> queue;
+
+    queue.push(1);
+    queue.push(2);
+    EXPECT_EQ(&queue.head, queue.tail);
+    EXPECT_EQ(2U, queue.tailIndex);
+    EXPECT_EQ(nullptr, queue.head.next);
+
+    // Segment full
+    queue.push(3);
+    EXPECT_NE(&queue.head, queue.tail);
+    EXPECT_EQ(queue.tail, queue.head.next);
+    EXPECT_EQ(4U, queue.tail->capacity);
+    EXPECT_EQ(1U, queue.tailIndex);
+    EXPECT_EQ(3U, queue.size());
+    EXPECT_EQ(3U, queue.available());
+}
+
+TEST(SpscQueueTest, pop)
+{
+    SpscQueue<int, 2> queue;
+
+    // Empty
+    EXPECT_EQ(nullptr, queue.pop());
+
+    queue.push(1);
+    queue.push(2);
+    queue.push(3);
+
+    int* first = queue.pop();
+    ASSERT_NE(nullptr, first);
+    EXPECT_EQ(1, *first);
+    EXPECT_EQ(2, *queue.pop());
+    EXPECT_EQ(3, *queue.pop());
+    EXPECT_EQ(nullptr, queue.pop());
+    EXPECT_EQ(0U, queue.available());
+    EXPECT_EQ(3U, queue.size());
+
+    // Popped elements stay in place.
+    queue.push(4);
+    EXPECT_EQ(1, *first);
+    EXPECT_EQ(4, *queue.pop());
+}
+
+TEST(SpscQueueTest, concurrent)
+{
+    const int numElements = 100000;
+    SpscQueue<int, 8> queue;
+
+    std::thread producer([&]() {
+        for (int i = 0; i < numElements; ++i) {
+            queue.push(int(i));
+        }
+    });
+    for (int i = 0; i < numElements; ++i) {
+        int* element;
+        while ((element = queue.pop()) == nullptr) {
+        }
+        EXPECT_EQ(i, *element);
+    }
+    producer.join();
+    EXPECT_EQ(nullptr, queue.pop());
+}
+
+}  // namespace
+}  // namespace Roo
@@ -15,6 +15,9 @@
 
 #include "ThreadId.h"
 
+#include <pthread.h>
+#include <sched.h>
+
 #include <mutex>
 #include <unordered_map>
 
@@ -114,5 +117,24 @@ getName()
         return it->second;
 }
 
+/**
+ * Restrict the current thread to run only on the given CPU.
+ *
+ * @return
+ *      True if the thread was pinned; false if the CPU is invalid or the
+ *      thread is not allowed to run on it.
+ */
+bool
+setCpuAffinity(int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
 }  // namespace ThreadId
 }  // namespace Roo
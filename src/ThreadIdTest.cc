@@ -14,6 +14,8 @@
  */
 
 #include <gtest/gtest.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <string>
 #include <thread>
@@ -75,5 +77,26 @@ TEST_F(ThreadIdTest, names)
     EXPECT_EQ("thread 1", ThreadId::getName());
 }
 
+TEST_F(ThreadIdTest, setCpuAffinity)
+{
+    EXPECT_FALSE(ThreadId::setCpuAffinity(-1));
+    EXPECT_FALSE(ThreadId::setCpuAffinity(CPU_SETSIZE));
+
+    // Pin a separate thread so the test's own affinity is unchanged.
+    bool pinned = false;
+    int cpu = -1;
+    std::thread thread([&]() {
+        pinned = ThreadId::setCpuAffinity(sched_getcpu());
+        cpu_set_t cpus;
+        pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (CPU_COUNT(&cpus) == 1) {
+            cpu = sched_getcpu();
+        }
+    });
+    thread.join();
+    EXPECT_TRUE(pinned);
+    EXPECT_LE(0, cpu);
+}
+
 }  // namespace
 }  // namespace Roo
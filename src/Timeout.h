@@ -18,7 +18,10 @@
 
 #include <PerfUtils/Cycles.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
 
 #include "Intrusive.h"
 
@@ -48,6 +51,7 @@ class Timeout {
     explicit Timeout(Args&&... args)
         : object(static_cast<Args&&>(args)...)
         , expirationCycleTime(0)
+        , slot(UNSCHEDULED)
         , node(this)
     {}
 
@@ -68,9 +72,19 @@ class Timeout {
     T object;
 
   private:
+    /// Value of slot when the Timeout is not managed by a TimeoutManager.
+    static constexpr uint32_t UNSCHEDULED = UINT32_MAX;
+
+    /// Value of slot when the Timeout has elapsed but not yet been processed.
+    static constexpr uint32_t EXPIRED = UINT32_MAX - 1;
+
     /// Cycle timestamp when timeout should elapse.
     uint64_t expirationCycleTime;
 
+    /// Index of the TimeoutManager wheel slot holding this Timeout, or one of
+    /// UNSCHEDULED or EXPIRED.
+    uint32_t slot;
+
     /// Intrusive member to help track this timeout.
     typename Intrusive::List<Timeout<T>>::Node node;
 
@@ -80,37 +94,57 @@ class Timeout {
 /**
  * Structure to keep track of multiple instances of the same kind of timeout.
  *
+ * Timeouts are kept in a hierarchical timing wheel: LEVELS wheels of SLOTS
+ * slots each, where a slot at level L covers SLOTS^L ticks.  A Timeout is
+ * filed in the lowest level whose range covers its expiration and is moved
+ * down ("cascaded") as time advances, so scheduling and canceling a Timeout
+ * are O(1) regardless of how many Timeouts are managed or how far in the
+ * future they expire.  Each Timeout may have its own expiration; timeouts
+ * elapse on tick boundaries and so may fire up to one tick late.
+ *
  * This structure is not thread-safe.
  */
 template <typename T>
 class TimeoutManager {
   public:
     /**
-     * Construct a new TimeoutManager with a particular timeout interval.  All
-     * timeouts tracked by this manager will have the same timeout interval.
+     * Construct a new TimeoutManager.
      *
+     * @param tickCycles
+     *      Resolution of the timing wheel in cycles.
      */
-    explicit TimeoutManager(uint64_t timeoutIntervalCycles)
-        : timeoutIntervalCycles(timeoutIntervalCycles)
+    explicit TimeoutManager(uint64_t tickCycles = 1)
+        : tickCycles(tickCycles > 0 ? tickCycles : 1)
+        , currentTick(PerfUtils::Cycles::rdtsc() / this->tickCycles)
         , nextTimeout(UINT64_MAX)
-        , list()
+        , count(0)
+        , occupied()
+        , slots()
+        , expired()
     {}
 
     /**
-     * Schedule the Timeout to elapse one timeout interval from this point.  If
-     * the Timeout was previously scheduled, this call will reschedule it.
+     * Schedule the Timeout to elapse delayCycles from this point.  If the
+     * Timeout was previously scheduled, this call will reschedule it.
      *
      * @param timeout
      *      The Timeout that should be scheduled.
+     * @param delayCycles
+     *      Number of cycles after which the Timeout should elapse.
      */
-    inline void setTimeout(Timeout<T>* timeout)
+    inline void setTimeout(Timeout<T>* timeout, uint64_t delayCycles)
     {
-        list.remove(&timeout->node);
-        timeout->expirationCycleTime =
-            PerfUtils::Cycles::rdtsc() + timeoutIntervalCycles;
-        list.push_back(&timeout->node);
-        nextTimeout.store(list.front().expirationCycleTime,
-                          std::memory_order_relaxed);
+        uint64_t now = PerfUtils::Cycles::rdtsc();
+        unlink(timeout);
+        if (empty()) {
+            // Nothing depends on the wheel's position; anchor it at now.
+            currentTick = now / tickCycles;
+        }
+        timeout->expirationCycleTime = now + delayCycles;
+        uint64_t tick = link(timeout);
+        if (tick * tickCycles < nextTimeout.load(std::memory_order_relaxed)) {
+            nextTimeout.store(tick * tickCycles, std::memory_order_relaxed);
+        }
     }
 
     /**
@@ -121,21 +155,32 @@ class TimeoutManager {
      */
     inline void cancelTimeout(Timeout<T>* timeout)
     {
-        list.remove(&timeout->node);
-        if (list.empty()) {
+        unlink(timeout);
+        if (empty()) {
             nextTimeout.store(UINT64_MAX, std::memory_order_relaxed);
-        } else {
-            nextTimeout.store(list.front().expirationCycleTime,
-                              std::memory_order_relaxed);
         }
     }
 
+    /**
+     * Return the cycle time at or after which the next Timeout may elapse, or
+     * UINT64_MAX if no Timeouts are scheduled.
+     *
+     * This method is thread-safe and conservative in the same way as
+     * anyElapsed(); the returned time may be earlier than the next Timeout.
+     */
+    inline uint64_t nextDeadline() const
+    {
+        return nextTimeout.load(std::memory_order_relaxed);
+    }
+
     /**
      * Check if any managed Timeouts have elapsed.
      *
      * This method is thread-safe but may race with the other non-thread-safe
      * methods of the TimeoutManager (e.g. concurrent calls to setTimeout() or
      * cancelTimeout() may not be reflected in the result of this method call).
+     * The check is conservative; it may return true even though
+     * processExpired() ends up finding nothing to do.
      *
      * @param now
      *      Optionally provided "current" timestamp cycle time. Used to avoid
@@ -147,6 +192,40 @@ class TimeoutManager {
         return now >= nextTimeout.load(std::memory_order_relaxed);
     }
 
+    /**
+     * Advance the wheel to the given time and call func(timeout) for each
+     * Timeout that has elapsed.  Each Timeout is unscheduled before it is
+     * passed to func, which may reschedule it with setTimeout(), cancel other
+     * Timeouts, or destroy it.
+     *
+     * @param now
+     *      Current timestamp cycle time.
+     * @param func
+     *      Function object called with a Timeout<T>* for each elapsed Timeout.
+     * @return
+     *      The number of Timeouts that elapsed.
+     */
+    template <typename Function>
+    std::size_t processExpired(uint64_t now, Function func)
+    {
+        advance(now / tickCycles);
+        std::size_t numExpired = 0;
+        while (!expired.empty()) {
+            Timeout<T>* timeout = &expired.front();
+            expired.pop_front();
+            timeout->slot = Timeout<T>::UNSCHEDULED;
+            --count;
+            func(timeout);
+            ++numExpired;
+        }
+        nextTimeout.store(nextEventTick() * tickCycles,
+                          std::memory_order_relaxed);
+        if (empty()) {
+            nextTimeout.store(UINT64_MAX, std::memory_order_relaxed);
+        }
+        return numExpired;
+    }
+
     /**
      * Check if the TimeoutManager manages no Timeouts.
      *
@@ -155,40 +234,201 @@ class TimeoutManager {
      */
     inline bool empty() const
     {
-        return list.empty();
+        return count == 0;
     }
 
+  private:
+    /// log2 of the number of slots in each level of the wheel.
+    static constexpr unsigned SLOT_BITS = 6;
+
+    /// Number of slots in each level of the wheel.
+    static constexpr unsigned SLOTS = 1U << SLOT_BITS;
+
+    /// Number of levels in the wheel.
+    static constexpr unsigned LEVELS = 4;
+
+    /// Largest number of ticks into the future a Timeout can be filed; later
+    /// Timeouts are parked at this horizon and refiled when they get there.
+    /// Stopping one top-level slot short of a full rotation guarantees that a
+    /// parked Timeout is never refiled into the slot being cascaded.
+    static constexpr uint64_t MAX_DELTA =
+        (uint64_t(SLOTS - 1)) << (SLOT_BITS * (LEVELS - 1));
+
     /**
-     * Return a pointer the managed timeout element that expires first.
-     *
-     * Calling front() an empty TimeoutManager is undefined.
+     * Return the tick at or after which the given Timeout has elapsed.
      */
-    inline Timeout<T>* front()
+    inline uint64_t expirationTick(const Timeout<T>* timeout) const
     {
-        return &list.front();
+        return (timeout->expirationCycleTime + tickCycles - 1) / tickCycles;
     }
 
     /**
-     * Return a const pointer the managed timeout element that expires first.
+     * File a Timeout into the wheel based on its expiration time.
      *
-     * Calling front() an empty TimeoutManager is undefined.
+     * @return
+     *      The tick at which the Timeout is scheduled to elapse.
      */
-    inline const Timeout<T>* front() const
+    uint64_t link(Timeout<T>* timeout)
     {
-        return &list.front();
+        uint64_t tick = expirationTick(timeout);
+        if (tick <= currentTick) {
+            tick = currentTick + 1;
+        }
+        uint64_t delta = tick - currentTick;
+        if (delta > MAX_DELTA) {
+            delta = MAX_DELTA;
+        }
+        uint64_t target = currentTick + delta;
+        unsigned level = (63 - __builtin_clzll(delta)) / SLOT_BITS;
+        unsigned index = (target >> (SLOT_BITS * level)) & (SLOTS - 1);
+        timeout->slot = level * SLOTS + index;
+        slots[timeout->slot].push_back(&timeout->node);
+        occupied[level] |= uint64_t(1) << index;
+        ++count;
+        return tick;
     }
 
-  private:
-    /// The number of cycles this newly scheduled timeouts would wait before
-    /// they elapse.
-    uint64_t timeoutIntervalCycles;
+    /**
+     * Remove a Timeout from the wheel (or the expired list) if it is
+     * scheduled.
+     */
+    void unlink(Timeout<T>* timeout)
+    {
+        if (timeout->slot == Timeout<T>::UNSCHEDULED) {
+            return;
+        }
+        if (timeout->slot == Timeout<T>::EXPIRED) {
+            expired.remove(&timeout->node);
+        } else {
+            Intrusive::List<Timeout<T>>& list = slots[timeout->slot];
+            list.remove(&timeout->node);
+            if (list.empty()) {
+                occupied[timeout->slot / SLOTS] &=
+                    ~(uint64_t(1) << (timeout->slot % SLOTS));
+            }
+        }
+        timeout->slot = Timeout<T>::UNSCHEDULED;
+        --count;
+    }
 
-    /// The smallest timeout expiration time of all timeouts under
-    /// management. Accessing this value is thread-safe.
+    /**
+     * Move every Timeout out of the given slot, refiling the ones that have
+     * not yet elapsed and appending the rest to the expired list.
+     */
+    void drain(unsigned level, unsigned index)
+    {
+        Intrusive::List<Timeout<T>>& list = slots[level * SLOTS + index];
+        occupied[level] &= ~(uint64_t(1) << index);
+        while (!list.empty()) {
+            Timeout<T>* timeout = &list.front();
+            list.pop_front();
+            --count;
+            if (expirationTick(timeout) <= currentTick) {
+                timeout->slot = Timeout<T>::EXPIRED;
+                expired.push_back(&timeout->node);
+                ++count;
+            } else {
+                link(timeout);
+            }
+        }
+    }
+
+    /**
+     * Advance currentTick to nowTick, cascading higher levels as their slots
+     * come due and collecting elapsed Timeouts into the expired list.  Empty
+     * stretches of the wheel are skipped using the occupancy bitmaps.
+     */
+    void advance(uint64_t nowTick)
+    {
+        while (currentTick < nowTick) {
+            if (count == expired.size()) {
+                // Nothing left in the wheel; jump straight to now.
+                currentTick = nowTick;
+                break;
+            }
+            // Find the next occupied level 0 slot or the next rotation of
+            // level 0, whichever comes first.
+            unsigned index = currentTick & (SLOTS - 1);
+            uint64_t later = (index == SLOTS - 1)
+                                 ? 0
+                                 : occupied[0] & (~uint64_t(0) << (index + 1));
+            uint64_t next = later != 0
+                                ? (currentTick & ~uint64_t(SLOTS - 1)) +
+                                      __builtin_ctzll(later)
+                                : (currentTick | (SLOTS - 1)) + 1;
+            if (next > nowTick) {
+                currentTick = nowTick;
+                break;
+            }
+            currentTick = next;
+            // Cascade from the highest level that rolled over down to level 1
+            // so that Timeouts can fall through several levels at once.
+            unsigned level = 0;
+            while (level + 1 < LEVELS &&
+                   ((currentTick >> (SLOT_BITS * (level + 1))) <<
+                    (SLOT_BITS * (level + 1))) == currentTick) {
+                ++level;
+            }
+            for (; level > 0; --level) {
+                unsigned shift = SLOT_BITS * level;
+                drain(level, (currentTick >> shift) & (SLOTS - 1));
+            }
+            drain(0, currentTick & (SLOTS - 1));
+        }
+    }
+
+    /**
+     * Return the earliest tick after currentTick at which the wheel might
+     * have work to do (either a level 0 slot elapsing or a higher level slot
+     * cascading); UINT64_MAX / tickCycles if the wheel is empty.
+     */
+    uint64_t nextEventTick() const
+    {
+        uint64_t nextTick = UINT64_MAX / tickCycles;
+        for (unsigned level = 0; level < LEVELS; ++level) {
+            if (occupied[level] == 0) {
+                continue;
+            }
+            unsigned shift = SLOT_BITS * level;
+            unsigned index = (currentTick >> shift) & (SLOTS - 1);
+            // Rotate so that bit k represents the slot k + 1 slots away.
+            unsigned rotate = (index + 1) % SLOTS;
+            uint64_t bits = occupied[level];
+            if (rotate != 0) {
+                bits = (bits >> rotate) | (bits << (SLOTS - rotate));
+            }
+            uint64_t distance = __builtin_ctzll(bits) + 1;
+            uint64_t tick = ((currentTick >> shift) + distance) << shift;
+            nextTick = std::min(nextTick, tick);
+        }
+        return nextTick;
+    }
+
+    /// Number of cycles covered by a single level 0 slot.
+    uint64_t const tickCycles;
+
+    /// The tick up to which the wheel has been advanced.
+    uint64_t currentTick;
+
+    /// Conservative lower bound on the cycle time at which processExpired()
+    /// will next find work. Accessing this value is thread-safe.
     std::atomic<uint64_t> nextTimeout;
 
-    /// Used to keep track of all timeouts under management.
-    Intrusive::List<Timeout<T>> list;
+    /// Number of Timeouts scheduled in the wheel or waiting in expired.
+    std::size_t count;
+
+    /// Per level bitmap of the slots that hold at least one Timeout.
+    uint64_t occupied[LEVELS];
+
+    /// The wheel; slot i of level L is slots[L * SLOTS + i].
+    Intrusive::List<Timeout<T>> slots[LEVELS * SLOTS];
+
+    /// Timeouts that have elapsed but have not yet been processed.
+    Intrusive::List<Timeout<T>> expired;
+
+    // Disable copy and assign
+    TimeoutManager(const TimeoutManager&) = delete;
+    TimeoutManager& operator=(const TimeoutManager&) = delete;
 };
 
 }  // namespace Roo
@@ -16,11 +16,19 @@
 #include <PerfUtils/Cycles.h>
 #include <gtest/gtest.h>
 
+#include <memory>
+#include <random>
+#include <vector>
+
 #include "Timeout.h"
 
 namespace Roo {
 namespace {
 
+/// Mocked start time aligned to every level of the timing wheel (a mocked
+/// time of 0 would read the real TSC).
+const uint64_t START = uint64_t(1) << 32;
+
 TEST(TimeoutTest, hasElapsed)
 {
     PerfUtils::Cycles::mockTscValue = 999;
@@ -40,80 +48,202 @@ TEST(TimeoutTest, hasElapsed)
 TEST(TimeoutManagerTest, setTimeout)
 {
     PerfUtils::Cycles::mockTscValue = 10000;
-    TimeoutManager<int> manager(100);
-    Timeout<int> dummy(-1);
-    dummy.expirationCycleTime = 42;
-    manager.list.push_back(&dummy.node);
-    manager.nextTimeout = 0;
-
+    TimeoutManager<int> manager(10);
     Timeout<int> t(9001);
 
     EXPECT_EQ(0U, t.expirationCycleTime);
-    EXPECT_EQ(nullptr, t.node.list);
-    EXPECT_EQ(-1, manager.list.back().object);
+    EXPECT_EQ(Timeout<int>::UNSCHEDULED, t.slot);
+    EXPECT_EQ(1000U, manager.currentTick);
 
-    manager.setTimeout(&t);
+    manager.setTimeout(&t, 100);
 
     EXPECT_EQ(10100U, t.expirationCycleTime);
-    EXPECT_EQ(42U, manager.nextTimeout.load());
-    EXPECT_EQ(&manager.list, t.node.list);
-    EXPECT_EQ(9001, manager.list.back().object);
+    EXPECT_EQ(1010U % 64, t.slot);
+    EXPECT_EQ(uint64_t(1) << (1010 % 64), manager.occupied[0]);
+    EXPECT_EQ(10100U, manager.nextTimeout.load());
+    EXPECT_EQ(1U, manager.count);
+
+    manager.cancelTimeout(&t);
+    PerfUtils::Cycles::mockTscValue = 0;
+}
+
+TEST(TimeoutManagerTest, setTimeout_delay)
+{
+    PerfUtils::Cycles::mockTscValue = START;
+    TimeoutManager<int> manager(1);
+    Timeout<int> t1(1);
+    Timeout<int> t2(2);
+    Timeout<int> t3(3);
+
+    manager.setTimeout(&t1, 3000);
+    EXPECT_EQ(START + 3000, t1.expirationCycleTime);
+    EXPECT_EQ(64 + (3000 >> 6), t1.slot);
+    EXPECT_EQ(START + 3000, manager.nextTimeout.load());
+
+    manager.setTimeout(&t2, 100000);
+    EXPECT_EQ(2 * 64 + (100000 >> 12), t2.slot);
+    EXPECT_EQ(START + 3000, manager.nextTimeout.load());
 
-    manager.list.clear();
+    // Delays beyond the wheel's horizon are parked in the top level.
+    manager.setTimeout(&t3, UINT64_MAX / 2);
+    EXPECT_EQ(3 * 64 + 63, t3.slot);
+
+    EXPECT_EQ(3U, manager.count);
+    manager.cancelTimeout(&t1);
+    manager.cancelTimeout(&t2);
+    manager.cancelTimeout(&t3);
     PerfUtils::Cycles::mockTscValue = 0;
 }
 
 TEST(TimeoutManagerTest, setTimeout_reset)
 {
     PerfUtils::Cycles::mockTscValue = 10000;
-    TimeoutManager<int> manager(100);
+    TimeoutManager<int> manager(1);
     Timeout<int> t(42);
-    Timeout<int> dummy(-1);
-    dummy.expirationCycleTime = 9001;
-    manager.list.push_back(&t.node);
-    manager.list.push_back(&dummy.node);
-    t.expirationCycleTime = 50;
-
-    EXPECT_EQ(50U, t.expirationCycleTime);
-    EXPECT_EQ(&manager.list, t.node.list);
-    EXPECT_EQ(42, manager.front()->object);
-    EXPECT_EQ(-1, manager.list.back().object);
 
-    manager.setTimeout(&t);
+    manager.setTimeout(&t, 10);
+    EXPECT_EQ(10010U % 64, t.slot);
+    EXPECT_EQ(1U, manager.count);
 
+    manager.setTimeout(&t, 100);
     EXPECT_EQ(10100U, t.expirationCycleTime);
-    EXPECT_EQ(9001U, manager.nextTimeout.load());
-    EXPECT_EQ(&manager.list, t.node.list);
-    EXPECT_EQ(-1, manager.front()->object);
-    EXPECT_EQ(42, manager.list.back().object);
+    EXPECT_EQ(64 + ((10100 >> 6) % 64), t.slot);
+    EXPECT_EQ(0U, manager.occupied[0]);
+    EXPECT_EQ(1U, manager.count);
 
-    manager.list.clear();
+    manager.cancelTimeout(&t);
     PerfUtils::Cycles::mockTscValue = 0;
 }
 
 TEST(TimeoutManagerTest, cancelTimeout)
 {
-    TimeoutManager<int> manager(100);
+    PerfUtils::Cycles::mockTscValue = START;
+    TimeoutManager<int> manager(1);
     Timeout<int> t1(1);
-    t1.expirationCycleTime = 42;
     Timeout<int> t2(2);
-    t2.expirationCycleTime = 9001;
-    manager.list.push_back(&t1.node);
-    manager.list.push_back(&t2.node);
+    manager.setTimeout(&t1, 42);
+    manager.setTimeout(&t2, 42);
 
-    EXPECT_EQ(2, manager.list.size());
+    EXPECT_EQ(2U, manager.count);
 
     manager.cancelTimeout(&t1);
 
-    EXPECT_EQ(nullptr, t1.node.list);
-    EXPECT_EQ(9001U, manager.nextTimeout.load());
-    EXPECT_EQ(1, manager.list.size());
+    EXPECT_EQ(Timeout<int>::UNSCHEDULED, t1.slot);
+    EXPECT_EQ(uint64_t(1) << 42, manager.occupied[0]);
+    EXPECT_EQ(1U, manager.count);
+
+    manager.cancelTimeout(&t2);
+
+    EXPECT_EQ(Timeout<int>::UNSCHEDULED, t2.slot);
+    EXPECT_EQ(0U, manager.occupied[0]);
+    EXPECT_EQ(UINT64_MAX, manager.nextTimeout.load());
+    EXPECT_TRUE(manager.empty());
 
+    // Canceling an unscheduled Timeout is a no-op.
     manager.cancelTimeout(&t2);
+    EXPECT_TRUE(manager.empty());
+    PerfUtils::Cycles::mockTscValue = 0;
+}
 
-    EXPECT_EQ(nullptr, t2.node.list);
+TEST(TimeoutManagerTest, processExpired)
+{
+    PerfUtils::Cycles::mockTscValue = START;
+    TimeoutManager<int> manager(1);
+    Timeout<int> t[4];
+    for (int i = 0; i < 4; ++i) {
+        t[i].object = i;
+    }
+    manager.setTimeout(&t[0], 10);
+    manager.setTimeout(&t[1], 100);
+    manager.setTimeout(&t[2], 10000);
+    manager.setTimeout(&t[3], 10);
+    std::vector<int> fired;
+    auto record = [&](Timeout<int>* timeout) {
+        fired.push_back(timeout->object);
+    };
+
+    EXPECT_FALSE(manager.anyElapsed(START + 9));
+    EXPECT_EQ(0U, manager.processExpired(START + 9, record));
+    EXPECT_TRUE(manager.anyElapsed(START + 10));
+    EXPECT_EQ(2U, manager.processExpired(START + 10, record));
+    EXPECT_EQ(std::vector<int>({0, 3}), fired);
+    EXPECT_EQ(Timeout<int>::UNSCHEDULED, t[0].slot);
+
+    fired.clear();
+    EXPECT_EQ(0U, manager.processExpired(START + 99, record));
+    EXPECT_EQ(1U, manager.processExpired(START + 5000, record));
+    EXPECT_EQ(std::vector<int>({1}), fired);
+
+    fired.clear();
+    EXPECT_EQ(0U, manager.processExpired(START + 9999, record));
+    EXPECT_EQ(1U, manager.processExpired(START + 10000, record));
+    EXPECT_EQ(std::vector<int>({2}), fired);
+    EXPECT_TRUE(manager.empty());
     EXPECT_EQ(UINT64_MAX, manager.nextTimeout.load());
-    EXPECT_TRUE(manager.list.empty());
+    PerfUtils::Cycles::mockTscValue = 0;
+}
+
+TEST(TimeoutManagerTest, processExpired_reschedule)
+{
+    PerfUtils::Cycles::mockTscValue = START;
+    TimeoutManager<int> manager(1);
+    Timeout<int> t1(1);
+    Timeout<int> t2(2);
+    manager.setTimeout(&t1, 10);
+    manager.setTimeout(&t2, 10);
+
+    // Expiring t1 reschedules it and cancels t2 before t2 is processed.
+    PerfUtils::Cycles::mockTscValue = START + 10;
+    int calls = 0;
+    manager.processExpired(START + 10, [&](Timeout<int>* timeout) {
+        ++calls;
+        manager.setTimeout(timeout, 100);
+        manager.cancelTimeout(timeout == &t1 ? &t2 : &t1);
+    });
+
+    EXPECT_EQ(1, calls);
+    EXPECT_EQ(START + 110, t1.expirationCycleTime);
+    EXPECT_EQ(Timeout<int>::UNSCHEDULED, t2.slot);
+    EXPECT_EQ(1U, manager.count);
+    EXPECT_LE(manager.nextTimeout.load(), START + 110);
+
+    manager.cancelTimeout(&t1);
+    PerfUtils::Cycles::mockTscValue = 0;
+}
+
+TEST(TimeoutManagerTest, processExpired_random)
+{
+    const int numTimeouts = 1000;
+    PerfUtils::Cycles::mockTscValue = 12345;
+    TimeoutManager<int> manager(1);
+    std::unique_ptr<Timeout<int>[]> timeouts(new Timeout<int>[numTimeouts]);
+    std::mt19937_64 random(42);
+    for (int i = 0; i < numTimeouts; ++i) {
+        timeouts[i].object = i;
+        manager.setTimeout(&timeouts[i], random() % (1 << 20));
+    }
+
+    // Every Timeout fires in the first call whose time has reached it.
+    uint64_t now = 12345;
+    int numFired = 0;
+    while (!manager.empty()) {
+        uint64_t last = now;
+        now += random() % 5000;
+        numFired += manager.processExpired(now, [&](Timeout<int>* timeout) {
+            EXPECT_LE(timeout->expirationCycleTime, now);
+            EXPECT_GT(timeout->expirationCycleTime, last);
+        });
+        for (int i = 0; i < numTimeouts; ++i) {
+            Timeout<int>& timeout = timeouts[i];
+            if (timeout.slot != Timeout<int>::UNSCHEDULED) {
+                EXPECT_GT(timeout.expirationCycleTime, now);
+                EXPECT_LE(manager.nextTimeout.load(),
+                          timeout.expirationCycleTime);
+            }
+        }
+    }
+    EXPECT_EQ(numTimeouts, numFired);
+    PerfUtils::Cycles::mockTscValue = 0;
 }
 
 }  // namespace
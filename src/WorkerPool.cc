@@ -0,0 +1,230 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "WorkerPool.h"
+
+#include <PerfUtils/Cycles.h>
+
+#include "Debug.h"
+#include "StringUtil.h"
+#include "ThreadId.h"
+
+namespace Roo {
+
+using PerfUtils::Cycles;
+
+const uint64_t WorkerPool::IDLE_SPIN_US;
+
+/**
+ * Construct a WorkerPool and start its worker threads.
+ *
+ * @param numWorkers
+ *      Number of worker threads; must be at least 1.
+ * @param handler
+ *      Function the workers call to process each task.
+ * @param firstCpu
+ *      If non-negative, worker i is pinned to CPU firstCpu + i.
+ */
+WorkerPool::WorkerPool(std::size_t numWorkers, Socket::RequestHandler handler,
+                       int firstCpu)
+    : numWorkers(numWorkers)
+    , idleSpinCycles(Cycles::fromMicroseconds(IDLE_SPIN_US))
+    , handler(std::move(handler))
+    , workers(new Worker[numWorkers])
+    , nextWorker(0)
+    , stop(false)
+    , sleepers(0)
+    , sleepMutex()
+    , wakeCondition()
+{
+    for (std::size_t i = 0; i < numWorkers; ++i) {
+        int cpu = firstCpu < 0 ? -1 : firstCpu + static_cast<int>(i);
+        workers[i].thread = std::thread(&WorkerPool::run, this, i, cpu);
+    }
+}
+
+/**
+ * Stop the worker threads.  Tasks that have not been run are destroyed
+ * without being passed to the handler.
+ */
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stop.store(true, std::memory_order_release);
+    }
+    wakeCondition.notify_all();
+    for (std::size_t i = 0; i < numWorkers; ++i) {
+        workers[i].thread.join();
+    }
+    for (std::size_t i = 0; i < numWorkers; ++i) {
+        for (ServerTask* task : workers[i].tasks) {
+            Roo::unique_ptr<ServerTask> discard(task);
+        }
+    }
+}
+
+/**
+ * Queue a task to be run by one of the workers.
+ *
+ * @param task
+ *      The task to run; ownership passes to the WorkerPool.
+ */
+void
+WorkerPool::submit(ServerTask* task)
+{
+    std::size_t id =
+        nextWorker.fetch_add(1, std::memory_order_relaxed) % numWorkers;
+    Worker* worker = &workers[id];
+    {
+        SpinLock::Lock lock_worker(worker->mutex);
+        worker->tasks.push_back(task);
+        uint64_t depth = worker->tasks.size();
+        worker->counters.queue_depth.set(depth);
+        if (depth > worker->counters.max_queue_depth.get()) {
+            worker->counters.max_queue_depth.set(depth);
+        }
+    }
+    // Order the push before the check for sleepers; pairs with the fetch_add
+    // in sleep().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        wakeCondition.notify_one();
+    }
+}
+
+/**
+ * Main loop of a worker thread.
+ *
+ * @param id
+ *      Index of the worker in workers.
+ * @param cpu
+ *      CPU to which the thread should be pinned; -1 to leave it unpinned.
+ */
+void
+WorkerPool::run(std::size_t id, int cpu)
+{
+    ThreadId::setName(StringUtil::format("worker %lu", id));
+    if (cpu >= 0 && !ThreadId::setCpuAffinity(cpu)) {
+        WARNING("Unable to pin worker %lu to CPU %d", id, cpu);
+    }
+    Worker* worker = &workers[id];
+    uint64_t idleStart = 0;
+    while (!stop.load(std::memory_order_acquire)) {
+        ServerTask* task = pop(worker);
+        if (task == nullptr) {
+            task = steal(id);
+            if (task == nullptr) {
+                uint64_t now = Cycles::rdtsc();
+                if (idleStart == 0) {
+                    idleStart = now;
+                } else if (now - idleStart >= idleSpinCycles) {
+                    sleep();
+                    idleStart = 0;
+                } else {
+                    std::this_thread::yield();
+                }
+                continue;
+            }
+            worker->counters.steals.add(1);
+        }
+        idleStart = 0;
+        handler(Roo::unique_ptr<ServerTask>(task));
+        worker->counters.tasks.add(1);
+    }
+}
+
+/**
+ * Block the calling worker until submit() signals new work or the pool is
+ * stopping.  Returns immediately if a task is already queued.
+ */
+void
+WorkerPool::sleep()
+{
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    // Advertise the sleep before checking the queues a final time so that a
+    // submit() of a task not seen here signals wakeCondition.
+    sleepers.fetch_add(1);
+    if (!stop.load(std::memory_order_acquire) && !hasWork()) {
+        wakeCondition.wait(lock);
+    }
+    sleepers.fetch_sub(1);
+}
+
+/**
+ * Return true if any worker's queue is (probably) non-empty.
+ */
+bool
+WorkerPool::hasWork() const
+{
+    for (std::size_t i = 0; i < numWorkers; ++i) {
+        if (workers[i].counters.queue_depth.get() != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Remove and return the oldest task queued for the given worker, or nullptr
+ * if its queue is empty.
+ */
+ServerTask*
+WorkerPool::pop(Worker* worker)
+{
+    SpinLock::Lock lock_worker(worker->mutex);
+    if (worker->tasks.empty()) {
+        return nullptr;
+    }
+    ServerTask* task = worker->tasks.front();
+    worker->tasks.pop_front();
+    worker->counters.queue_depth.set(worker->tasks.size());
+    return task;
+}
+
+/**
+ * Take a task queued for another worker.
+ *
+ * The victim is the worker with the deepest queue, found from the queue
+ * depth counters without taking any locks, and the oldest task is taken
+ * since it has been delayed the longest by the slow task ahead of it.
+ *
+ * @param thief
+ *      Index of the worker looking for a task.
+ * @return
+ *      The stolen task, or nullptr if all other queues are (or have just
+ *      become) empty.
+ */
+ServerTask*
+WorkerPool::steal(std::size_t thief)
+{
+    Worker* victim = nullptr;
+    uint64_t victimDepth = 0;
+    for (std::size_t i = 1; i < numWorkers; ++i) {
+        Worker* worker = &workers[(thief + i) % numWorkers];
+        uint64_t depth = worker->counters.queue_depth.get();
+        if (depth > victimDepth) {
+            victim = worker;
+            victimDepth = depth;
+        }
+    }
+    if (victim == nullptr) {
+        return nullptr;
+    }
+    return pop(victim);
+}
+
+}  // namespace Roo
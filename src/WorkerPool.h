@@ -0,0 +1,132 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ROO_WORKERPOOL_H
+#define ROO_WORKERPOOL_H
+
+#include <Roo/Roo.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "CacheAligned.h"
+#include "Perf.h"
+#include "SpinLock.h"
+
+namespace Roo {
+
+/**
+ * Runs incoming ServerTasks on a fixed set of worker threads.
+ *
+ * Each worker has its own queue.  Submitted tasks are spread round-robin
+ * across the queues and a worker whose queue is empty takes tasks from the
+ * busiest other queue, so a slow task only delays the tasks queued behind it
+ * until another worker becomes free.  Workers that find no task for
+ * IDLE_SPIN_US block until submit() signals new work.
+ *
+ * This class is thread-safe.
+ */
+class WorkerPool {
+  public:
+    WorkerPool(std::size_t numWorkers, Socket::RequestHandler handler,
+               int firstCpu);
+    ~WorkerPool();
+    void submit(ServerTask* task);
+
+    /**
+     * Return the number of worker threads.
+     */
+    std::size_t size() const
+    {
+        return numWorkers;
+    }
+
+  private:
+    /**
+     * State of a single worker thread; each on its own cache lines, so the
+     * array of workers is allocated through CacheAligned.
+     */
+    struct alignas(CacheAligned::CACHE_LINE_SIZE) Worker : public CacheAligned {
+        Worker()
+            : mutex()
+            , tasks()
+            , counters()
+            , thread()
+        {}
+
+        /// Protects tasks and the queue depth counters.
+        SpinLock mutex;
+
+        /// Tasks waiting to be run, oldest first.
+        std::deque<ServerTask*> tasks;
+
+        /// Statistics reported through Perf::getWorkerStats().
+        Perf::WorkerCounters counters;
+
+        /// Thread running this worker.
+        std::thread thread;
+    };
+
+    void run(std::size_t id, int cpu);
+    ServerTask* pop(Worker* worker);
+    ServerTask* steal(std::size_t thief);
+    void sleep();
+    bool hasWork() const;
+
+    /// Microseconds an idle worker keeps looking for tasks before blocking.
+    static const uint64_t IDLE_SPIN_US = 50;
+
+    /// Number of entries in workers.
+    std::size_t const numWorkers;
+
+    /// IDLE_SPIN_US in cycles.
+    uint64_t const idleSpinCycles;
+
+    /// Function called by the workers to process each task.
+    Socket::RequestHandler const handler;
+
+    /// The workers.
+    std::unique_ptr<Worker[]> const workers;
+
+    /// Index of the worker whose queue receives the next submitted task.
+    std::atomic<std::size_t> nextWorker;
+
+    /// Set to tell the workers to exit.
+    std::atomic<bool> stop;
+
+    /// Number of workers blocked (or about to block) on wakeCondition;
+    /// submit() only signals when this is non-zero.
+    std::atomic<int> sleepers;
+
+    /// Protects the check for work made by a worker before blocking so that
+    /// a signal from submit() cannot be lost.
+    std::mutex sleepMutex;
+
+    /// Signaled when a task is submitted or the pool is stopping.
+    std::condition_variable wakeCondition;
+
+    // Disable copy and assign
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+};
+
+}  // namespace Roo
+
+#endif  // ROO_WORKERPOOL_H
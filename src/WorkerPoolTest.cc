@@ -0,0 +1,204 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <vector>
+
+#include "WorkerPool.h"
+
+namespace Roo {
+namespace {
+
+/**
+ * ServerTask that only records that it was destroyed.
+ */
+class FakeServerTask : public ServerTask {
+  public:
+    FakeServerTask(int id, std::atomic<int>* destroyed)
+        : id(id)
+        , destroyed(destroyed)
+    {}
+
+    virtual Homa::InMessage* getRequest()
+    {
+        return nullptr;
+    }
+    virtual void reply(const void*, std::size_t) {}
+    virtual ReplyBuffer allocReply()
+    {
+        return ReplyBuffer();
+    }
+    virtual void commitReply() {}
+    virtual void delegate(Homa::Driver::Address, const void*, std::size_t) {}
+    virtual void delegate(Homa::Driver::Address, const struct iovec*,
+                          std::size_t)
+    {}
+    virtual void delegateMany(const Homa::Driver::Address[], std::size_t,
+                              const void*, std::size_t)
+    {}
+    virtual void forward(Homa::Driver::Address, const void*, std::size_t) {}
+
+    const int id;
+
+  protected:
+    virtual void destroy()
+    {
+        destroyed->fetch_add(1);
+    }
+
+    std::atomic<int>* const destroyed;
+};
+
+class WorkerPoolTest : public ::testing::Test {
+  public:
+    WorkerPoolTest()
+        : destroyed(0)
+        , handled(0)
+        , release(false)
+        , tasks()
+    {
+        for (int i = 0; i < 8; ++i) {
+            tasks.emplace_back(i, &destroyed);
+        }
+    }
+
+    /**
+     * Handler that blocks on task 0 until release is set.
+     */
+    Socket::RequestHandler blockingHandler()
+    {
+        return [this](Roo::unique_ptr<ServerTask> task) {
+            if (static_cast<FakeServerTask*>(task.get())->id == 0) {
+                while (!release.load()) {
+                }
+            }
+            handled.fetch_add(1);
+        };
+    }
+
+    std::atomic<int> destroyed;
+    std::atomic<int> handled;
+    std::atomic<bool> release;
+    std::vector<FakeServerTask> tasks;
+};
+
+TEST_F(WorkerPoolTest, constructor)
+{
+    WorkerPool pool(3, blockingHandler(), -1);
+    EXPECT_EQ(3U, pool.size());
+    for (std::size_t i = 0; i < pool.size(); ++i) {
+        EXPECT_TRUE(pool.workers[i].thread.joinable());
+        EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(&pool.workers[i]) %
+                          CacheAligned::CACHE_LINE_SIZE);
+    }
+    std::vector<Perf::WorkerStats> stats;
+    Perf::getWorkerStats(&stats);
+    EXPECT_EQ(3U, stats.size());
+}
+
+TEST_F(WorkerPoolTest, submit)
+{
+    release = true;
+    WorkerPool pool(2, blockingHandler(), -1);
+    for (int i = 0; i < 8; ++i) {
+        pool.submit(&tasks[i]);
+    }
+    while (handled.load() < 8) {
+    }
+    EXPECT_EQ(8, destroyed.load());
+
+    std::vector<Perf::WorkerStats> stats;
+    Perf::getWorkerStats(&stats);
+    ASSERT_EQ(2U, stats.size());
+    EXPECT_EQ(8U, stats[0].tasks + stats[1].tasks);
+    EXPECT_EQ(0U, stats[0].queue_depth + stats[1].queue_depth);
+    EXPECT_LE(1U, stats[0].max_queue_depth);
+}
+
+TEST_F(WorkerPoolTest, steal)
+{
+    WorkerPool pool(2, blockingHandler(), -1);
+    for (int i = 0; i < 3; ++i) {
+        pool.submit(&tasks[i]);
+    }
+
+    // Task 0 blocks one worker; the other must run the rest, including one
+    // queued for the blocked worker.
+    while (handled.load() < 2) {
+    }
+    std::vector<Perf::WorkerStats> stats;
+    Perf::getWorkerStats(&stats);
+    ASSERT_EQ(2U, stats.size());
+    EXPECT_LE(1U, stats[0].steals + stats[1].steals);
+
+    release = true;
+    while (handled.load() < 3) {
+    }
+}
+
+TEST_F(WorkerPoolTest, steal_busiest)
+{
+    WorkerPool pool(3, blockingHandler(), -1);
+    while (pool.sleepers.load() < 3) {
+    }
+
+    // Queue tasks directly so that the sleeping workers are not signaled.
+    int victims[] = {1, 2, 2};
+    for (int i = 0; i < 3; ++i) {
+        WorkerPool::Worker* worker = &pool.workers[victims[i]];
+        worker->tasks.push_back(&tasks[i + 1]);
+        worker->counters.queue_depth.set(worker->tasks.size());
+    }
+
+    ServerTask* task = pool.steal(0);
+    EXPECT_EQ(&tasks[2], task);
+    EXPECT_EQ(1U, pool.workers[2].counters.queue_depth.get());
+    Roo::unique_ptr<ServerTask> discard(task);
+}
+
+TEST_F(WorkerPoolTest, sleep)
+{
+    release = true;
+    WorkerPool pool(1, blockingHandler(), -1);
+    while (pool.sleepers.load() < 1) {
+    }
+    EXPECT_FALSE(pool.hasWork());
+
+    pool.submit(&tasks[1]);
+    while (handled.load() < 1) {
+    }
+    EXPECT_EQ(1, destroyed.load());
+}
+
+TEST_F(WorkerPoolTest, destructor)
+{
+    {
+        WorkerPool pool(1, blockingHandler(), -1);
+        pool.submit(&tasks[0]);
+        while (pool.workers[0].counters.queue_depth.get() != 0) {
+        }
+        pool.submit(&tasks[1]);
+        // Stop the worker before it can run task 1.
+        pool.stop = true;
+        release = true;
+    }
+    EXPECT_EQ(1, handled.load());
+    EXPECT_EQ(2, destroyed.load());
+}
+
+}  // namespace
+}  // namespace Roo
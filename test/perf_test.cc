@@ -0,0 +1,824 @@
+/* Copyright (c) 2020, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <Homa/Drivers/Fake/FakeDriver.h>
+#include <PerfUtils/Cycles.h>
+#include <Roo/Roo.h>
+
+#if defined(__cpp_impl_coroutine)
+#include <Roo/Coroutine.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Bitmap.h"
+#include "MpmcQueue.h"
+#include "RooPCImpl.h"
+#include "SmallMap.h"
+#include "SpscQueue.h"
+#include "docopt.h"
+
+static const char USAGE[] = R"(Roo Performance Test.
+
+    Measures the performance of Roo operations using the fake driver.
+
+    Usage:
+        perf_test [options] [<test>...]
+        perf_test (-h | --help)
+        perf_test --list
+
+    Options:
+        -h --help       Show this screen.
+        --list          List the available tests.
+        --count=<n>     Number of operations per thread [default: 1000000].
+        --threads=<n>   Maximum number of threads to use [default: 16].
+)";
+
+using PerfUtils::Cycles;
+
+/// Number of calls to the global operator new made by this process.
+static std::atomic<uint64_t> allocationCount(0);
+
+void*
+operator new(std::size_t size)
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* ptr = std::malloc(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void
+operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void
+operator delete(void* ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+/**
+ * Parameters that apply to all tests.
+ */
+struct Options {
+    /// Number of operations each thread should perform.
+    uint64_t count;
+
+    /// Maximum number of concurrent threads a test should use.
+    int maxThreads;
+};
+
+/**
+ * A Homa transport and Roo socket pair backed by a fake driver.
+ */
+struct Node {
+    explicit Node(uint64_t id,
+                  const Roo::SocketOptions& options = Roo::SocketOptions(),
+                  bool singleThreaded = false)
+        : id(id)
+        , driver()
+        , transport(Homa::Transport::create(&driver, id))
+        , socket(singleThreaded
+                     ? Roo::Socket::createSingleThreaded(transport, options)
+                     : Roo::Socket::create(transport, options))
+    {}
+
+    ~Node()
+    {
+        socket.reset(nullptr);
+        delete transport;
+    }
+
+    const uint64_t id;
+    Homa::Drivers::Fake::FakeDriver driver;
+    Homa::Transport* transport;
+    std::unique_ptr<Roo::Socket> socket;
+};
+
+/**
+ * Perform a single RooPC from the client to the server, polling both sockets
+ * on the calling thread until the RooPC completes.
+ */
+void
+roundTrip(Node* client, Node* server, const void* request, std::size_t length)
+{
+    Roo::unique_ptr<Roo::RooPC> rpc = client->socket->allocRooPC();
+    rpc->send(server->driver.getLocalAddress(), request, length);
+    while (rpc->checkStatus() == Roo::RooPC::Status::IN_PROGRESS) {
+        server->socket->poll();
+        Roo::unique_ptr<Roo::ServerTask> task = server->socket->receive();
+        if (task) {
+            task->reply(request, length);
+        }
+        client->socket->poll();
+    }
+    rpc->receive();
+}
+
+/**
+ * Run the given function on numThreads threads concurrently and return the
+ * number of cycles elapsed between the start of the first and the end of the
+ * last thread.
+ */
+template <typename Function>
+uint64_t
+runThreads(int numThreads, Function func)
+{
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < numThreads; ++i) {
+        threads.emplace_back([&, i]() {
+            ready.fetch_add(1);
+            while (!go.load()) {
+            }
+            func(i);
+        });
+    }
+    while (ready.load() < numThreads) {
+    }
+    uint64_t start = Cycles::rdtsc();
+    go.store(true);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return Cycles::rdtsc() - start;
+}
+
+/**
+ * Print the result of one run of a thread scaling test.
+ */
+void
+printScaling(int numThreads, uint64_t totalOps, uint64_t cycles,
+             double* baseline)
+{
+    double opsPerSecond = totalOps / Cycles::toSeconds(cycles);
+    if (*baseline == 0) {
+        *baseline = opsPerSecond;
+    }
+    printf("  %3d threads  %8.2f Mops/s  %7.1f ns/op/thread  %5.2fx\n",
+           numThreads, opsPerSecond / 1e6,
+           1e9 * numThreads / opsPerSecond, opsPerSecond / *baseline);
+}
+
+/**
+ * Measure how allocRooPC(), destroying a RooPC, and receive() scale as more
+ * threads share a single Socket.
+ */
+void
+socketScaling(const Options& options)
+{
+    Node node(1);
+    double baseline = 0;
+    for (int numThreads = 1; numThreads <= options.maxThreads;
+         numThreads *= 2) {
+        uint64_t cycles = runThreads(numThreads, [&](int) {
+            for (uint64_t i = 0; i < options.count; ++i) {
+                Roo::unique_ptr<Roo::RooPC> rpc = node.socket->allocRooPC();
+                Roo::unique_ptr<Roo::ServerTask> task = node.socket->receive();
+            }
+        });
+        printScaling(numThreads, numThreads * options.count, cycles,
+                     &baseline);
+    }
+}
+
+/**
+ * Measure the queue that hands incoming requests from the polling thread to
+ * the worker threads calling receive(): one producer thread inserts while N
+ * consumer threads spin trying to remove.
+ */
+void
+pendingTaskContention(const Options& options)
+{
+    for (int numWorkers = 1; numWorkers <= options.maxThreads;
+         numWorkers *= 2) {
+        Roo::MpmcQueue<void*> queue(4096);
+        std::atomic<uint64_t> consumed(0);
+        std::atomic<uint64_t> emptyPops(0);
+        uint64_t producerCycles = 0;
+        uint64_t cycles = runThreads(numWorkers + 1, [&](int id) {
+            if (id == 0) {
+                // Poller
+                uint64_t start = Cycles::rdtsc();
+                for (uint64_t i = 1; i <= options.count; ++i) {
+                    while (!queue.push(reinterpret_cast<void*>(i))) {
+                    }
+                }
+                producerCycles = Cycles::rdtsc() - start;
+            } else {
+                // Worker
+                uint64_t empty = 0;
+                void* element;
+                while (consumed.load(std::memory_order_relaxed) <
+                       options.count) {
+                    if (queue.pop(&element)) {
+                        consumed.fetch_add(1, std::memory_order_relaxed);
+                    } else {
+                        empty++;
+                    }
+                }
+                emptyPops.fetch_add(empty);
+            }
+        });
+        printf("  1 poller %3d workers  %8.2f Mops/s  %6.1f ns/push  "
+               "%10lu empty pops\n",
+               numWorkers, options.count / Cycles::toSeconds(cycles) / 1e6,
+               Cycles::toSeconds(producerCycles) * 1e9 / options.count,
+               emptyPops.load());
+    }
+}
+
+/**
+ * Compare allocating and destroying RooPCs one at a time against doing so in
+ * batches using allocRooPCs() and destroyRooPCs().
+ */
+void
+batchAlloc(const Options& options)
+{
+    Node node(1);
+    const std::size_t maxBatch = 64;
+    Roo::unique_ptr<Roo::RooPC> rpcs[maxBatch];
+    for (std::size_t batch = 1; batch <= maxBatch; batch *= 4) {
+        uint64_t numBatches = options.count / batch;
+        uint64_t start = Cycles::rdtsc();
+        for (uint64_t i = 0; i < numBatches; ++i) {
+            if (batch == 1) {
+                rpcs[0] = node.socket->allocRooPC();
+                rpcs[0].reset();
+            } else {
+                node.socket->allocRooPCs(rpcs, batch);
+                node.socket->destroyRooPCs(rpcs, batch);
+            }
+        }
+        uint64_t cycles = Cycles::rdtsc() - start;
+        printf("  batch %3lu  %7.1f ns/RooPC\n", batch,
+               Cycles::toSeconds(cycles) * 1e9 / (numBatches * batch));
+    }
+}
+
+/**
+ * Branch metadata as tracked by RooPCImpl before SmallMap was introduced.
+ */
+struct BranchState {
+    bool complete;
+    Roo::Proto::RequestId pingReceiverId;
+    Homa::Driver::Address pingAddress;
+    unsigned pingTimeouts;
+};
+
+/**
+ * RooPC completion tracking with the standard containers RooPCImpl used
+ * before; the "before" side of rooPCAllocations.
+ */
+struct StdTracking {
+    void track(Roo::Proto::BranchId branchId, Roo::Proto::ResponseId responseId)
+    {
+        branches.insert({branchId, BranchState()});
+        expectedResponses.insert({responseId, false});
+        expectedResponses.at(responseId) = true;
+        responses.emplace_back();
+        responseQueue.push_back(responses.back().get());
+    }
+
+    std::unordered_map<Roo::Proto::BranchId, BranchState,
+                       Roo::Proto::BranchId::Hasher>
+        branches;
+    std::unordered_map<Roo::Proto::ResponseId, bool,
+                       Roo::Proto::ResponseId::Hasher>
+        expectedResponses;
+    std::deque<Homa::InMessage*> responseQueue;
+    std::deque<Homa::unique_ptr<Homa::InMessage> > responses;
+};
+
+/**
+ * RooPC completion tracking with the containers RooPCImpl uses now; the
+ * "after" side of rooPCAllocations.
+ */
+struct InlineTracking {
+    /// Bitmaps tracking the responses of one task.
+    struct TaskResponses {
+        Roo::Bitmap tracked;
+        Roo::Bitmap received;
+    };
+
+    void track(Roo::Proto::BranchId branchId, Roo::Proto::ResponseId responseId)
+    {
+        branches.insert(branchId, BranchState());
+        TaskResponses* task =
+            expectedResponses.insert(responseId.taskId, TaskResponses()).first;
+        task->tracked.set(responseId.sequence);
+        task->received.set(responseId.sequence);
+        responses.push(Homa::unique_ptr<Homa::InMessage>());
+    }
+
+    static const std::size_t N = Roo::RooPCImpl::INLINE_CAPACITY;
+    Roo::SmallMap<Roo::Proto::BranchId, BranchState, N> branches;
+    Roo::SmallMap<Roo::Proto::TaskId, TaskResponses, N> expectedResponses;
+    Roo::SpscQueue<Homa::unique_ptr<Homa::InMessage>, N> responses;
+};
+
+/**
+ * Return the heap allocations made to track a RooPC with the given number of
+ * branches, each answered by one response from its own task.
+ */
+template <typename Tracking>
+double
+trackingAllocations(uint64_t width, uint64_t count)
+{
+    uint64_t start = allocationCount.load();
+    for (uint64_t i = 0; i < count; ++i) {
+        Tracking tracking;
+        for (uint64_t j = 0; j < width; ++j) {
+            Roo::Proto::TaskId taskId(1, j);
+            tracking.track(Roo::Proto::BranchId(taskId, 0),
+                           Roo::Proto::ResponseId(taskId, 0));
+        }
+    }
+    return double(allocationCount.load() - start) / count;
+}
+
+/**
+ * Report the heap allocations made per single-hop RooPC once the sockets have
+ * warmed up, along with the size of the per-RooPC state.  The completion
+ * tracking containers are also measured on their own next to the standard
+ * containers they replaced.
+ */
+void
+rooPCAllocations(const Options& options)
+{
+    Node client(1);
+    Node server(2);
+    char payload[100] = {};
+    for (int i = 0; i < 1000; ++i) {
+        roundTrip(&client, &server, payload, sizeof(payload));
+    }
+    uint64_t start = allocationCount.load();
+    for (uint64_t i = 0; i < options.count; ++i) {
+        roundTrip(&client, &server, payload, sizeof(payload));
+    }
+    uint64_t allocations = allocationCount.load() - start;
+    printf("  %6.2f allocations/RooPC  sizeof(RooPCImpl) %lu bytes\n",
+           double(allocations) / options.count, sizeof(Roo::RooPCImpl));
+
+    printf("  completion tracking: %lu bytes (std containers %lu bytes)\n",
+           sizeof(InlineTracking), sizeof(StdTracking));
+    uint64_t count = std::max<uint64_t>(options.count / 100, 1);
+    for (uint64_t width = 1; width <= 64; width *= 2) {
+        printf("  width %2lu  %7.2f allocations (std containers %7.2f)\n",
+               width, trackingAllocations<InlineTracking>(width, count),
+               trackingAllocations<StdTracking>(width, count));
+    }
+}
+
+/**
+ * Measure the cost of RooPCs that fan out to many branches; each branch is a
+ * request sent to the same server which replies directly.
+ */
+void
+wideFanOut(const Options& options)
+{
+    Node client(1);
+    Node server(2);
+    char payload[100] = {};
+    Homa::Driver::Address serverAddress = server.driver.getLocalAddress();
+    for (uint64_t width = 1; width <= 2048; width *= 8) {
+        uint64_t numRpcs = std::max<uint64_t>(options.count / width / 100, 1);
+        uint64_t start = Cycles::rdtsc();
+        for (uint64_t i = 0; i < numRpcs; ++i) {
+            Roo::unique_ptr<Roo::RooPC> rpc = client.socket->allocRooPC();
+            for (uint64_t j = 0; j < width; ++j) {
+                rpc->send(serverAddress, payload, sizeof(payload));
+            }
+            while (rpc->checkStatus() == Roo::RooPC::Status::IN_PROGRESS) {
+                server.socket->poll();
+                for (Roo::unique_ptr<Roo::ServerTask> task =
+                         server.socket->receive();
+                     task; task = server.socket->receive()) {
+                    task->reply(payload, sizeof(payload));
+                }
+                client.socket->poll();
+            }
+            while (rpc->receive() != nullptr) {
+            }
+        }
+        uint64_t cycles = Cycles::rdtsc() - start;
+        printf("  width %5lu  %9.1f us/RooPC  %7.1f ns/branch\n", width,
+               Cycles::toSeconds(cycles) * 1e6 / numRpcs,
+               Cycles::toSeconds(cycles) * 1e9 / (numRpcs * width));
+    }
+}
+
+/**
+ * Compare the cost of issuing a fan-out of identical requests with one
+ * RooPC::send() call per branch and with a single RooPC::sendMany() call.
+ * Only the time spent sending is reported.
+ */
+void
+fanOutSend(const Options& options)
+{
+    Node client(1);
+    Node server(2);
+    char payload[100] = {};
+    for (uint64_t width = 8; width <= 512; width *= 8) {
+        std::vector<Homa::Driver::Address> destinations(
+            width, server.driver.getLocalAddress());
+        uint64_t numRpcs = std::max<uint64_t>(options.count / width / 100, 1);
+        for (int many = 0; many < 2; ++many) {
+            uint64_t cycles = 0;
+            for (uint64_t i = 0; i < numRpcs; ++i) {
+                Roo::unique_ptr<Roo::RooPC> rpc = client.socket->allocRooPC();
+                uint64_t start = Cycles::rdtsc();
+                if (many) {
+                    rpc->sendMany(destinations.data(), width, payload,
+                                  sizeof(payload));
+                } else {
+                    for (uint64_t j = 0; j < width; ++j) {
+                        rpc->send(destinations[j], payload, sizeof(payload));
+                    }
+                }
+                cycles += Cycles::rdtsc() - start;
+                while (rpc->checkStatus() == Roo::RooPC::Status::IN_PROGRESS) {
+                    server.socket->poll();
+                    for (Roo::unique_ptr<Roo::ServerTask> task =
+                             server.socket->receive();
+                         task; task = server.socket->receive()) {
+                        task->reply(payload, sizeof(payload));
+                    }
+                    client.socket->poll();
+                }
+            }
+            printf("  width %3lu  %-8s  %7.1f ns/branch\n", width,
+                   many ? "sendMany" : "send",
+                   Cycles::toSeconds(cycles) * 1e9 / (numRpcs * width));
+        }
+    }
+}
+
+/**
+ * Measure single-hop RooPC latency percentiles as client threads are added,
+ * with the client threads polling the socket themselves (cooperative) and
+ * with the socket polled by its own thread.
+ */
+void
+pollerLatency(const Options& options)
+{
+    for (int ownPoller = 0; ownPoller < 2; ++ownPoller) {
+        printf("  %s\n", ownPoller ? "own poller" : "cooperative");
+        Roo::SocketOptions serverOptions;
+        serverOptions.ownPoller = true;
+        Node server(2, serverOptions);
+        server.socket->registerHandler([](Roo::unique_ptr<Roo::ServerTask> t) {
+            char response[100] = {};
+            t->reply(response, sizeof(response));
+        });
+        Roo::SocketOptions clientOptions;
+        clientOptions.ownPoller = ownPoller;
+        Node client(1, clientOptions);
+        Homa::Driver::Address serverAddress = server.driver.getLocalAddress();
+        uint64_t numRpcs = std::max<uint64_t>(options.count / 100, 1);
+
+        // Leave a CPU for each poller.
+        for (int numThreads = 1; numThreads <= options.maxThreads - 2;
+             numThreads *= 2) {
+            std::vector<std::vector<uint64_t>> latencies(numThreads);
+            runThreads(numThreads, [&](int id) {
+                char request[100] = {};
+                latencies[id].reserve(numRpcs);
+                for (uint64_t i = 0; i < numRpcs; ++i) {
+                    uint64_t start = Cycles::rdtsc();
+                    Roo::unique_ptr<Roo::RooPC> rpc =
+                        client.socket->allocRooPC();
+                    rpc->send(serverAddress, request, sizeof(request));
+                    rpc->wait();
+                    rpc->receive();
+                    latencies[id].push_back(Cycles::rdtsc() - start);
+                }
+            });
+            std::vector<uint64_t> all;
+            for (const std::vector<uint64_t>& samples : latencies) {
+                all.insert(all.end(), samples.begin(), samples.end());
+            }
+            std::sort(all.begin(), all.end());
+            printf("    %3d threads  p50 %7.2f us  p99 %7.2f us\n",
+                   numThreads, Cycles::toSeconds(all[all.size() / 2]) * 1e6,
+                   Cycles::toSeconds(all[all.size() * 99 / 100]) * 1e6);
+        }
+    }
+}
+
+/**
+ * Measure the latency to the first response of a RooPC whose handler replies
+ * right away and then keeps working, with the server buffering its last
+ * message (default) and with SocketOptions::eagerSend.
+ */
+void
+eagerSendLatency(const Options& options)
+{
+    const uint64_t workCycles = Cycles::fromMicroseconds(20);
+    for (int eagerSend = 0; eagerSend < 2; ++eagerSend) {
+        Roo::SocketOptions serverOptions;
+        serverOptions.ownPoller = true;
+        serverOptions.eagerSend = eagerSend;
+        Node server(2, serverOptions);
+        server.socket->startWorkers(
+            1,
+            [workCycles](Roo::unique_ptr<Roo::ServerTask> task) {
+                char response[100] = {};
+                task->reply(response, sizeof(response));
+                uint64_t stop = Cycles::rdtsc() + workCycles;
+                while (Cycles::rdtsc() < stop) {
+                }
+            },
+            -1);
+        Node client(1);
+        Homa::Driver::Address serverAddress = server.driver.getLocalAddress();
+        uint64_t numRpcs = std::max<uint64_t>(options.count / 100, 1);
+        char request[100] = {};
+        std::vector<uint64_t> firstResponse;
+        std::vector<uint64_t> completion;
+        firstResponse.reserve(numRpcs);
+        completion.reserve(numRpcs);
+        for (uint64_t i = 0; i < numRpcs; ++i) {
+            uint64_t start = Cycles::rdtsc();
+            Roo::unique_ptr<Roo::RooPC> rpc = client.socket->allocRooPC();
+            rpc->send(serverAddress, request, sizeof(request));
+            while (rpc->receive() == nullptr) {
+                client.socket->poll();
+            }
+            firstResponse.push_back(Cycles::rdtsc() - start);
+            rpc->wait();
+            completion.push_back(Cycles::rdtsc() - start);
+        }
+        std::sort(firstResponse.begin(), firstResponse.end());
+        std::sort(completion.begin(), completion.end());
+        printf("  %-8s  first response p50 %7.2f us  completion p50 %7.2f us\n",
+               eagerSend ? "eager" : "buffered",
+               Cycles::toSeconds(firstResponse[numRpcs / 2]) * 1e6,
+               Cycles::toSeconds(completion[numRpcs / 2]) * 1e6);
+    }
+}
+
+/**
+ * Compare the cost of single-hop RooPCs driven by one thread through
+ * thread-safe sockets and through sockets that skip locking.
+ */
+void
+singleThreadedRooPCs(const Options& options)
+{
+    for (int singleThreaded = 0; singleThreaded < 2; ++singleThreaded) {
+        Node client(1, Roo::SocketOptions(), singleThreaded);
+        Node server(2, Roo::SocketOptions(), singleThreaded);
+        char payload[100] = {};
+        for (int i = 0; i < 1000; ++i) {
+            roundTrip(&client, &server, payload, sizeof(payload));
+        }
+        uint64_t start = Cycles::rdtsc();
+        for (uint64_t i = 0; i < options.count; ++i) {
+            roundTrip(&client, &server, payload, sizeof(payload));
+        }
+        uint64_t cycles = Cycles::rdtsc() - start;
+        printf("  %-15s  %7.1f ns/RooPC\n",
+               singleThreaded ? "single-threaded" : "thread-safe",
+               Cycles::toSeconds(cycles) * 1e9 / options.count);
+    }
+}
+
+/**
+ * Compare the client-side cost of sending requests made of 3 and 5 fragments
+ * when the fragments are first concatenated into a temporary buffer and when
+ * they are passed to RooPC::send() as an iovec array.
+ */
+void
+scatterGatherSend(const Options& options)
+{
+    Node client(1);
+    Node server(2);
+    Homa::Driver::Address serverAddress = server.driver.getLocalAddress();
+    char header[32] = {};
+    char fragment[256] = {};
+    char response[32] = {};
+
+    for (std::size_t numFragments : {3, 5}) {
+        struct iovec fragments[5];
+        std::size_t length = 0;
+        for (std::size_t i = 0; i < numFragments; ++i) {
+            if (i == 0) {
+                fragments[i] = {header, sizeof(header)};
+            } else {
+                fragments[i] = {fragment, sizeof(fragment)};
+            }
+            length += fragments[i].iov_len;
+        }
+        for (int gather = 0; gather < 2; ++gather) {
+            uint64_t cycles = 0;
+            uint64_t allocations = 0;
+            for (uint64_t i = 0; i < options.count; ++i) {
+                Roo::unique_ptr<Roo::RooPC> rpc = client.socket->allocRooPC();
+                uint64_t startAllocations = allocationCount.load();
+                uint64_t start = Cycles::rdtsc();
+                if (gather) {
+                    rpc->send(serverAddress, fragments, numFragments);
+                } else {
+                    std::unique_ptr<char[]> buffer(new char[length]);
+                    char* next = buffer.get();
+                    for (std::size_t j = 0; j < numFragments; ++j) {
+                        std::memcpy(next, fragments[j].iov_base,
+                                    fragments[j].iov_len);
+                        next += fragments[j].iov_len;
+                    }
+                    rpc->send(serverAddress, buffer.get(), length);
+                }
+                cycles += Cycles::rdtsc() - start;
+                allocations += allocationCount.load() - startAllocations;
+                while (rpc->checkStatus() == Roo::RooPC::Status::IN_PROGRESS) {
+                    server.socket->poll();
+                    Roo::unique_ptr<Roo::ServerTask> task =
+                        server.socket->receive();
+                    if (task) {
+                        task->reply(response, sizeof(response));
+                    }
+                    client.socket->poll();
+                }
+            }
+            printf("  %lu fragments %-12s  %7.1f ns/send  %5.2f allocs/send\n",
+                   numFragments, gather ? "iovec" : "concatenated",
+                   Cycles::toSeconds(cycles) * 1e9 / options.count,
+                   double(allocations) / options.count);
+        }
+    }
+}
+
+#if defined(__cpp_impl_coroutine)
+/**
+ * Issue _count_ single-hop RooPCs one after another, each awaited by the
+ * calling coroutine.
+ */
+Roo::Coroutine
+coroutineClient(Roo::CoroutineExecutor* executor, Node* client,
+                Homa::Driver::Address serverAddress, const void* request,
+                std::size_t length, uint64_t count)
+{
+    for (uint64_t i = 0; i < count; ++i) {
+        Roo::unique_ptr<Roo::RooPC> rpc = client->socket->allocRooPC();
+        rpc->send(serverAddress, request, length);
+        co_await executor->complete(rpc.get());
+        rpc->receive();
+    }
+}
+
+/**
+ * Compare single-hop RooPCs awaited by many coroutines on one thread with
+ * RooPCs issued one at a time and waited on in the blocking style.
+ */
+void
+coroutineRooPCs(const Options& options)
+{
+    Node client(1);
+    Node server(2);
+    char payload[100] = {};
+    Homa::Driver::Address serverAddress = server.driver.getLocalAddress();
+    uint64_t numRpcs = std::max<uint64_t>(options.count / 10, 1);
+
+    uint64_t start = Cycles::rdtsc();
+    for (uint64_t i = 0; i < numRpcs; ++i) {
+        roundTrip(&client, &server, payload, sizeof(payload));
+    }
+    uint64_t cycles = Cycles::rdtsc() - start;
+    printf("  blocking             %7.2f us/RooPC\n",
+           Cycles::toSeconds(cycles) * 1e6 / numRpcs);
+
+    for (uint64_t concurrency = 1; concurrency <= 100000; concurrency *= 10) {
+        uint64_t perCoroutine = std::max<uint64_t>(numRpcs / concurrency, 1);
+        Roo::CoroutineExecutor executor(client.socket.get());
+        start = Cycles::rdtsc();
+        for (uint64_t i = 0; i < concurrency; ++i) {
+            executor.spawn(coroutineClient(&executor, &client, serverAddress,
+                                           payload, sizeof(payload),
+                                           perCoroutine));
+        }
+        while (executor.size() > 0) {
+            server.socket->poll();
+            for (Roo::unique_ptr<Roo::ServerTask> task =
+                     server.socket->receive();
+                 task; task = server.socket->receive()) {
+                task->reply(payload, sizeof(payload));
+            }
+            executor.runOnce();
+        }
+        cycles = Cycles::rdtsc() - start;
+        printf("  coroutines %7lu   %7.2f us/RooPC\n", concurrency,
+               Cycles::toSeconds(cycles) * 1e6 / (concurrency * perCoroutine));
+    }
+}
+#endif
+
+/**
+ * Describes a single test.
+ */
+struct TestInfo {
+    /// Name used to select the test on the command line.
+    const char* name;
+    /// Function that runs the test.
+    void (*func)(const Options&);
+    /// Short description of what the test measures.
+    const char* description;
+};
+
+TestInfo tests[] = {
+    {"socketScaling", socketScaling,
+     "allocRooPC()/destroy/receive() throughput as threads are added"},
+    {"pendingTaskContention", pendingTaskContention,
+     "pending request hand-off with 1 poller and N receive() workers"},
+    {"batchAlloc", batchAlloc,
+     "allocRooPC()/destroy cost per RooPC as the batch size grows"},
+    {"rooPCAllocations", rooPCAllocations,
+     "heap allocations and memory footprint per single-hop RooPC"},
+    {"wideFanOut", wideFanOut,
+     "completion cost of RooPCs with 1 to 2048 branches"},
+    {"fanOutSend", fanOutSend,
+     "per-branch cost of fan-out requests with send() vs. sendMany()"},
+    {"pollerLatency", pollerLatency,
+     "RooPC latency with cooperative polling vs. a background poller"},
+    {"eagerSendLatency", eagerSendLatency,
+     "first-response latency of early replies, buffered vs. eager send"},
+    {"singleThreadedRooPCs", singleThreadedRooPCs,
+     "single-hop RooPC cost with thread-safe vs. single-threaded sockets"},
+    {"scatterGatherSend", scatterGatherSend,
+     "send cost of 3 and 5 fragment requests, concatenated vs. iovec"},
+#if defined(__cpp_impl_coroutine)
+    {"coroutineRooPCs", coroutineRooPCs,
+     "coroutine-awaited RooPCs with 1 to 100k in flight vs. blocking wait()"},
+#endif
+};
+
+int
+main(int argc, char* argv[])
+{
+    std::map<std::string, docopt::value> args =
+        docopt::docopt(USAGE, {argv + 1, argv + argc},
+                       true,               // show help if requested
+                       "Roo Perf Test");  // version string
+
+    if (args["--list"].asBool()) {
+        for (const TestInfo& test : tests) {
+            printf("%-24s %s\n", test.name, test.description);
+        }
+        return 0;
+    }
+
+    Options options;
+    options.count = args["--count"].asLong();
+    options.maxThreads = args["--threads"].asLong();
+
+    std::vector<std::string> selected = args["<test>"].asStringList();
+    bool foundTest = false;
+    for (const TestInfo& test : tests) {
+        bool run = selected.empty();
+        for (const std::string& name : selected) {
+            if (name == test.name) {
+                run = true;
+            }
+        }
+        if (run) {
+            foundTest = true;
+            printf("%s: %s\n", test.name, test.description);
+            test.func(options);
+        }
+    }
+    if (!foundTest) {
+        std::cerr << "No matching test found." << std::endl;
+        return 1;
+    }
+    return 0;
+}